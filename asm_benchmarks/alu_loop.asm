@@ -0,0 +1,53 @@
+; Benchmark: tight ALU loop (register only, no memory access besides fetching)
+; Prints the 16 bit result in hex
+.setapc 3
+
+ujmp ::main
+
+.jlabel print_hex
+; Prints r10 as 4 hex digits and a newline, clobbers r4 - r6, idx and acc
+set r5, 16
+set r6, 0xf
+.jlabel __print_hex_digit
+subi r5, 4
+cp r4, r10
+shr r4, r5
+and r4, r6
+set idx, ::hex_digits
+add idx, r4
+gm acc
+set idx, 2
+sm acc
+set r4, 0
+bne r5, r4, ::__print_hex_digit
+set acc, 10
+sm acc
+ret
+
+.jlabel hex_digits
+.string "0123456789ABCDEF"
+
+.jlabel main
+set sp, 0x9000
+set r4, 0
+set r7, 0
+set r9, 1
+set r10, 0
+set r11, 20
+.jlabel outer
+set r6, 0
+.jlabel inner
+add r4, r6
+xor r4, r7
+cp r8, r4
+shl r8, r9
+shr r4, r9
+orr r4, r8
+addi r6, 1
+bne r6, r10, ::inner
+addi r7, 1
+bne r7, r11, ::outer
+cp r10, r4
+calla ::print_hex
+set idx, 0
+sm idx
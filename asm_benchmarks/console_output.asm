@@ -0,0 +1,30 @@
+; Benchmark: console output, prints a 45 byte line 20000 times through the output port
+.setapc 3
+
+ujmp ::main
+
+.jlabel line
+.string "The quick brown fox jumps over the lazy dog.\n"
+.byte 0
+
+.jlabel main
+set sp, 0x9000
+set r7, 0
+set r8, 20000
+set r9, 2
+set r10, 0
+.jlabel next_line
+set r5, ::line
+.jlabel next_char
+cp idx, r5
+gm acc
+beq acc, r10, ::line_done
+cp idx, r9
+sm acc
+addi r5, 1
+ujmp ::next_char
+.jlabel line_done
+addi r7, 1
+bne r7, r8, ::next_line
+set idx, 0
+sm idx
@@ -0,0 +1,62 @@
+; Benchmark: byte copy loop with GM/SM, copies 4 KiB of ROM to RAM 256 times
+; Prints the 16 bit sum of the copied bytes in hex
+.setapc 3
+
+ujmp ::main
+
+.jlabel print_hex
+; Prints r10 as 4 hex digits and a newline, clobbers r4 - r6, idx and acc
+set r5, 16
+set r6, 0xf
+.jlabel __print_hex_digit
+subi r5, 4
+cp r4, r10
+shr r4, r5
+and r4, r6
+set idx, ::hex_digits
+add idx, r4
+gm acc
+set idx, 2
+sm acc
+set r4, 0
+bne r5, r4, ::__print_hex_digit
+set acc, 10
+sm acc
+ret
+
+.jlabel hex_digits
+.string "0123456789ABCDEF"
+
+.jlabel main
+set sp, 0x9000
+set r4, 0x1000
+set r8, 0
+set r9, 256
+.jlabel pass
+set r5, 0x0003
+set r6, 0xa000
+set r7, 0
+.jlabel copy
+cp idx, r5
+gm acc
+cp idx, r6
+sm acc
+addi r5, 1
+addi r6, 1
+addi r7, 1
+bne r7, r4, ::copy
+addi r8, 1
+bne r8, r9, ::pass
+; Sum what was copied
+set r10, 0
+set idx, 0xa000
+set r7, 0
+.jlabel sum
+gm acc
+add r10, acc
+addi idx, 1
+addi r7, 1
+bne r7, r4, ::sum
+calla ::print_hex
+set idx, 0
+sm idx
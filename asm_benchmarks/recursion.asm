@@ -0,0 +1,55 @@
+; Benchmark: stack heavy recursion, naive fib(27) through CALLA/RET and PUSHR/POP
+; Prints fib(27) modulo 0x10000 in hex
+.setapc 3
+
+ujmp ::main
+
+.jlabel print_hex
+; Prints r10 as 4 hex digits and a newline, clobbers r4 - r6, idx and acc
+set r5, 16
+set r6, 0xf
+.jlabel __print_hex_digit
+subi r5, 4
+cp r4, r10
+shr r4, r5
+and r4, r6
+set idx, ::hex_digits
+add idx, r4
+gm acc
+set idx, 2
+sm acc
+set r4, 0
+bne r5, r4, ::__print_hex_digit
+set acc, 10
+sm acc
+ret
+
+.jlabel hex_digits
+.string "0123456789ABCDEF"
+
+.jlabel fib
+; r5 = fib(r4), keeps r4, clobbers r6
+lti r4, 2
+cjmp ::__fib_small
+pushr r4
+subi r4, 1
+calla ::fib
+pushr r5
+subi r4, 1
+calla ::fib
+pop r6
+add r5, r6
+pop r4
+ret
+.jlabel __fib_small
+cp r5, r4
+ret
+
+.jlabel main
+set sp, 0x9000
+set r4, 27
+calla ::fib
+cp r10, r5
+calla ::print_hex
+set idx, 0
+sm idx
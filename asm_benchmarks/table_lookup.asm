@@ -0,0 +1,73 @@
+; Benchmark: variables kept in memory with SETRA/SETAR and byte table lookups
+; A 16 bit LCG indexes a 256 byte table (the start of the ROM), the looked up bytes are mixed into a checksum
+; Prints the checksum in hex
+.setapc 3
+
+ujmp ::main
+
+.jlabel print_hex
+; Prints r10 as 4 hex digits and a newline, clobbers r4 - r6, idx and acc
+set r5, 16
+set r6, 0xf
+.jlabel __print_hex_digit
+subi r5, 4
+cp r4, r10
+shr r4, r5
+and r4, r6
+set idx, ::hex_digits
+add idx, r4
+gm acc
+set idx, 2
+sm acc
+set r4, 0
+bne r5, r4, ::__print_hex_digit
+set acc, 10
+sm acc
+ret
+
+.jlabel hex_digits
+.string "0123456789ABCDEF"
+
+.jlabel main
+set sp, 0x9000
+set r4, 1
+setar 0x9100, r4
+set r4, 0
+setar 0x9102, r4
+setar 0x9104, r4
+setar 0x9106, r4
+set r8, 75
+set r9, 0xff
+set r11, 8
+.jlabel loop
+; state = state * 75 + 74
+setra r4, 0x9100
+mul r4, r8
+addi r4, 74
+setar 0x9100, r4
+; sum = (sum + table[state >> 8]) ^ state
+cp r5, r4
+shr r5, r11
+and r5, r9
+set idx, 3
+add idx, r5
+gm r6
+setra r7, 0x9102
+add r7, r6
+xor r7, r4
+setar 0x9102, r7
+; count 16 x 65536 iterations
+setra r7, 0x9104
+addi r7, 1
+setar 0x9104, r7
+set r5, 0
+bne r7, r5, ::loop
+setra r7, 0x9106
+addi r7, 1
+setar 0x9106, r7
+lti r7, 16
+cjmp ::loop
+setra r10, 0x9102
+calla ::print_hex
+set idx, 0
+sm idx
@@ -28,6 +28,7 @@
 
 import sys
 import re
+import json
 
 
 # Types of NEC16 opcodes
@@ -41,9 +42,15 @@ import re
 # 8: EOPS NOP opcode
 # 9: SE IMMVAL/ADDR opcode
 # 10: SE REG opcode
-# 11: SE no-parameter opcode (RET)
+# 11: SE no-parameter opcode (RET, HLT)
 # 12: ME ADDR<-REG opcode
 # 13: ME REG<-[ADDR] opcode
+# 14: ME block opcode (dst, src/fill, length registers)
+# 15: ME word load opcode (reg, base reg, signed 12 bit offset)
+# 16: ME word store opcode (base reg, signed 12 bit offset, reg)
+# 17: EOPS regB cond IMMVAL opcode (compare with immediate)
+# 18: EOPS regBC IMMVAL opcode (compare and branch, a third value of 1 swaps the registers)
+# 19: ME atomic exchange opcode (value, address registers), CAS is type 14 (value, address, expected registers)
 
 opcodes = {
     "nop": [8, 0],
@@ -55,14 +62,33 @@ opcodes = {
     "cp": [7, 6],
     "swap": [7, 7],
     "ujmp": [5, 8],
+    "addi": [6, 10],
+    "subi": [6, 11],
+    "eqi": [17, 12, 1],
+    "gti": [17, 12, 2],
+    "lti": [17, 12, 3],
+    "beq": [18, 13, 0],
+    "bne": [18, 14, 0],
+    "blt": [18, 15, 0],
+    "bgt": [18, 15, 1],
     "pushi": [9, 0],
     "pushr": [10, 1],
     "pop": [10, 2],
     "callr": [10, 4],
     "calla": [9, 3],
     "ret": [11, 5],
+    "hlt": [11, 8],
     "setar": [12, 6],
     "setra": [13, 7],
+    "memcpy": [14, 9, 0],
+    "memset": [14, 9, 1],
+    "memcmp": [14, 9, 2],
+    "xchg": [19, 14, 0],
+    "cas": [14, 14, 1],
+    "ldw": [15, 10],
+    "stw": [16, 11],
+    "ldwp": [15, 12],
+    "stwp": [16, 13],
     "jmp": [3, 1],
     "gm": [3, 2],
     "sm": [3, 3],
@@ -106,14 +132,88 @@ reg = {
     "sb": 12
 }
 
+GM_NEC16_CONDRES = 2
+GM_NEC16_SP = 13
+GM_NEC16_PC = 15
+
+# Static cost of each opcode on the reference core
+# [instructions, bus accesses, bus accesses per byte of a block length]
+# Every instruction is fetched with 2 bus reads, immediate values need 2 more
+costs = {
+    "nop": [1, 2, 0],
+    "eq": [1, 2, 0],
+    "gt": [1, 2, 0],
+    "lt": [1, 2, 0],
+    "set": [1, 4, 0],
+    "cjmp": [1, 4, 0],
+    "cp": [1, 2, 0],
+    "swap": [1, 2, 0],
+    "ujmp": [1, 4, 0],
+    "addi": [1, 4, 0],
+    "subi": [1, 4, 0],
+    "eqi": [1, 4, 0],
+    "gti": [1, 4, 0],
+    "lti": [1, 4, 0],
+    "beq": [1, 4, 0],
+    "bne": [1, 4, 0],
+    "blt": [1, 4, 0],
+    "bgt": [1, 4, 0],
+    "pushi": [1, 6, 0],
+    "pushr": [1, 4, 0],
+    "pop": [1, 4, 0],
+    "callr": [1, 4, 0],
+    "calla": [1, 6, 0],
+    "ret": [1, 4, 0],
+    "hlt": [1, 2, 0],
+    "setar": [1, 6, 0],
+    "setra": [1, 6, 0],
+    "memcpy": [1, 4, 2],
+    "memset": [1, 4, 1],
+    "memcmp": [1, 4, 2],
+    "xchg": [1, 6, 0],
+    "cas": [1, 6, 0],
+    "ldw": [1, 6, 0],
+    "stw": [1, 6, 0],
+    "ldwp": [1, 6, 0],
+    "stwp": [1, 6, 0],
+    "jmp": [1, 2, 0],
+    "gm": [1, 3, 0],
+    "sm": [1, 3, 0],
+    "or": [1, 2, 0],
+    "orr": [1, 2, 0],
+    "and": [1, 2, 0],
+    "xor": [1, 2, 0],
+    "not": [1, 2, 0],
+    "shl": [1, 2, 0],
+    "shr": [1, 2, 0],
+    "add": [1, 2, 0],
+    "sub": [1, 2, 0],
+    "mul": [1, 2, 0],
+    "div": [1, 2, 0],
+    "mod": [1, 2, 0]
+}
+
+# Control flow of opcodes for the cost report
+# Branches take a label as their last argument, stops never fall through (hlt does, it resumes at the next instruction)
+branch_ops = ["cjmp", "ujmp", "beq", "bne", "blt", "bgt"]
+call_ops = ["calla"]
+stop_ops = ["ujmp", "ret"]
+
 ln = 0
 pc = 0
 fpc = 0
 
 bin_code = []
 
+# Everything that got assembled, in source order (used by the cost report)
+# kind is "instr", "data" or "label", tok holds the instruction without comments
+asm_items = []
+
+def record_item(kind, item_pc, item_fpc, tok):
+    asm_items.append({"kind": kind, "ln": ln, "pc": item_pc, "fpc": item_fpc, "size": fpc - item_fpc, "tok": tok})
+
 def make_binary_file():
-    with open(sys.argv[2], "wb") as bfile:
+    with open(asm_args[1], "wb") as bfile:
         bfile.close()
 
 def writebin(b):
@@ -128,15 +228,24 @@ def swritebin(b, addr):
         addr_index += 1
 
 
-if len(sys.argv) < 3:
-    print("Usage: <assembler> <input assembly file> <output binary file> [starting pc count]")
+asm_options = {}
+asm_args = []
+for arg in sys.argv[1:]:
+    if arg[0:2] == "--":
+        opt = arg[2:].split("=", 1)
+        asm_options[opt[0]] = opt[1] if len(opt) == 2 else ""
+    else:
+        asm_args.append(arg)
+
+if len(asm_args) < 2:
+    print("Usage: <assembler> <input assembly file> <output binary/object file> [starting pc count] [--object] [--optimize] [--cost-report=<report file or ->] [--map=<map file>]")
     sys.exit()
 
 make_binary_file()
 
 def asm_error(error_msg):
     print("Assembly Error:", error_msg, "<line", str(ln) + ">")
-    sys.exit()
+    sys.exit(1)
 
 def convert_num_2(n):
     n = n.strip()
@@ -153,9 +262,41 @@ def convert_num_2(n):
     else:
         return int(n, 10)
 
+def convert_offset_12(n):
+    n = n.strip()
+    if len(n) >= 1 and n[0] == "-":
+        off = -convert_num_2(n[1:])
+    else:
+        off = convert_num_2(n)
+    if off > 2047 or off < -2048:
+        asm_error("Offsets must be in the range -2048 to 2047")
+    return off & 0xfff
+
 labels = {}
 reqlabels_to_fix = {}
 
+# Address map (--map), one line per label and per assembled source line
+# Used by gmnec16layout.py to match profiled PCs back to source lines
+def write_map(map_name):
+    with open(map_name, "w") as map_file:
+        for item in asm_items:
+            if item["kind"] == "label":
+                map_file.write("0x%04x label %s\n" % (item["pc"], item["tok"][1]))
+            else:
+                map_file.write("0x%04x line %d %d\n" % (item["pc"], item["ln"], item["size"]))
+
+# Relocatable object output (--object)
+# Sections are slices of bin_code, a section starts at every .section and .setapc
+# base is None for sections the linker places and the address for .setapc sections
+object_mode = "object" in asm_options
+sections = []
+label_sections = {}
+global_labels = []
+label_refs = []
+
+def start_section(name, base):
+    sections.append({"name": name, "base": base, "fpc": fpc})
+
 def convert_num(n, immval_offset, num_bytes):
     n = n.strip()
     if n == "":
@@ -168,13 +309,14 @@ def convert_num(n, immval_offset, num_bytes):
         if n[0:2] == "0o":
             return int(n, 8)
         if n[0:2] == "::":
+            label_refs.append([fpc + immval_offset, num_bytes, n[2:]])
             label_present = n[2:] in labels
             if label_present is True:
                 return labels[n[2:]]
             else:
                 reqlabel_present0 = n[2:] in reqlabels_to_fix
                 if reqlabel_present0:
-                    reqlabels_to_fix[n[2:]][len(reqlabels_to_fix[n[2:]])] = [fpc + immval_offset, num_bytes]
+                    reqlabels_to_fix[n[2:]].append([fpc + immval_offset, num_bytes])
                 else:
                     reqlabels_to_fix[n[2:]] = [[fpc + immval_offset, num_bytes]]
                 return 0
@@ -183,12 +325,314 @@ def convert_num(n, immval_offset, num_bytes):
     else:
         return int(n, 10)
     
-if sys.argv.__len__() >= 4:
-    pc = convert_num_2(sys.argv[3])
+def item_cost(item):
+    return costs[item["tok"][0]]
 
-with open(sys.argv[1], "r") as asmf:
-    for u_asmline in asmf:
-        ln += 1
+def add_cost(total, c):
+    return [total[0] + c[0], total[1] + c[1], total[2] + c[2]]
+
+def format_cost(c):
+    bus = str(c[1])
+    if c[2] != 0:
+        bus += "+" + str(c[2]) + "n"
+    return str(c[0]) + " instrs, " + bus + " bus"
+
+def item_target(item):
+    arg = item["tok"][-1]
+    if arg[0:2] == "::":
+        return arg[2:]
+    return None
+
+def item_index_of_label(name):
+    for i in range(len(asm_items)):
+        if asm_items[i]["kind"] == "label" and asm_items[i]["tok"][1] == name:
+            return i
+    return None
+
+def straight_line(start_index):
+    # Follow the fall-through path, taking no branches, until control can't fall through
+    total = [0, 0, 0]
+    calls = []
+    next_pc = asm_items[start_index]["pc"]
+    for item in asm_items[start_index:]:
+        if item["kind"] == "data" or item["pc"] != next_pc:
+            break
+        if item["kind"] == "instr":
+            total = add_cost(total, item_cost(item))
+            if item["tok"][0] in call_ops and item_target(item) is not None:
+                calls.append(item_target(item))
+            if item["tok"][0] in stop_ops:
+                break
+        next_pc = item["pc"] + item["size"]
+    return total, calls
+
+def inclusive_cost(name, visiting):
+    start = item_index_of_label(name)
+    if start is None or name in visiting:
+        return [0, 0, 0]
+    total, calls = straight_line(start)
+    for callee in calls:
+        total = add_cost(total, inclusive_cost(callee, visiting + [name]))
+    return total
+
+def write_cost_report(report_name):
+    lines = ["; NEC16 static cost report for " + asm_args[0],
+             "; costs are for the reference core, n is the length of a block instruction",
+             "; straight-line costs take no branches, inclusive costs add the straight-line cost of calls", ""]
+
+    functions = []
+    for item in asm_items:
+        if item["kind"] == "instr" and item["tok"][0] in call_ops and item_target(item) is not None:
+            if not item_target(item) in functions:
+                functions.append(item_target(item))
+
+    lines.append("[labels]")
+    for i in range(len(asm_items)):
+        item = asm_items[i]
+        if item["kind"] != "label":
+            continue
+        total, calls = straight_line(i)
+        kind = "function" if item["tok"][1] in functions else "label"
+        line = "0x%04x %s %s: %s" % (item["pc"], kind, item["tok"][1], format_cost(total))
+        if len(calls) > 0:
+            line += " (inclusive " + format_cost(inclusive_cost(item["tok"][1], [])) + ")"
+        lines.append(line)
+
+    lines.append("")
+    lines.append("[loops]")
+    for item in asm_items:
+        if item["kind"] != "instr" or not item["tok"][0] in branch_ops:
+            continue
+        target = item_target(item)
+        if target is None or not target in labels or labels[target] > item["pc"]:
+            continue
+        body = [0, 0, 0]
+        for body_item in asm_items:
+            if body_item["kind"] == "instr" and body_item["pc"] >= labels[target] and body_item["pc"] <= item["pc"]:
+                body = add_cost(body, item_cost(body_item))
+        lines.append("0x%04x-0x%04x loop %s (%s at line %d): %s per iteration" % (labels[target], item["pc"] + item["size"] - 1, target, item["tok"][0], item["ln"], format_cost(body)))
+
+    lines.append("")
+    lines.append("[calls]")
+    # A call target, or a label that can't be reached by falling through code, starts a new routine
+    caller = "<entry>"
+    next_pc = None
+    after_code = False
+    for item in asm_items:
+        if item["kind"] == "label":
+            if item["tok"][1] in functions or not after_code or item["pc"] != next_pc:
+                caller = item["tok"][1]
+            continue
+        # Like straight_line, control doesn't fall through past a stop instruction
+        after_code = item["kind"] == "instr" and not item["tok"][0] in stop_ops
+        next_pc = item["pc"] + item["size"]
+        if item["kind"] != "instr" or not item["tok"][0] in call_ops:
+            continue
+        callee = item_target(item)
+        if callee is None:
+            continue
+        lines.append("%s -> %s (line %d): %s" % (caller, callee, item["ln"], format_cost(inclusive_cost(callee, []))))
+
+    report = "\n".join(lines) + "\n"
+    if report_name == "" or report_name == "-":
+        print(report, end="")
+    else:
+        with open(report_name, "w") as report_file:
+            report_file.write(report)
+
+# Registers written by an instruction, None when it may write any register
+def instr_writes(tok):
+    op = tok[0]
+    if op in ["calla", "callr", "ret"]:
+        return None
+    if op in ["eq", "gt", "lt", "eqi", "gti", "lti", "memcmp"]:
+        return [GM_NEC16_CONDRES]
+    if op in ["pushi", "pushr"]:
+        return [GM_NEC16_SP]
+    if op == "pop":
+        return [reg[tok[1]], GM_NEC16_SP]
+    if op == "swap" or op == "ldwp":
+        return [reg[tok[1]], reg[tok[2]]]
+    if op == "cas":
+        return [reg[tok[3]], GM_NEC16_CONDRES]
+    if op == "stwp":
+        return [reg[tok[1]]]
+    if op in ["cp", "set", "addi", "subi", "setra", "ldw", "gm", "or", "not", "xchg"] or opcodes[op][0] == 2:
+        return [reg[tok[1]]]
+    return []
+
+def const_value(n):
+    if n[0:2] == "::":
+        return n
+    return convert_num_2(n)
+
+# Peephole optimizer, works on the source and returns new source lines
+# The optimized source is assembled again, so every label and fixup is resolved for the new layout
+def optimize(source_lines):
+    global ln
+    entries = []
+    for ln, u_asmline in source_lines:
+        asmline = u_asmline.strip()
+        if asmline == "" or asmline[0] == ";":
+            continue
+        if asmline[0] == ".":
+            dtok = [tok for tok in asmline.split(" ") if tok != '']
+            if dtok[0] == ".jlabel" and len(dtok) == 2:
+                entries.append({"ln": ln, "kind": "label", "tok": dtok, "text": asmline})
+            else:
+                entries.append({"ln": ln, "kind": "other", "tok": dtok, "text": asmline})
+            continue
+        tok = []
+        for t in [t for t in re.split(r'[, ]', asmline) if t != '']:
+            if t[0] == ";":
+                break
+            tok.append(t)
+        tok[0] = tok[0].lower()
+        entries.append({"ln": ln, "kind": "instr", "tok": tok, "text": asmline})
+
+    changed = True
+    while changed:
+        changed = False
+        label_index = {}
+        for i in range(len(entries)):
+            if entries[i]["kind"] == "label":
+                label_index[entries[i]["tok"][1]] = i
+
+        def next_instr(i):
+            while i < len(entries) and entries[i]["kind"] == "label":
+                i += 1
+            return i
+
+        # Thread jumps that land on an unconditional jump
+        for entry in entries:
+            tok = entry["tok"]
+            if entry["kind"] != "instr" or not (tok[0] in branch_ops or tok[0] in call_ops) or tok[-1][0:2] != "::":
+                continue
+            target = tok[-1][2:]
+            seen = [target]
+            while target in label_index:
+                k = next_instr(label_index[target] + 1)
+                if k >= len(entries) or entries[k]["kind"] != "instr" or entries[k]["tok"][0] != "ujmp":
+                    break
+                if entries[k]["tok"][1][0:2] != "::" or entries[k]["tok"][1][2:] in seen:
+                    break
+                target = entries[k]["tok"][1][2:]
+                seen.append(target)
+            if "::" + target != tok[-1]:
+                tok[-1] = "::" + target
+                changed = True
+
+        optimized = []
+        known = {}
+        for i in range(len(entries)):
+            entry = entries[i]
+            tok = entry["tok"]
+            if entry["kind"] != "instr":
+                # Labels are join points and directives may be data, forget what we know
+                known = {}
+                optimized.append(entry)
+                continue
+            op = tok[0]
+            remove = False
+
+            # Branch to the label right after the branch
+            if (op in branch_ops) and tok[-1][0:2] == "::":
+                k = i + 1
+                while k < len(entries) and entries[k]["kind"] == "label":
+                    if entries[k]["tok"][1] == tok[-1][2:]:
+                        remove = True
+                    k += 1
+
+            if op == "set" and reg[tok[1]] != GM_NEC16_PC:
+                value = const_value(tok[2])
+                if known.get(reg[tok[1]]) == value:
+                    remove = True
+                known[reg[tok[1]]] = value
+            elif op == "cp":
+                rA = reg[tok[1]]
+                rB = reg[tok[2]]
+                prev = optimized[-1] if len(optimized) > 0 else None
+                if rA == rB:
+                    remove = True
+                elif prev is not None and prev["kind"] == "instr" and prev["tok"][0] == "cp" and reg[prev["tok"][1]] == rB and reg[prev["tok"][2]] == rA:
+                    remove = True
+                elif rB in known:
+                    known[rA] = known[rB]
+                else:
+                    known.pop(rA, None)
+            else:
+                writes = instr_writes(tok)
+                if writes is None or GM_NEC16_PC in writes:
+                    known = {}
+                else:
+                    for r in writes:
+                        known.pop(r, None)
+            # Registers may change while a hlt waits, forget them like after a stop
+            if op in stop_ops or op == "hlt" or (op == "set" and reg[tok[1]] == GM_NEC16_PC):
+                known = {}
+
+            if remove:
+                changed = True
+            else:
+                optimized.append(entry)
+        entries = optimized
+
+    new_lines = []
+    for entry in entries:
+        if entry["kind"] == "instr":
+            new_lines.append([entry["ln"], entry["tok"][0] + " " + ", ".join(entry["tok"][1:])])
+        elif entry["kind"] == "label":
+            new_lines.append([entry["ln"], ".jlabel " + entry["tok"][1]])
+        else:
+            new_lines.append([entry["ln"], entry["text"]])
+    return new_lines
+
+def section_end(index):
+    if index + 1 < len(sections):
+        return sections[index + 1]["fpc"]
+    return len(bin_code)
+
+def write_object(object_name):
+    obj = {"format": "gmnec16-object", "version": 1, "source": asm_args[0], "sections": [], "symbols": [], "relocs": []}
+    for i in range(len(sections)):
+        sec = sections[i]
+        obj["sections"].append({"name": sec["name"], "base": sec["base"], "data": bytes(bin_code[sec["fpc"]:section_end(i)]).hex()})
+    for name in global_labels:
+        if not name in labels:
+            asm_error("Global label \"" + name + "\" is not defined")
+    for name in labels:
+        sec = sections[label_sections[name]]
+        offset = labels[name] - (sec["base"] if sec["base"] is not None else 0)
+        obj["symbols"].append({"name": name, "section": label_sections[name], "offset": offset, "global": name in global_labels})
+    for ref in label_refs:
+        for i in range(len(sections)):
+            if ref[0] >= sections[i]["fpc"] and ref[0] < section_end(i):
+                obj["relocs"].append({"section": i, "offset": ref[0] - sections[i]["fpc"], "size": ref[1], "symbol": ref[2]})
+                break
+    with open(object_name, "w") as object_file:
+        json.dump(obj, object_file, indent=1)
+        object_file.write("\n")
+
+start_pc = 0
+if asm_args.__len__() >= 3:
+    start_pc = convert_num_2(asm_args[2])
+
+# Assemble a list of [line number, source line] pairs
+def assemble(source_lines):
+    global ln, pc, fpc
+    pc = start_pc
+    fpc = 0
+    bin_code.clear()
+    labels.clear()
+    reqlabels_to_fix.clear()
+    asm_items.clear()
+    sections.clear()
+    label_sections.clear()
+    global_labels.clear()
+    label_refs.clear()
+    if object_mode:
+        start_section("text", start_pc if asm_args.__len__() >= 3 else None)
+    for ln, u_asmline in source_lines:
         asmline = u_asmline.strip()
         if asmline == "":
             continue
@@ -206,14 +650,24 @@ with open(sys.argv[1], "r") as asmf:
                     writebin([n])
                     pc += 1
                     fpc += 1
+                    record_item("data", pc - 1, fpc - 1, dtok)
                 if dtok[0] == ".setapc":
                     pc = convert_num_2(dtok[1])
+                    if object_mode:
+                        start_section("text", pc)
+                if dtok[0] == ".section" and object_mode:
+                    pc = 0
+                    start_section(dtok[1], None)
+                if dtok[0] == ".global":
+                    global_labels.append(dtok[1])
                 if dtok[0] == ".jlabel":
                     reqlabel_present = dtok[1] in reqlabels_to_fix
                     if reqlabel_present:
                         for i in reqlabels_to_fix[dtok[1]]:
                             swritebin(pc.to_bytes(i[1], 'little', signed=False), i[0])
                     labels[dtok[1]] = pc
+                    label_sections[dtok[1]] = len(sections) - 1
+                    record_item("label", pc, fpc, dtok)
             if len(dtok) >= 2:
                 if dtok[0] == ".string":
                     mdtok = dtok.copy()
@@ -224,15 +678,16 @@ with open(sys.argv[1], "r") as asmf:
                     writebin(bytes(mstr, "ascii"))
                     pc += len(mstr_arr)
                     fpc += len(mstr_arr)
+                    record_item("data", pc - len(mstr_arr), fpc - len(mstr_arr), dtok)
             continue
-        asmtok = re.split(r'[, ]', asmline)
-        if '' in asmtok:
-            asmtok.remove('')
+        asmtok = [tok for tok in re.split(r'[, ]', asmline) if tok != '']
         asm_instr_available = asmtok[0].lower() in opcodes
         if asm_instr_available is False:
             asm_error("Invalid instruction \"" + asmtok[0] + "\"")
 
         instr_info = opcodes[asmtok[0].lower()]
+        instr_pc = pc
+        instr_fpc = fpc
 
         if instr_info[0] == 2:
             if asmtok.__len__() >= 3:
@@ -391,6 +846,130 @@ with open(sys.argv[1], "r") as asmf:
                 fpc += 4
             else:
                 asm_error("1 immediate value/address are needed for this instruction type")
+        if instr_info[0] == 14:
+            if asmtok.__len__() >= 4:
+                if asmtok.__len__() > 4:
+                    if asmtok[4][0] != ";":
+                        asm_error("Additional arguments to this instruction type are not allowed")
+                for rtok in asmtok[1:4]:
+                    if not rtok in reg:
+                        asm_error("Invalid register \"" + rtok + "\"")
+                rA = reg[asmtok[1]]
+                rB = reg[asmtok[2]]
+                rC = reg[asmtok[3]]
+                writebin([9, (instr_info[1] << 4) | rA, (rB << 4) | rC, instr_info[2]])
+                pc += 4
+                fpc += 4
+            else:
+                asm_error("3 registers are needed for this instruction type")
+        if instr_info[0] == 19:
+            if asmtok.__len__() >= 3:
+                if asmtok.__len__() > 3:
+                    if asmtok[3][0] != ";":
+                        asm_error("Additional arguments to this instruction type are not allowed")
+                for rtok in asmtok[1:3]:
+                    if not rtok in reg:
+                        asm_error("Invalid register \"" + rtok + "\"")
+                rA = reg[asmtok[1]]
+                rB = reg[asmtok[2]]
+                writebin([9, (instr_info[1] << 4) | rA, rB << 4, instr_info[2]])
+                pc += 4
+                fpc += 4
+            else:
+                asm_error("2 registers are needed for this instruction type")
+        if instr_info[0] == 15 or instr_info[0] == 16:
+            if asmtok.__len__() >= 3:
+                # The offset may be left out
+                if asmtok.__len__() == 3 or asmtok[3][0] == ";":
+                    if instr_info[0] == 15:
+                        asmtok.insert(3, "0")
+                    else:
+                        asmtok.insert(2, "0")
+                if asmtok.__len__() > 4:
+                    if asmtok[4][0] != ";":
+                        asm_error("Additional arguments to this instruction type are not allowed")
+                if instr_info[0] == 15:
+                    rA_tok = asmtok[1]
+                    rbase_tok = asmtok[2]
+                    off_tok = asmtok[3]
+                else:
+                    rbase_tok = asmtok[1]
+                    off_tok = asmtok[2]
+                    rA_tok = asmtok[3]
+                if not rA_tok in reg:
+                    asm_error("Invalid register \"" + rA_tok + "\"")
+                if not rbase_tok in reg:
+                    asm_error("Invalid register \"" + rbase_tok + "\"")
+                rA = reg[rA_tok]
+                rbase = reg[rbase_tok]
+                off = convert_offset_12(off_tok)
+                writebin([9, (instr_info[1] << 4) | rA, (rbase << 4) | (off >> 8), off & 0xff])
+                pc += 4
+                fpc += 4
+            else:
+                asm_error("1 register, 1 base register and an optional offset are needed for this instruction type")
+        if instr_info[0] == 17:
+            if asmtok.__len__() >= 3:
+                if asmtok.__len__() > 3:
+                    if asmtok[3][0] != ";":
+                        asm_error("Additional arguments to this instruction type are not allowed")
+                rA_present = asmtok[1] in reg
+                if rA_present == False:
+                    asm_error("Invalid register \"" + asmtok[1] + "\"")
+                rA = reg[asmtok[1]]
+                immval = convert_num(asmtok[2], 2, 2).to_bytes(2, 'little', signed=False)
+                writebin([instr_info[1], (rA << 4) | instr_info[2], immval[0], immval[1]])
+                pc += 4
+                fpc += 4
+            else:
+                asm_error("1 register and an immediate value are needed for this instruction type")
+        if instr_info[0] == 18:
+            if asmtok.__len__() >= 4:
+                if asmtok.__len__() > 4:
+                    if asmtok[4][0] != ";":
+                        asm_error("Additional arguments to this instruction type are not allowed")
+                rA_present = asmtok[1] in reg
+                rB_present = asmtok[2] in reg
+                if rA_present == False:
+                    asm_error("Invalid register \"" + asmtok[1] + "\"")
+                if rB_present == False:
+                    asm_error("Invalid register \"" + asmtok[2] + "\"")
+                rA = reg[asmtok[1]]
+                rB = reg[asmtok[2]]
+                if instr_info[2] == 1:
+                    rA, rB = rB, rA
+                immval = convert_num(asmtok[3], 2, 2).to_bytes(2, 'little', signed=False)
+                writebin([instr_info[1], (rA << 4) | rB, immval[0], immval[1]])
+                pc += 4
+                fpc += 4
+            else:
+                asm_error("2 registers and an immediate value/address are needed for this instruction type")
+
+        instr_tok = [asmtok[0].lower()]
+        for tok in asmtok[1:]:
+            if tok[0] == ";":
+                break
+            instr_tok.append(tok)
+        record_item("instr", instr_pc, instr_fpc, instr_tok)
+
+source_lines = []
+with open(asm_args[0], "r") as asmf:
+    for u_asmline in asmf:
+        ln += 1
+        source_lines.append([ln, u_asmline])
+
+assemble(source_lines)
+if "optimize" in asm_options:
+    assemble(optimize(source_lines))
+
+if object_mode:
+    write_object(asm_args[1])
+else:
+    with open(asm_args[1], "wb") as bin_file:
+        bin_file.write(bytearray(bin_code))
+
+if "cost-report" in asm_options:
+    write_cost_report(asm_options["cost-report"])
 
-with open(sys.argv[2], "wb") as bin_file:
-    bin_file.write(bytearray(bin_code))
+if "map" in asm_options:
+    write_map(asm_options["map"])
@@ -0,0 +1,181 @@
+#!/usr/bin/python3
+
+# Memory heatmap and working set report for NEC 16 programs
+
+#
+#
+# Copyright (c) 2022 GalaxianMonster
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+#
+
+import sys
+import math
+
+# Usage:
+#   gmnec16asm.py prog.asm prog.bin 3 --map=prog.map
+#   tios prog.bin --heatmap=prog.heat [--heatmap-window=<instructions>]
+#   gmnec16heat.py prog.heat [prog.map] [--top=<labels>]
+#
+# The heatmap shows every 64 byte line of the address space, one row per KiB, hotter lines
+# get denser characters. The kind map marks lines that were executed (x), written (w) or
+# only read (r). Without a map the per-label summary is left out, a label covers every
+# address up to the next label (the last one up to the end of the image).
+
+LINE_SIZE = 64
+PAGE_SIZE = 256
+RAM_START = 32 * 1024 + 3
+SHADES = " .:-=+*#%@"
+
+def heat_error(error_msg):
+    print("Heatmap Error:", error_msg)
+    sys.exit(1)
+
+def convert_num_2(n):
+    n = n.strip()
+    if len(n) >= 2:
+        if n[0:2] == "0x":
+            return int(n, 16)
+        if n[0:2] == "0b":
+            return int(n, 2)
+        if n[0:2] == "0o":
+            return int(n, 8)
+    return int(n, 10)
+
+def load_heatmap(heat_name):
+    counts = {}
+    windows = []
+    ram_exec = {}
+    window_len = 0
+    try:
+        with open(heat_name, "r") as heat_file:
+            for line in heat_file:
+                tok = line.split()
+                if len(tok) == 2 and tok[0] == "window":
+                    window_len = int(tok[1])
+                if len(tok) == 5 and tok[0] == "addr":
+                    counts[convert_num_2(tok[1])] = (int(tok[2]), int(tok[3]), int(tok[4]))
+                if len(tok) == 4 and tok[0] == "ws":
+                    windows.append((int(tok[2]), int(tok[3])))
+                if len(tok) == 3 and tok[0] == "ramexec":
+                    ram_exec[convert_num_2(tok[1])] = int(tok[2])
+    except (OSError, ValueError) as e:
+        heat_error("Can't read heatmap \"" + heat_name + "\" (" + str(e) + ")")
+    return counts, windows, ram_exec, window_len
+
+# Labels sorted by address and the end of the assembled image
+def load_labels(map_name):
+    labels = []
+    image_end = 0
+    try:
+        with open(map_name, "r") as map_file:
+            for line in map_file:
+                tok = line.split()
+                if len(tok) == 3 and tok[1] == "label":
+                    labels.append((convert_num_2(tok[0]), tok[2]))
+                if len(tok) == 4 and tok[1] == "line":
+                    image_end = max(image_end, convert_num_2(tok[0]) + int(tok[3]))
+    except (OSError, ValueError) as e:
+        heat_error("Can't read map \"" + map_name + "\" (" + str(e) + ")")
+    labels.sort()
+    return labels, image_end
+
+def shade(n, top):
+    if n == 0:
+        return SHADES[0]
+    return SHADES[1 + int((len(SHADES) - 2) * math.log(n) / math.log(top)) if top > 1 else len(SHADES) - 1]
+
+def print_maps(lines):
+    top = max([sum(c) for c in lines.values()] + [1])
+    print("Heatmap (64 byte lines, '%s' from cold to hot, hottest line %d accesses)" % (SHADES[1:], top))
+    for row in range(0, 0x10000, 1024):
+        line_sums = [sum(lines.get(row + i * LINE_SIZE, (0, 0, 0))) for i in range(1024 // LINE_SIZE)]
+        kinds = []
+        for i in range(1024 // LINE_SIZE):
+            r, w, x = lines.get(row + i * LINE_SIZE, (0, 0, 0))
+            kinds.append("x" if x > 0 else ("w" if w > 0 else ("r" if r > 0 else ".")))
+        if sum(line_sums) == 0:
+            continue
+        print("  0x%04x |%s|  %s" % (row, "".join([shade(n, top) for n in line_sums]), "".join(kinds)))
+
+if len(sys.argv) < 2:
+    print("Usage: <heatmap tool> <heatmap file (tios --heatmap)> [assembler map file (--map)] [--top=<labels>]")
+    sys.exit()
+
+top_labels = 20
+map_name = None
+for arg in sys.argv[2:]:
+    if arg.startswith("--top="):
+        top_labels = int(arg[6:])
+    else:
+        map_name = arg
+
+counts, windows, ram_exec, window_len = load_heatmap(sys.argv[1])
+
+lines = {}
+for addr, c in counts.items():
+    base = addr - addr % LINE_SIZE
+    old = lines.get(base, (0, 0, 0))
+    lines[base] = (old[0] + c[0], old[1] + c[1], old[2] + c[2])
+total = [sum([c[k] for c in counts.values()]) for k in range(3)]
+pages = set([addr // PAGE_SIZE for addr in counts])
+
+print("Reads %d, writes %d, instructions %d" % (total[0], total[1], total[2]))
+print("Touched %d addresses, %d lines of %d bytes (%d bytes), %d pages of %d bytes (%d bytes)" % (len(counts), len(lines), LINE_SIZE,
+    len(lines) * LINE_SIZE, len(pages), PAGE_SIZE, len(pages) * PAGE_SIZE))
+if len(windows) > 0:
+    sizes = [w[0] for w in windows]
+    page_counts = [w[1] for w in windows]
+    print("Working set over %d windows of %d instructions:" % (len(windows), window_len))
+    print("  lines: min %d, mean %.1f, max %d (max %d bytes)" % (min(sizes), sum(sizes) / len(sizes), max(sizes), max(sizes) * LINE_SIZE))
+    print("  pages: min %d, mean %.1f, max %d (max %d bytes)" % (min(page_counts), sum(page_counts) / len(page_counts), max(page_counts),
+        max(page_counts) * PAGE_SIZE))
+    peak = sizes.index(max(sizes))
+    print("  peak at window %d (instructions %d - %d)" % (peak, peak * window_len, (peak + 1) * window_len - 1))
+print()
+print_maps(lines)
+
+if map_name is not None:
+    labels, image_end = load_labels(map_name)
+    summary = []
+    for i, (start, name) in enumerate(labels):
+        end = labels[i + 1][0] if i + 1 < len(labels) else max(image_end, start + 1)
+        if i + 1 < len(labels) and end == start:
+            continue
+        c = [0, 0, 0]
+        for addr in range(start, end):
+            if addr in counts:
+                for k in range(3):
+                    c[k] += counts[addr][k]
+        if sum(c) > 0:
+            summary.append((sum(c), name, start, end, c))
+    summary.sort(reverse=True)
+    print()
+    print("Labels by accesses (top %d):" % top_labels)
+    print("  %-24s %-13s %12s %12s %12s" % ("label", "range", "reads", "writes", "executed"))
+    for n, name, start, end, c in summary[:top_labels]:
+        print("  %-24s 0x%04x-0x%04x %12d %12d %12d" % (name, start, end - 1, c[0], c[1], c[2]))
+
+ram_code = sorted(set([addr for addr, c in counts.items() if c[2] > 0 and addr >= RAM_START]) | set(ram_exec.keys()))
+if len(ram_code) > 0:
+    print()
+    print("WARNING: code executed in RAM (TIOS stops the machine there):")
+    for addr in ram_code:
+        print("  0x%04x" % addr)
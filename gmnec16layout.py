@@ -0,0 +1,321 @@
+#!/usr/bin/python3
+
+# Profile-guided code layout for NEC 16 assembly
+
+#
+#
+# Copyright (c) 2022 GalaxianMonster
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+#
+
+import sys
+import re
+
+# Usage:
+#   gmnec16asm.py prog.asm prog.bin 3 --map=prog.map
+#   tios prog.bin --profile=prog.prof
+#   gmnec16layout.py prog.asm prog.map prog.prof prog.pgo.asm
+#   gmnec16asm.py prog.pgo.asm prog.bin 3
+#
+# Code between data and .setapc/.section directives is a region, regions are split into
+# basic blocks at labels and after branches. Inside a region the blocks are chained along
+# their hottest edges so the hot path falls through, the first block of a region always
+# stays first. Branches are rewritten and ujmps added where a fall-through got broken.
+# Only "::label" branch targets can be moved, regions with numeric branch targets are kept.
+
+branch_ops = ["cjmp", "ujmp", "beq", "bne", "blt", "bgt"]
+inverse_ops = {"beq": "bne", "bne": "beq"}
+
+def layout_error(error_msg):
+    print("Layout Error:", error_msg)
+    sys.exit(1)
+
+def convert_num_2(n):
+    n = n.strip()
+    if len(n) >= 2:
+        if n[0:2] == "0x":
+            return int(n, 16)
+        if n[0:2] == "0b":
+            return int(n, 2)
+        if n[0:2] == "0o":
+            return int(n, 8)
+    return int(n, 10)
+
+def load_map(map_name):
+    line_pcs = {}
+    try:
+        with open(map_name, "r") as map_file:
+            for line in map_file:
+                tok = line.split()
+                if len(tok) == 4 and tok[1] == "line" and int(tok[3]) > 0:
+                    line_pcs[int(tok[2])] = convert_num_2(tok[0])
+    except (OSError, ValueError) as e:
+        layout_error("Can't read map \"" + map_name + "\" (" + str(e) + ")")
+    return line_pcs
+
+def load_profile(profile_name):
+    pc_counts = {}
+    edges = {}
+    try:
+        with open(profile_name, "r") as profile_file:
+            for line in profile_file:
+                tok = line.split()
+                if len(tok) == 3 and tok[0] == "pc":
+                    pc_counts[convert_num_2(tok[1])] = int(tok[2])
+                if len(tok) == 4 and tok[0] == "edge":
+                    edges[(convert_num_2(tok[1]), convert_num_2(tok[2]))] = int(tok[3])
+    except (OSError, ValueError) as e:
+        layout_error("Can't read profile \"" + profile_name + "\" (" + str(e) + ")")
+    return pc_counts, edges
+
+def instr_tokens(asmline):
+    tok = []
+    for t in [t for t in re.split(r'[, ]', asmline) if t != '']:
+        if t[0] == ";":
+            break
+        tok.append(t)
+    tok[0] = tok[0].lower()
+    return tok
+
+# Split the source into entries, comments and blank lines stick to the entry after them
+def read_entries(asm_name):
+    entries = []
+    pending = []
+    try:
+        with open(asm_name, "r") as asm_file:
+            source = asm_file.read().split("\n")
+    except OSError as e:
+        layout_error("Can't read \"" + asm_name + "\" (" + str(e) + ")")
+    if len(source) > 0 and source[-1] == "":
+        source.pop()
+    for ln in range(1, len(source) + 1):
+        u_asmline = source[ln - 1]
+        asmline = u_asmline.strip()
+        if asmline == "" or asmline[0] == ";":
+            pending.append(u_asmline)
+            continue
+        if asmline[0] == ".":
+            dtok = [tok for tok in asmline.split(" ") if tok != '']
+            if dtok[0] == ".jlabel" and len(dtok) == 2:
+                kind = "label"
+            elif dtok[0] == ".global":
+                kind = "global"
+            else:
+                kind = "fixed"
+            entries.append({"ln": ln, "kind": kind, "tok": dtok, "text": u_asmline, "before": pending})
+        else:
+            entries.append({"ln": ln, "kind": "instr", "tok": instr_tokens(asmline), "text": u_asmline, "before": pending})
+        pending = []
+    return entries, pending
+
+def writes_pc(tok):
+    return len(tok) >= 2 and tok[0] not in branch_ops and tok[1].lower() in ["pc", "r15"]
+
+def ends_block(tok):
+    return tok[0] in branch_ops or tok[0] == "ret" or writes_pc(tok)
+
+def falls_through(tok):
+    return not (tok[0] in ["ujmp", "ret"] or writes_pc(tok))
+
+def target_of(tok):
+    if tok[0] in branch_ops and tok[-1][0:2] == "::":
+        return tok[-1][2:]
+    return None
+
+def split_blocks(region):
+    blocks = []
+    block = None
+    for entry in region:
+        if entry["kind"] == "label" and (block is None or len(block["instrs"]) > 0):
+            block = {"labels": [], "entries": [], "instrs": []}
+            blocks.append(block)
+        if block is None:
+            block = {"labels": [], "entries": [], "instrs": []}
+            blocks.append(block)
+        block["entries"].append(entry)
+        if entry["kind"] == "label":
+            block["labels"].append(entry["tok"][1])
+        if entry["kind"] == "instr":
+            block["instrs"].append(entry)
+            if ends_block(entry["tok"]):
+                block = None
+    return [b for b in blocks if len(b["entries"]) > 0]
+
+def layout_region(region, line_pcs, pc_counts, edges, new_label):
+    # Labels after the last instruction belong to the data that follows
+    end = len(region)
+    while end > 0 and region[end - 1]["kind"] != "instr":
+        end -= 1
+    return layout_code(region[:end], line_pcs, pc_counts, edges, new_label) + region[end:]
+
+def layout_code(region, line_pcs, pc_counts, edges, new_label):
+    blocks = split_blocks(region)
+    for entry in region:
+        if entry["kind"] == "instr" and entry["tok"][0] in branch_ops and target_of(entry["tok"]) is None:
+            return region
+    if len(blocks) < 2:
+        return region
+
+    label_block = {}
+    for i in range(len(blocks)):
+        b = blocks[i]
+        b["index"] = i
+        for name in b["labels"]:
+            label_block[name] = i
+        last = b["instrs"][-1]["tok"] if len(b["instrs"]) > 0 else None
+        b["last"] = last
+        b["fall"] = i + 1 if (last is None or falls_through(last)) else None
+        if b["fall"] == len(blocks):
+            b["fall"] = None
+            b["falls_out"] = True
+        else:
+            b["falls_out"] = False
+        first_pc = line_pcs.get(b["instrs"][0]["ln"]) if len(b["instrs"]) > 0 else None
+        b["count"] = pc_counts.get(first_pc, 0) if first_pc is not None else 0
+        b["last_pc"] = line_pcs.get(b["instrs"][-1]["ln"]) if len(b["instrs"]) > 0 else None
+
+    # Candidate layout edges, [weight, from, to]
+    candidates = []
+    for b in blocks:
+        last = b["last"]
+        last_count = pc_counts.get(b["last_pc"], 0) if b["last_pc"] is not None else b["count"]
+        taken = 0
+        target = target_of(last) if last is not None else None
+        if target is not None and target in label_block and b["last_pc"] is not None:
+            t = blocks[label_block[target]]
+            t_pc = line_pcs.get(t["instrs"][0]["ln"]) if len(t["instrs"]) > 0 else None
+            taken = edges.get((b["last_pc"], t_pc), 0)
+            if last[0] == "ujmp" or last[0] in inverse_ops:
+                candidates.append([taken, b["index"], t["index"]])
+        if b["fall"] is not None:
+            candidates.append([max(last_count - taken, 0), b["index"], b["fall"]])
+
+    # Greedy chaining along the hottest edges, ties keep the source order
+    chain_of = list(range(len(blocks)))
+    chains = [[i] for i in range(len(blocks))]
+    candidates.sort(key=lambda c: (-c[0], c[1]))
+    for weight, a, t in candidates:
+        if weight <= 0:
+            continue
+        ca = chain_of[a]
+        ct = chain_of[t]
+        if ca == ct or chains[ca][-1] != a or chains[ct][0] != t or t == 0:
+            continue
+        for i in chains[ct]:
+            chain_of[i] = ca
+        chains[ca] += chains[ct]
+        chains[ct] = []
+
+    # Entry chain first, then the other chains from hot to cold
+    order = [c for c in chains if len(c) > 0 and c[0] != 0]
+    order.sort(key=lambda c: (-max(blocks[i]["count"] for i in c), c[0]))
+    order = chains[chain_of[0]] + [i for c in order for i in c]
+
+    def block_label(i):
+        if len(blocks[i]["labels"]) == 0:
+            blocks[i]["labels"].append(new_label())
+            blocks[i]["synthetic"] = True
+        return blocks[i]["labels"][0]
+
+    end_label = []
+    laid_out = []
+    for k in range(len(order)):
+        b = blocks[order[k]]
+        n = order[k + 1] if k + 1 < len(order) else None
+        entries = list(b["entries"])
+        last = b["last"]
+        tail = []
+        if last is not None and last[0] == "ujmp" and target_of(last) in label_block and label_block[target_of(last)] == n:
+            index = entries.index(b["instrs"][-1])
+            entries[index] = {"kind": "removed", "before": entries[index]["before"]}
+        elif b["fall"] is not None and b["fall"] != n:
+            target = target_of(last) if last is not None else None
+            if last is not None and last[0] in inverse_ops and target in label_block and label_block[target] == n:
+                tok = [inverse_ops[last[0]]] + last[1:-1] + ["::" + block_label(b["fall"])]
+                index = entries.index(b["instrs"][-1])
+                entries[index] = dict(entries[index])
+                entries[index]["tok"] = tok
+                entries[index]["text"] = None
+            else:
+                tail.append("ujmp ::" + block_label(b["fall"]))
+        elif b["falls_out"] and n is not None:
+            # Fell out of the region, keep doing so through a label at the end
+            if len(end_label) == 0:
+                end_label.append(new_label())
+            tail.append("ujmp ::" + end_label[0])
+        b["out"] = entries
+        b["tail"] = tail
+        laid_out.append(b)
+
+    result = []
+    for b in laid_out:
+        if b.get("synthetic"):
+            result.append({"kind": "label", "tok": [".jlabel", b["labels"][0]], "text": None, "before": []})
+        result += b["out"]
+        for line in b["tail"]:
+            result.append({"kind": "instr", "tok": instr_tokens(line), "text": None, "before": []})
+    if len(end_label) > 0:
+        result.append({"kind": "label", "tok": [".jlabel", end_label[0]], "text": None, "before": []})
+    return result
+
+def entry_text(entry):
+    if entry["text"] is not None:
+        return entry["text"]
+    if entry["kind"] == "label":
+        return ".jlabel " + entry["tok"][1]
+    return entry["tok"][0] + " " + ", ".join(entry["tok"][1:])
+
+if len(sys.argv) < 5:
+    print("Usage: <layout tool> <input assembly file> <assembler map file (--map)> <profile file (tios --profile)> <output assembly file>")
+    sys.exit()
+
+line_pcs = load_map(sys.argv[2])
+pc_counts, edges = load_profile(sys.argv[3])
+entries, trailing = read_entries(sys.argv[1])
+
+used_labels = [e["tok"][1] for e in entries if e["kind"] == "label"]
+label_counter = [0]
+def new_label():
+    while "__pgo_%d" % label_counter[0] in used_labels:
+        label_counter[0] += 1
+    name = "__pgo_%d" % label_counter[0]
+    used_labels.append(name)
+    return name
+
+out_entries = []
+region = []
+for entry in entries:
+    if entry["kind"] == "fixed":
+        out_entries += layout_region(region, line_pcs, pc_counts, edges, new_label)
+        out_entries.append(entry)
+        region = []
+    else:
+        region.append(entry)
+out_entries += layout_region(region, line_pcs, pc_counts, edges, new_label)
+
+with open(sys.argv[4], "w") as out_file:
+    for entry in out_entries:
+        for line in entry["before"]:
+            out_file.write(line + "\n")
+        if entry["kind"] != "removed":
+            out_file.write(entry_text(entry) + "\n")
+    for line in trailing:
+        out_file.write(line + "\n")
@@ -0,0 +1,169 @@
+#!/usr/bin/python3
+
+# Linker for NEC 16 objects made by gmnec16asm.py --object
+
+#
+# 
+# Copyright (c) 2022 GalaxianMonster
+# 
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+# 
+#
+
+
+import sys
+import json
+
+# Sections without a base are placed one after another from the base address,
+# grouped by name in the order the names first appear on the command line
+# .setapc sections are placed at their own address, gaps are filled with zeros
+
+def link_error(error_msg):
+    print("Link Error:", error_msg)
+    sys.exit(1)
+
+def convert_num_2(n):
+    n = n.strip()
+    if len(n) >= 2:
+        if n[0:2] == "0x":
+            return int(n, 16)
+        if n[0:2] == "0b":
+            return int(n, 2)
+        if n[0:2] == "0o":
+            return int(n, 8)
+    return int(n, 10)
+
+def load_object(object_name):
+    try:
+        with open(object_name, "r") as object_file:
+            obj = json.load(object_file)
+    except (OSError, ValueError) as e:
+        link_error("Can't read object \"" + object_name + "\" (" + str(e) + ")")
+    if obj.get("format") != "gmnec16-object" or obj.get("version") != 1:
+        link_error("\"" + object_name + "\" is not a NEC16 object")
+    obj["name"] = object_name
+    for sec in obj["sections"]:
+        sec["data"] = bytes.fromhex(sec["data"])
+    return obj
+
+def place_sections(objects, base):
+    order = []
+    for obj in objects:
+        for sec in obj["sections"]:
+            if sec["base"] is None and not sec["name"] in order:
+                order.append(sec["name"])
+    addr = base
+    for name in order:
+        for obj in objects:
+            for sec in obj["sections"]:
+                if sec["base"] is None and sec["name"] == name:
+                    sec["addr"] = addr
+                    addr += len(sec["data"])
+    for obj in objects:
+        for sec in obj["sections"]:
+            if sec["base"] is not None:
+                sec["addr"] = sec["base"]
+            if sec["addr"] < base or sec["addr"] + len(sec["data"]) > 0x10000:
+                link_error("Section \"" + sec["name"] + "\" of \"" + obj["name"] + "\" at 0x%04x is outside of the address space" % sec["addr"])
+
+def collect_globals(objects):
+    global_symbols = {}
+    for obj in objects:
+        for sym in obj["symbols"]:
+            if not sym["global"]:
+                continue
+            if sym["name"] in global_symbols:
+                link_error("Symbol \"" + sym["name"] + "\" is defined in \"" + global_symbols[sym["name"]][0] + "\" and \"" + obj["name"] + "\"")
+            global_symbols[sym["name"]] = [obj["name"], obj["sections"][sym["section"]]["addr"] + sym["offset"]]
+    return global_symbols
+
+def resolve_symbol(obj, name, global_symbols):
+    # Labels of the object itself come first, then exported labels of every object
+    for sym in obj["symbols"]:
+        if sym["name"] == name:
+            return obj["sections"][sym["section"]]["addr"] + sym["offset"]
+    if name in global_symbols:
+        return global_symbols[name][1]
+    link_error("Undefined symbol \"" + name + "\" in \"" + obj["name"] + "\"")
+
+def build_image(objects, base):
+    end = base
+    for obj in objects:
+        for sec in obj["sections"]:
+            end = max(end, sec["addr"] + len(sec["data"]))
+    image = bytearray(end - base)
+    owner = [None] * (end - base)
+    for obj in objects:
+        for sec in obj["sections"]:
+            start = sec["addr"] - base
+            for i in range(len(sec["data"])):
+                if owner[start + i] is not None:
+                    link_error("Section \"" + sec["name"] + "\" of \"" + obj["name"] + "\" overlaps \"" + owner[start + i] + "\" at 0x%04x" % (sec["addr"] + i))
+                owner[start + i] = obj["name"]
+            image[start:start + len(sec["data"])] = sec["data"]
+    return image
+
+def apply_relocs(objects, base, image, global_symbols):
+    for obj in objects:
+        for rel in obj["relocs"]:
+            value = resolve_symbol(obj, rel["symbol"], global_symbols)
+            if value >= (1 << (8 * rel["size"])):
+                link_error("Address of \"" + rel["symbol"] + "\" (0x%04x) doesn't fit in %d byte(s) in \"%s\"" % (value, rel["size"], obj["name"]))
+            at = obj["sections"][rel["section"]]["addr"] + rel["offset"] - base
+            image[at:at + rel["size"]] = value.to_bytes(rel["size"], "little", signed=False)
+
+def write_map(map_name, objects):
+    lines = []
+    for obj in objects:
+        for sym in obj["symbols"]:
+            addr = obj["sections"][sym["section"]]["addr"] + sym["offset"]
+            lines.append([addr, "0x%04x %s %s %s" % (addr, "global" if sym["global"] else "local", sym["name"], obj["name"])])
+    lines.sort(key=lambda l: l[0])
+    with open(map_name, "w") as map_file:
+        for l in lines:
+            map_file.write(l[1] + "\n")
+
+link_options = {}
+link_args = []
+for arg in sys.argv[1:]:
+    if arg[0:2] == "--":
+        opt = arg[2:].split("=", 1)
+        link_options[opt[0]] = opt[1] if len(opt) == 2 else ""
+    else:
+        link_args.append(arg)
+
+if len(link_args) < 2:
+    print("Usage: <linker> <output binary file> <object files...> [--base=<address of the first byte>] [--map=<map file>]")
+    sys.exit()
+
+base = 0
+if "base" in link_options:
+    base = convert_num_2(link_options["base"])
+
+objects = [load_object(name) for name in link_args[1:]]
+place_sections(objects, base)
+global_symbols = collect_globals(objects)
+image = build_image(objects, base)
+apply_relocs(objects, base, image, global_symbols)
+
+with open(link_args[0], "wb") as bin_file:
+    bin_file.write(image)
+
+if "map" in link_options:
+    write_map(link_options["map"], objects)
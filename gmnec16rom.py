@@ -0,0 +1,109 @@
+#!/usr/bin/python3
+
+# ROM container builder for NEC 16 systems (TIOS)
+
+#
+#
+# Copyright (c) 2022 GalaxianMonster
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+#
+
+import sys
+import zlib
+
+# Container layout (little endian), see tios_load_container in nec16_systems/tios.h:
+#   "NEC16ROM", version (2), header size (2), entry point (2), segment count (2), CRC-32 (4)
+#   segment table: load address (2), flags (2), length (4), file offset (4)
+#   segment data, each one starting at a file offset equal to its load address modulo 4096,
+#   so a loader can map it straight from the file
+
+ROM_MAGIC = b"NEC16ROM"
+ROM_VERSION = 1
+ROM_HEADER_SIZE = 20
+ROM_SEGMENT_SIZE = 12
+ROM_CRC_OFFSET = 16
+ROM_ALIGN = 4096
+
+def rom_error(error_msg):
+    print("ROM Error:", error_msg)
+    sys.exit(1)
+
+def convert_num_2(n):
+    n = n.strip()
+    if len(n) >= 2:
+        if n[0:2] == "0x":
+            return int(n, 16)
+        if n[0:2] == "0b":
+            return int(n, 2)
+        if n[0:2] == "0o":
+            return int(n, 8)
+    return int(n, 10)
+
+def build_rom(segments, entry):
+    table_end = ROM_HEADER_SIZE + len(segments) * ROM_SEGMENT_SIZE
+    offset = table_end
+    table = bytearray()
+    for load, data in segments:
+        offset += (load - offset) % ROM_ALIGN
+        table += load.to_bytes(2, "little") + (0).to_bytes(2, "little") + len(data).to_bytes(4, "little") + offset.to_bytes(4, "little")
+        offset += len(data)
+    image = bytearray(ROM_MAGIC + ROM_VERSION.to_bytes(2, "little") + ROM_HEADER_SIZE.to_bytes(2, "little") + entry.to_bytes(2, "little") + len(segments).to_bytes(2, "little") + bytes(4)) + table
+    for i in range(len(segments)):
+        at = int.from_bytes(table[i * ROM_SEGMENT_SIZE + 8:i * ROM_SEGMENT_SIZE + 12], "little")
+        image += bytes(at - len(image)) + segments[i][1]
+    image[ROM_CRC_OFFSET:ROM_CRC_OFFSET + 4] = zlib.crc32(image).to_bytes(4, "little")
+    return image
+
+rom_options = {}
+rom_args = []
+for arg in sys.argv[1:]:
+    if arg[0:2] == "--":
+        opt = arg[2:].split("=", 1)
+        rom_options[opt[0]] = opt[1] if len(opt) == 2 else ""
+    else:
+        rom_args.append(arg)
+
+if len(rom_args) < 2:
+    print("Usage: <rom builder> <output rom file> <binary file>[@<load address, 3 by default>]... [--entry=<address, the first load address by default>]")
+    sys.exit()
+
+segments = []
+for arg in rom_args[1:]:
+    name, _, load = arg.partition("@")
+    load = convert_num_2(load) if load != "" else 3
+    try:
+        with open(name, "rb") as bin_file:
+            data = bin_file.read()
+    except OSError as e:
+        rom_error("Can't read \"" + name + "\" (" + str(e) + ")")
+    if load < 3 or load + len(data) > 0x10000:
+        rom_error("\"" + name + "\" at 0x%04x doesn't fit between 0x0003 and 0xffff" % load)
+    for other_load, other_data in segments:
+        if load < other_load + len(other_data) and other_load < load + len(data):
+            rom_error("\"" + name + "\" at 0x%04x overlaps another segment" % load)
+    segments.append([load, data])
+
+entry = convert_num_2(rom_options["entry"]) if "entry" in rom_options else segments[0][0]
+if entry < 3 or entry >= 32 * 1024 + 3:
+    rom_error("Entry point 0x%04x is not in ROM" % entry)
+
+with open(rom_args[0], "wb") as rom_file:
+    rom_file.write(build_rom(segments, entry))
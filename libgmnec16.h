@@ -33,14 +33,23 @@ extern "C"
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 /*
  * NEC 16 Specification
  *
  *    RAM: Up to 64 KiB
- *    Opcodes: 32 (Total) (19 base opcodes + 5 IE opcodes + 6 SE opcodes + 2 ME opcodes)
+ *    Opcodes: 48 (Total) (19 base opcodes + 11 IE opcodes + 7 SE opcodes + 11 ME opcodes)
  *    Registers: 16 (only 16-bit)
  *
+ *    Memory ordering (several cores sharing one bus):
+ *      Byte reads and writes are atomic, word accesses (GM/SM pairs, LDW/STW, immediates) may tear
+ *      Plain accesses of one core can be seen by other cores late and out of order
+ *      XCHG and CAS are atomic on an aligned word and order every access before and after them (full barriers)
+ *      Instruction fetches only see code written by the same core
+ *
+ *    DIV and MOD by 0 fail with GM_NEC16_DIVBYZERO and leave regA as it was
  *
  */
 
@@ -51,21 +60,60 @@ extern "C"
 #define GM_NEC16_SP 13
 #define GM_NEC16_SB 12
 
+/* Status codes (not errors) returned by gmnec16_instr_step */
+#define GM_NEC16_HALTED 1
+
+#define GM_NEC16_DIVBYZERO -4
 #define GM_NEC16_ADDRINVALID -3
 #define GM_NEC16_INSTRUCTIONINVALID -2
 #define GM_NEC16_UNKNOWN_ERROR -1
 
+/* Fast memory path, a page that is not NULL maps its 256 bytes straight to host memory */
+#define GM_NEC16_PAGE_SHIFT 8
+#define GM_NEC16_PAGE_SIZE 0x100
+#define GM_NEC16_PAGE_COUNT 0x100
+
+/* Predecoded instructions */
+#define GM_NEC16_NOT_DECODED 0xff
+
+/* Kinds of the (ME) block instruction */
+#define GM_NEC16_BLOCK_COPY 0
+#define GM_NEC16_BLOCK_FILL 1
+#define GM_NEC16_BLOCK_COMPARE 2
+
+/* Kinds of the (ME) atomic instruction */
+#define GM_NEC16_ATOMIC_XCHG 0
+#define GM_NEC16_ATOMIC_CAS 1
+
 #define gmnec16_err_check_0(x) if(x<0){return x;}
 
 typedef int(*GM_NEC16_BusWriteFunc)(void*, uint16_t, uint8_t);
 typedef int(*GM_NEC16_BusReadFunc)(void*, uint16_t, uint8_t*);
+/* data, aligned addr, kind, expected (CAS), value to store in and old value out */
+typedef int(*GM_NEC16_BusAtomicFunc)(void*, uint16_t, uint8_t, uint16_t, uint16_t*);
+
+/* A predecoded instruction, imm16 holds the 2 bytes after the instruction word */
+typedef struct __GM_NEC16_DECODED
+{
+        uint8_t opcode; /* GM_NEC16_NOT_DECODED when the instruction has to be fetched */
+        uint8_t regA;
+        uint8_t regB;
+        uint8_t secondbyte;
+        uint16_t immval;
+        uint16_t imm16;
+} GM_NEC16_Decoded;
 
+/* Set up with gmnec16_init, then the bus functions, data and registers can be changed */
 typedef struct __GM_NEC16
 {
         GM_NEC16_BusWriteFunc bus_write;
         GM_NEC16_BusReadFunc bus_read;
+        GM_NEC16_BusAtomicFunc bus_atomic; /* NULL does atomics as plain reads and writes */
         void* data;
         uint16_t regs[0x10]; /* 16 registers */
+        uint8_t* pages[GM_NEC16_PAGE_COUNT]; /* Host memory of each page or NULL to use the bus */
+        const GM_NEC16_Decoded* decoded[GM_NEC16_PAGE_COUNT]; /* Predecoded instructions of each page or NULL to fetch them */
+        int32_t decoded_imm; /* Predecoded immediate of the running instruction or -1 */
 } GM_NEC16;
 
 typedef struct __GM_NEC16_INSTR
@@ -79,6 +127,365 @@ typedef struct __GM_NEC16_INSTR
 
 } GM_NEC16_Instr;
 
+/* Set up nec on a bus with every register 0, no mapped pages, no predecoded instructions and plain atomics */
+/* Required before the first step, the fields past regs are only cleared here (set bus_atomic afterwards to use one) */
+void gmnec16_init(GM_NEC16* nec, GM_NEC16_BusReadFunc read, GM_NEC16_BusWriteFunc write, void* data)
+{
+        memset(nec, 0, sizeof(GM_NEC16));
+        nec->bus_read = read;
+        nec->bus_write = write;
+        nec->data = data;
+        nec->decoded_imm = -1;
+}
+
+/* Map every page lying fully inside [addr, addr + len) to host memory, where host points at addr (NULL unmaps) */
+void gmnec16_map_pages(GM_NEC16* nec, uint16_t addr, uint32_t len, uint8_t* host)
+{
+        uint32_t page_addr = ((uint32_t)addr + GM_NEC16_PAGE_SIZE - 1) & ~(uint32_t)(GM_NEC16_PAGE_SIZE - 1);
+        uint32_t end = (uint32_t)addr + len;
+
+        if(end > 0x10000)
+        {
+                end = 0x10000;
+        }
+        for(; page_addr + GM_NEC16_PAGE_SIZE <= end; page_addr += GM_NEC16_PAGE_SIZE)
+        {
+                nec->pages[page_addr >> GM_NEC16_PAGE_SHIFT] = (host == NULL) ? NULL : host + (page_addr - addr);
+        }
+}
+
+/* Use the predecoded instructions in table for every page lying fully inside [addr, addr + len), where table holds the entry of addr (NULL drops them) */
+/* Writes done by the CPU drop the pages they touch, the owner of the bus has to call gmnec16_invalidate_decoded for any other write */
+/* Writes to the device addresses 0 to 2 keep every page, so the entries there and the ones whose 4 bytes reach them have to be GM_NEC16_NOT_DECODED */
+void gmnec16_map_decoded(GM_NEC16* nec, uint16_t addr, uint32_t len, const GM_NEC16_Decoded* table)
+{
+        uint32_t page_addr = ((uint32_t)addr + GM_NEC16_PAGE_SIZE - 1) & ~(uint32_t)(GM_NEC16_PAGE_SIZE - 1);
+        uint32_t end = (uint32_t)addr + len;
+
+        if(end > 0x10000)
+        {
+                end = 0x10000;
+        }
+        for(; page_addr + GM_NEC16_PAGE_SIZE <= end; page_addr += GM_NEC16_PAGE_SIZE)
+        {
+                nec->decoded[page_addr >> GM_NEC16_PAGE_SHIFT] = (table == NULL) ? NULL : table + (page_addr - addr);
+        }
+        nec->decoded_imm = -1;
+}
+
+/* Drop the predecoded pages holding an instruction that overlaps [addr, addr + len) */
+void gmnec16_invalidate_decoded(GM_NEC16* nec, uint16_t addr, uint32_t len)
+{
+        /* An instruction with its immediate is 4 bytes long, so it can start 3 bytes earlier */
+        uint16_t start = (uint16_t)(addr - 3);
+        uint32_t count;
+        uint32_t i;
+
+        /* Device addresses, see gmnec16_map_decoded */
+        if(addr < 3)
+        {
+                if(len <= (uint32_t)(3 - addr))
+                {
+                        return;
+                }
+                len -= 3 - addr;
+                addr = 3;
+                start = 0;
+        }
+        if(len == 0)
+        {
+                return;
+        }
+        count = (((uint32_t)(start & (GM_NEC16_PAGE_SIZE - 1)) + len + 3 - 1) >> GM_NEC16_PAGE_SHIFT) + 1;
+        if(count > GM_NEC16_PAGE_COUNT)
+        {
+                count = GM_NEC16_PAGE_COUNT;
+        }
+        for(i = 0; i < count; i++)
+        {
+                nec->decoded[((start >> GM_NEC16_PAGE_SHIFT) + i) & (GM_NEC16_PAGE_COUNT - 1)] = NULL;
+        }
+        nec->decoded_imm = -1;
+}
+
+/* Decode the instruction in b[0] and b[1], b[2] and b[3] are kept as its immediate */
+void gmnec16_predecode(GM_NEC16_Decoded* d, const uint8_t* b)
+{
+        d->opcode = (b[0] & 0xf0) >> 4;
+        d->regA = b[0] & 0xf;
+        d->regB = (b[1] & 0xf0) >> 4;
+        d->immval = (((uint16_t)b[0] & 0x0f) << 8) | (uint16_t)b[1];
+        d->secondbyte = b[1];
+        d->imm16 = (uint16_t)b[2] | ((uint16_t)b[3] << 8);
+}
+
+/* Byte access through the fast memory path, falling back to the bus for unmapped pages */
+int gmnec16_mem_read(GM_NEC16* nec, uint16_t addr, uint8_t* ib)
+{
+        uint8_t* page = nec->pages[addr >> GM_NEC16_PAGE_SHIFT];
+
+        if(page != NULL)
+        {
+                *ib = page[addr & (GM_NEC16_PAGE_SIZE - 1)];
+                return 0;
+        }
+        return nec->bus_read(nec->data, addr, ib);
+}
+
+int gmnec16_mem_write(GM_NEC16* nec, uint16_t addr, uint8_t ob)
+{
+        uint8_t* page = nec->pages[addr >> GM_NEC16_PAGE_SHIFT];
+
+        if(nec->decoded[addr >> GM_NEC16_PAGE_SHIFT] != NULL || nec->decoded[(uint16_t)(addr - 3) >> GM_NEC16_PAGE_SHIFT] != NULL)
+        {
+                gmnec16_invalidate_decoded(nec, addr, 1);
+        }
+        if(page != NULL)
+        {
+                page[addr & (GM_NEC16_PAGE_SIZE - 1)] = ob;
+                return 0;
+        }
+        return nec->bus_write(nec->data, addr, ob);
+}
+
+/* Atomic access to the aligned word at addr, *val is the word to store and receives the old one */
+/* CAS only stores when the old word equals expected */
+int gmnec16_atomic(GM_NEC16* nec, uint16_t addr, uint8_t kind, uint16_t expected, uint16_t* val)
+{
+        int bus_stat;
+        uint8_t word0;
+        uint8_t word1;
+        uint16_t old;
+
+        if(nec->bus_atomic != NULL)
+        {
+                if(nec->decoded[addr >> GM_NEC16_PAGE_SHIFT] != NULL || nec->decoded[(uint16_t)(addr - 3) >> GM_NEC16_PAGE_SHIFT] != NULL)
+                {
+                        gmnec16_invalidate_decoded(nec, addr, 2);
+                }
+                return nec->bus_atomic(nec->data, addr, kind, expected, val);
+        }
+        bus_stat = gmnec16_mem_read(nec, addr, &word0);
+        gmnec16_err_check_0(bus_stat);
+        bus_stat = gmnec16_mem_read(nec, (uint16_t)(addr + 1), &word1);
+        gmnec16_err_check_0(bus_stat);
+        old = (uint16_t)word0 | (((uint16_t)word1) << 8);
+        if(kind == GM_NEC16_ATOMIC_XCHG || old == expected)
+        {
+                bus_stat = gmnec16_mem_write(nec, addr, (uint8_t)(*val & 0xff));
+                gmnec16_err_check_0(bus_stat);
+                bus_stat = gmnec16_mem_write(nec, (uint16_t)(addr + 1), (uint8_t)((*val & 0xff00) >> 8));
+                gmnec16_err_check_0(bus_stat);
+        }
+        *val = old;
+        return 0;
+}
+
+/* Bytes left in the page of addr */
+#define gmnec16_page_left(addr) ((uint32_t)GM_NEC16_PAGE_SIZE - ((addr) & (GM_NEC16_PAGE_SIZE - 1)))
+
+/* Copy len bytes from src to dst, overlapping ranges behave like memmove */
+int gmnec16_block_copy(GM_NEC16* nec, uint16_t dst, uint16_t src, uint16_t len)
+{
+        uint32_t remaining = len;
+        int backwards = (uint16_t)(dst - src) != 0 && (uint16_t)(dst - src) < len;
+
+        gmnec16_invalidate_decoded(nec, dst, len);
+        while(remaining > 0)
+        {
+                int bus_stat;
+                uint32_t run = remaining;
+                uint32_t i;
+                uint16_t s;
+                uint16_t d;
+                uint8_t* spage;
+                uint8_t* dpage;
+                uint8_t b;
+
+                if(backwards)
+                {
+                        /* Walk down from the end, so the run ends where the pages end */
+                        uint16_t s_last = (uint16_t)(src + remaining - 1);
+                        uint16_t d_last = (uint16_t)(dst + remaining - 1);
+                        if(run > (uint32_t)(s_last & (GM_NEC16_PAGE_SIZE - 1)) + 1)
+                        {
+                                run = (uint32_t)(s_last & (GM_NEC16_PAGE_SIZE - 1)) + 1;
+                        }
+                        if(run > (uint32_t)(d_last & (GM_NEC16_PAGE_SIZE - 1)) + 1)
+                        {
+                                run = (uint32_t)(d_last & (GM_NEC16_PAGE_SIZE - 1)) + 1;
+                        }
+                        s = (uint16_t)(s_last - run + 1);
+                        d = (uint16_t)(d_last - run + 1);
+                }
+                else
+                {
+                        s = (uint16_t)(src + (len - remaining));
+                        d = (uint16_t)(dst + (len - remaining));
+                        if(run > gmnec16_page_left(s))
+                        {
+                                run = gmnec16_page_left(s);
+                        }
+                        if(run > gmnec16_page_left(d))
+                        {
+                                run = gmnec16_page_left(d);
+                        }
+                }
+
+                spage = nec->pages[s >> GM_NEC16_PAGE_SHIFT];
+                dpage = nec->pages[d >> GM_NEC16_PAGE_SHIFT];
+                if(spage != NULL && dpage != NULL)
+                {
+                        memmove(dpage + (d & (GM_NEC16_PAGE_SIZE - 1)), spage + (s & (GM_NEC16_PAGE_SIZE - 1)), run);
+                }
+                else if(backwards)
+                {
+                        for(i = run; i > 0; i--)
+                        {
+                                bus_stat = gmnec16_mem_read(nec, (uint16_t)(s + i - 1), &b);
+                                gmnec16_err_check_0(bus_stat);
+                                bus_stat = gmnec16_mem_write(nec, (uint16_t)(d + i - 1), b);
+                                gmnec16_err_check_0(bus_stat);
+                        }
+                }
+                else
+                {
+                        for(i = 0; i < run; i++)
+                        {
+                                bus_stat = gmnec16_mem_read(nec, (uint16_t)(s + i), &b);
+                                gmnec16_err_check_0(bus_stat);
+                                bus_stat = gmnec16_mem_write(nec, (uint16_t)(d + i), b);
+                                gmnec16_err_check_0(bus_stat);
+                        }
+                }
+                remaining -= run;
+        }
+        return 0;
+}
+
+/* Fill len bytes at dst with val */
+int gmnec16_block_fill(GM_NEC16* nec, uint16_t dst, uint8_t val, uint16_t len)
+{
+        uint32_t done = 0;
+
+        gmnec16_invalidate_decoded(nec, dst, len);
+        while(done < len)
+        {
+                int bus_stat;
+                uint16_t d = (uint16_t)(dst + done);
+                uint32_t run = len - done;
+                uint32_t i;
+                uint8_t* dpage = nec->pages[d >> GM_NEC16_PAGE_SHIFT];
+
+                if(run > gmnec16_page_left(d))
+                {
+                        run = gmnec16_page_left(d);
+                }
+                if(dpage != NULL)
+                {
+                        memset(dpage + (d & (GM_NEC16_PAGE_SIZE - 1)), val, run);
+                }
+                else
+                {
+                        for(i = 0; i < run; i++)
+                        {
+                                bus_stat = nec->bus_write(nec->data, (uint16_t)(d + i), val);
+                                gmnec16_err_check_0(bus_stat);
+                        }
+                }
+                done += run;
+        }
+        return 0;
+}
+
+/* Compare len bytes at a and b, *equal is set to 1 when they match */
+int gmnec16_block_compare(GM_NEC16* nec, uint16_t a, uint16_t b, uint16_t len, int* equal)
+{
+        uint32_t done = 0;
+
+        *equal = 1;
+        while(done < len)
+        {
+                int bus_stat;
+                uint16_t pa = (uint16_t)(a + done);
+                uint16_t pb = (uint16_t)(b + done);
+                uint32_t run = len - done;
+                uint32_t i;
+                uint8_t* apage = nec->pages[pa >> GM_NEC16_PAGE_SHIFT];
+                uint8_t* bpage = nec->pages[pb >> GM_NEC16_PAGE_SHIFT];
+
+                if(run > gmnec16_page_left(pa))
+                {
+                        run = gmnec16_page_left(pa);
+                }
+                if(run > gmnec16_page_left(pb))
+                {
+                        run = gmnec16_page_left(pb);
+                }
+                if(apage != NULL && bpage != NULL)
+                {
+                        if(memcmp(apage + (pa & (GM_NEC16_PAGE_SIZE - 1)), bpage + (pb & (GM_NEC16_PAGE_SIZE - 1)), run) != 0)
+                        {
+                                *equal = 0;
+                                return 0;
+                        }
+                }
+                else
+                {
+                        for(i = 0; i < run; i++)
+                        {
+                                uint8_t ab;
+                                uint8_t bb;
+                                bus_stat = gmnec16_mem_read(nec, (uint16_t)(pa + i), &ab);
+                                gmnec16_err_check_0(bus_stat);
+                                bus_stat = gmnec16_mem_read(nec, (uint16_t)(pb + i), &bb);
+                                gmnec16_err_check_0(bus_stat);
+                                if(ab != bb)
+                                {
+                                        *equal = 0;
+                                        return 0;
+                                }
+                        }
+                }
+                done += run;
+        }
+        return 0;
+}
+
+/* Read the 2 bytes at PC, using the predecoded immediate when there is one */
+int gmnec16_read_imm_bytes(GM_NEC16* nec, uint8_t* word0, uint8_t* word1)
+{
+        int bus_stat;
+
+        if(nec->decoded_imm >= 0)
+        {
+                *word0 = (uint8_t)(nec->decoded_imm & 0xff);
+                *word1 = (uint8_t)((nec->decoded_imm >> 8) & 0xff);
+                return 0;
+        }
+        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_PC], word0);
+        gmnec16_err_check_0(bus_stat);
+        return gmnec16_mem_read(nec, (uint16_t)(nec->regs[GM_NEC16_PC] + 1), word1);
+}
+
+/* Read the 16 bit immediate value at PC and step over it */
+int gmnec16_fetch_imm16(GM_NEC16* nec, uint16_t* immval)
+{
+        int bus_stat;
+        uint8_t word0;
+        uint8_t word1;
+
+        if(nec->regs[GM_NEC16_PC] == 0xffff)
+        {
+                return GM_NEC16_INSTRUCTIONINVALID;
+        }
+        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
+        gmnec16_err_check_0(bus_stat);
+        *immval = (uint16_t)word0 | ((uint16_t)word1 << 8);
+        nec->regs[GM_NEC16_PC] += 2;
+        return 0;
+}
+
 /* Extended opcodes, as we can't fit them in a 4 bit nibble */
 int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
 {
@@ -132,12 +539,7 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                         uint8_t word0;
                         uint8_t word1;
 
-                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
-                        if(bus_stat < 0)
-                        {
-                                return bus_stat;
-                        }
-                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                         if(bus_stat < 0)
                         {
                                 return bus_stat;
@@ -162,12 +564,7 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                 uint8_t word0;
                                 uint8_t word1;
 
-                                bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
-                                if(bus_stat < 0)
-                                {
-                                        return bus_stat;
-                                }
-                                bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                                bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                                 if(bus_stat < 0)
                                 {
                                         return bus_stat;
@@ -210,12 +607,7 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                         uint8_t word0;
                         uint8_t word1;
 
-                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
-                        if(bus_stat < 0)
-                        {
-                                return bus_stat;
-                        }
-                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                         if(bus_stat < 0)
                         {
                                 return bus_stat;
@@ -233,8 +625,12 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                 /* CALL addr */
                 /* CALL reg */
                 /* RET */
+                /* HLT */
                 /* SET reg, addr */
                 /* SET addr, reg */
+                /* MEMCPY/MEMSET/MEMCMP reg, reg, reg */
+                /* LDW/LDWP reg, base, offset */
+                /* STW/STWP base, offset, reg */
                 /* And more soon */
                 case 0x9:
                         switch(instr.regB)
@@ -245,13 +641,11 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0;
                                         uint8_t word1;
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP], word0);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP], word0);
-                                        gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP] + 1, word1);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP] + 1, word1);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_PC] += 2;
                                         nec->regs[GM_NEC16_SP] += 2;
@@ -263,9 +657,9 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0 = nec->regs[realregB] & 0xff;
                                         uint8_t word1 = (nec->regs[realregB] & 0xff00) >> 8;
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP], word0);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP], word0);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP] + 1, word1);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP] + 1, word1);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_SP] += 2;
                                 }
@@ -276,9 +670,9 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0;
                                         uint8_t word1;
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_SP] - 1, &word1);
+                                        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_SP] - 1, &word1);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_SP] - 2, &word0);
+                                        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_SP] - 2, &word0);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[realregB] = ((uint16_t)word0) | ((uint16_t)word1 << 8);
                                         nec->regs[GM_NEC16_SP] -= 2;
@@ -290,13 +684,11 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0 = (uint8_t)((nec->regs[GM_NEC16_PC] + 2) & 0xff);
                                         uint8_t word1 = (uint8_t)(((nec->regs[GM_NEC16_PC] + 2) & 0xff00) >> 8);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP], word0);
-                                        gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP] + 1, word1);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP], word0);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP] + 1, word1);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_PC] = ((uint16_t)word0) | ((uint16_t)word1 << 8);
                                         nec->regs[GM_NEC16_SP] += 2;
@@ -308,9 +700,9 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0 = (uint8_t)((nec->regs[GM_NEC16_PC]) & 0xff);
                                         uint8_t word1 = (uint8_t)(((nec->regs[GM_NEC16_PC]) & 0xff00) >> 8);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP], word0);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP], word0);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_SP] + 1, word1);
+                                        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_SP] + 1, word1);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_PC] = nec->regs[realregB];
                                         nec->regs[GM_NEC16_SP] += 2;
@@ -322,9 +714,9 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0;
                                         uint8_t word1;
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_SP] - 1, &word1);
+                                        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_SP] - 1, &word1);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_SP] - 2, &word0);
+                                        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_SP] - 2, &word0);
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_SP] -= 2;
                                         nec->regs[GM_NEC16_PC] = ((uint16_t)word0) | ((uint16_t)word1 << 8);
@@ -336,14 +728,12 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0;
                                         uint8_t word1;
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
-                                        gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                                         gmnec16_err_check_0(bus_stat);
                                         uint16_t addr_word = (uint16_t)word0 | (((uint16_t)word1) << 8);
-                                        bus_stat = nec->bus_write(nec->data, addr_word, (uint8_t)(nec->regs[realregB] & 0xff));
+                                        bus_stat = gmnec16_mem_write(nec, addr_word, (uint8_t)(nec->regs[realregB] & 0xff));
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_write(nec->data, addr_word + 1, (uint8_t)((nec->regs[realregB] & 0xff00) >> 8));
+                                        bus_stat = gmnec16_mem_write(nec, addr_word + 1, (uint8_t)((nec->regs[realregB] & 0xff00) >> 8));
                                         gmnec16_err_check_0(bus_stat);
                                         nec->regs[GM_NEC16_PC] += 2;
                                 }
@@ -354,25 +744,230 @@ int gmnec16_eops(GM_NEC16* nec, GM_NEC16_Instr instr)
                                         int bus_stat;
                                         uint8_t word0;
                                         uint8_t word1;
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &word0);
-                                        gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &word1);
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
                                         gmnec16_err_check_0(bus_stat);
                                         uint16_t addr_word = (uint16_t)word0 | (((uint16_t)word1) << 8);
-                                        bus_stat = nec->bus_read(nec->data, addr_word, &word0);
+                                        bus_stat = gmnec16_mem_read(nec, addr_word, &word0);
                                         gmnec16_err_check_0(bus_stat);
-                                        bus_stat = nec->bus_read(nec->data, addr_word + 1, &word1);
+                                        bus_stat = gmnec16_mem_read(nec, addr_word + 1, &word1);
                                         gmnec16_err_check_0(bus_stat);
                                         uint16_t addr_val_word = (uint16_t)word0 | (((uint16_t)word1) << 8);
                                         nec->regs[realregB] = addr_val_word;
                                         nec->regs[GM_NEC16_PC] += 2;
                                 }
                                         break;
+                                /* (SE) HLT (stop until the host signals an event, execution resumes at the next instruction) */
+                                case 0x8:
+                                        return GM_NEC16_HALTED;
+                                /* (ME) MEMCPY/MEMSET/MEMCMP rA, rB, rC (dst/a, src/fill byte/b, length), the kind is in the 4th byte */
+                                case 0x9:
+                                {
+                                        int bus_stat;
+                                        uint8_t word0;
+                                        uint8_t word1;
+                                        uint16_t dst;
+                                        uint16_t src;
+                                        uint16_t len;
+                                        int equal;
+
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
+                                        gmnec16_err_check_0(bus_stat);
+                                        nec->regs[GM_NEC16_PC] += 2;
+                                        dst = nec->regs[realregB];
+                                        src = nec->regs[(word0 & 0xf0) >> 4];
+                                        len = nec->regs[word0 & 0xf];
+                                        switch(word1)
+                                        {
+                                                case GM_NEC16_BLOCK_COPY:
+                                                        return gmnec16_block_copy(nec, dst, src, len);
+                                                case GM_NEC16_BLOCK_FILL:
+                                                        return gmnec16_block_fill(nec, dst, (uint8_t)(src & 0xff), len);
+                                                case GM_NEC16_BLOCK_COMPARE:
+                                                        bus_stat = gmnec16_block_compare(nec, dst, src, len, &equal);
+                                                        gmnec16_err_check_0(bus_stat);
+                                                        nec->regs[GM_NEC16_CONDRES] = equal ? 0 : 1;
+                                                        break;
+                                                default:
+                                                        return GM_NEC16_INSTRUCTIONINVALID;
+                                        }
+                                }
+                                        break;
+                                /* (ME) LDW reg, base, offset | STW base, offset, reg (and the post-increment LDWP/STWP) */
+                                /* base and a signed 12 bit offset are in the 3rd and 4th bytes, LDWP/STWP add 2 to base afterwards */
+                                case 0xa:
+                                case 0xb:
+                                case 0xc:
+                                case 0xd:
+                                {
+                                        int bus_stat;
+                                        uint8_t word0;
+                                        uint8_t word1;
+                                        uint8_t base_reg;
+                                        uint16_t offset;
+                                        uint16_t addr_word;
+                                        uint16_t val_word;
+
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
+                                        gmnec16_err_check_0(bus_stat);
+                                        nec->regs[GM_NEC16_PC] += 2;
+                                        base_reg = (word0 & 0xf0) >> 4;
+                                        offset = (((uint16_t)word0 & 0x0f) << 8) | (uint16_t)word1;
+                                        if(offset & 0x800)
+                                        {
+                                                offset |= 0xf000;
+                                        }
+                                        addr_word = (uint16_t)(nec->regs[base_reg] + offset);
+                                        if(instr.regB == 0xa || instr.regB == 0xc)
+                                        {
+                                                bus_stat = gmnec16_mem_read(nec, addr_word, &word0);
+                                                gmnec16_err_check_0(bus_stat);
+                                                bus_stat = gmnec16_mem_read(nec, (uint16_t)(addr_word + 1), &word1);
+                                                gmnec16_err_check_0(bus_stat);
+                                                val_word = (uint16_t)word0 | (((uint16_t)word1) << 8);
+                                                if(instr.regB == 0xc)
+                                                {
+                                                        nec->regs[base_reg] += 2;
+                                                }
+                                                /* The loaded value wins when reg is also the base */
+                                                nec->regs[realregB] = val_word;
+                                        }
+                                        else
+                                        {
+                                                val_word = nec->regs[realregB];
+                                                bus_stat = gmnec16_mem_write(nec, addr_word, (uint8_t)(val_word & 0xff));
+                                                gmnec16_err_check_0(bus_stat);
+                                                bus_stat = gmnec16_mem_write(nec, (uint16_t)(addr_word + 1), (uint8_t)((val_word & 0xff00) >> 8));
+                                                gmnec16_err_check_0(bus_stat);
+                                                if(instr.regB == 0xd)
+                                                {
+                                                        nec->regs[base_reg] += 2;
+                                                }
+                                        }
+                                }
+                                        break;
+                                /* (ME) XCHG rV, rAddr | CAS rV, rAddr, rExp, the kind is in the 4th byte */
+                                /* XCHG swaps rV with the word at rAddr, CAS stores rV there only when the word equals rExp */
+                                /* (CONDRES 0 when it did, 1 otherwise), rExp receives the old word either way */
+                                case 0xe:
+                                {
+                                        int bus_stat;
+                                        uint8_t word0;
+                                        uint8_t word1;
+                                        uint8_t exp_reg;
+                                        uint16_t addr_word;
+                                        uint16_t val_word;
+
+                                        bus_stat = gmnec16_read_imm_bytes(nec, &word0, &word1);
+                                        gmnec16_err_check_0(bus_stat);
+                                        nec->regs[GM_NEC16_PC] += 2;
+                                        addr_word = nec->regs[(word0 & 0xf0) >> 4];
+                                        exp_reg = word0 & 0xf;
+                                        if(word1 != GM_NEC16_ATOMIC_XCHG && word1 != GM_NEC16_ATOMIC_CAS)
+                                        {
+                                                return GM_NEC16_INSTRUCTIONINVALID;
+                                        }
+                                        if(addr_word & 1)
+                                        {
+                                                return GM_NEC16_ADDRINVALID;
+                                        }
+                                        val_word = nec->regs[realregB];
+                                        bus_stat = gmnec16_atomic(nec, addr_word, word1, nec->regs[exp_reg], &val_word);
+                                        gmnec16_err_check_0(bus_stat);
+                                        if(word1 == GM_NEC16_ATOMIC_XCHG)
+                                        {
+                                                nec->regs[realregB] = val_word;
+                                        }
+                                        else
+                                        {
+                                                nec->regs[GM_NEC16_CONDRES] = (val_word == nec->regs[exp_reg]) ? 0 : 1;
+                                                nec->regs[exp_reg] = val_word;
+                                        }
+                                }
+                                        break;
                                 default:
                                         break;
                                 /* More ME opcodes soon */
 
                         }
+                        break;
+
+                /* Immediate Extension Opcode | ADDI rA, immval */
+                /* Immediate Extension Opcode | SUBI rA, immval */
+                case 0xa:
+                case 0xb:
+                {
+                        int bus_stat;
+                        uint16_t immval;
+
+                        bus_stat = gmnec16_fetch_imm16(nec, &immval);
+                        gmnec16_err_check_0(bus_stat);
+                        if(instr.regA == 0xa)
+                        {
+                                nec->regs[instr.regB] += immval;
+                        }
+                        else
+                        {
+                                nec->regs[instr.regB] -= immval;
+                        }
+                }
+                        break;
+
+                /* Immediate Extension Opcode | EQI/GTI/LTI rA, immval (the comparison is in the low nibble, numbered like EQ/GT/LT) */
+                case 0xc:
+                {
+                        int bus_stat;
+                        uint16_t immval;
+                        int cond_true;
+
+                        bus_stat = gmnec16_fetch_imm16(nec, &immval);
+                        gmnec16_err_check_0(bus_stat);
+                        switch(realregB)
+                        {
+                                case 0x1:
+                                        cond_true = nec->regs[instr.regB] == immval;
+                                        break;
+                                case 0x2:
+                                        cond_true = nec->regs[instr.regB] > immval;
+                                        break;
+                                case 0x3:
+                                        cond_true = nec->regs[instr.regB] < immval;
+                                        break;
+                                default:
+                                        return GM_NEC16_INSTRUCTIONINVALID;
+                        }
+                        nec->regs[GM_NEC16_CONDRES] = cond_true ? 0 : 1;
+                }
+                        break;
+
+                /* Immediate Extension Opcode | BEQ/BNE/BLT rA, rB, immval (compare and jump, CONDRES is left alone) */
+                case 0xd:
+                case 0xe:
+                case 0xf:
+                {
+                        int bus_stat;
+                        uint16_t immval;
+                        int cond_true;
+
+                        bus_stat = gmnec16_fetch_imm16(nec, &immval);
+                        gmnec16_err_check_0(bus_stat);
+                        if(instr.regA == 0xd)
+                        {
+                                cond_true = nec->regs[instr.regB] == nec->regs[realregB];
+                        }
+                        else if(instr.regA == 0xe)
+                        {
+                                cond_true = nec->regs[instr.regB] != nec->regs[realregB];
+                        }
+                        else
+                        {
+                                cond_true = nec->regs[instr.regB] < nec->regs[realregB];
+                        }
+                        if(cond_true)
+                        {
+                                nec->regs[GM_NEC16_PC] = immval;
+                        }
+                }
+                        break;
                 
                 default:
                         break;
@@ -393,7 +988,7 @@ int gmnec16_gm(GM_NEC16* nec, GM_NEC16_Instr instr)
 {
         int bus_stat = 0;
         uint8_t bus_byte;
-        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_INDEX], &bus_byte);
+        bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_INDEX], &bus_byte);
         if(bus_stat < 0)
         {
                 return bus_stat;
@@ -406,7 +1001,7 @@ int gmnec16_sm(GM_NEC16* nec, GM_NEC16_Instr instr)
 {
         int bus_stat = 0;
         uint8_t bus_byte = (uint8_t)(nec->regs[instr.regA] & 0xff);
-        bus_stat = nec->bus_write(nec->data, nec->regs[GM_NEC16_INDEX], bus_byte);
+        bus_stat = gmnec16_mem_write(nec, nec->regs[GM_NEC16_INDEX], bus_byte);
         if(bus_stat < 0)
         {
                 return bus_stat;
@@ -476,12 +1071,20 @@ int gmnec16_mul(GM_NEC16* nec, GM_NEC16_Instr instr)
 
 int gmnec16_div(GM_NEC16* nec, GM_NEC16_Instr instr)
 {
+        if(nec->regs[instr.regB] == 0)
+        {
+                return GM_NEC16_DIVBYZERO;
+        }
         nec->regs[instr.regA] /= nec->regs[instr.regB];
         return 0;
 }
 
 int gmnec16_mod(GM_NEC16* nec, GM_NEC16_Instr instr)
 {
+        if(nec->regs[instr.regB] == 0)
+        {
+                return GM_NEC16_DIVBYZERO;
+        }
         nec->regs[instr.regA] %= nec->regs[instr.regB];
         return 0;
 }
@@ -489,6 +1092,7 @@ int gmnec16_mod(GM_NEC16* nec, GM_NEC16_Instr instr)
 typedef int(*gmnec16_opf)(GM_NEC16*, GM_NEC16_Instr);
 
 /* Execute one instruction and update Program Counter (PC) */
+/* Returns a negative error code, GM_NEC16_HALTED after HLT or 0 */
 int gmnec16_instr_step(GM_NEC16* nec)
 {
 
@@ -501,21 +1105,36 @@ int gmnec16_instr_step(GM_NEC16* nec)
         uint8_t instr0 = 0;
         uint8_t instr1 = 0;
         int bus_stat;
-        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC], &instr0);
-        check(bus_stat);
-        bus_stat = nec->bus_read(nec->data, nec->regs[GM_NEC16_PC] + 1, &instr1);
-        check(bus_stat);
-
         GM_NEC16_Instr instr;
-        instr.opcode = (instr0 & 0xf0) >> 4;
-        instr.regA = instr0 & 0xf;
-        instr.regB = (instr1 & 0xf0) >> 4;
-        instr.immval = (((uint16_t)instr0 & 0x0f) << 8) | (uint16_t)instr1;
-        instr.secondbyte = instr1;
+        const GM_NEC16_Decoded* decoded = nec->decoded[nec->regs[GM_NEC16_PC] >> GM_NEC16_PAGE_SHIFT];
+
+        if(decoded != NULL && decoded[nec->regs[GM_NEC16_PC] & (GM_NEC16_PAGE_SIZE - 1)].opcode != GM_NEC16_NOT_DECODED)
+        {
+                decoded += nec->regs[GM_NEC16_PC] & (GM_NEC16_PAGE_SIZE - 1);
+                instr.opcode = decoded->opcode;
+                instr.regA = decoded->regA;
+                instr.regB = decoded->regB;
+                instr.immval = decoded->immval;
+                instr.secondbyte = decoded->secondbyte;
+                nec->decoded_imm = decoded->imm16;
+        }
+        else
+        {
+                bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_PC], &instr0);
+                check(bus_stat);
+                bus_stat = gmnec16_mem_read(nec, nec->regs[GM_NEC16_PC] + 1, &instr1);
+                check(bus_stat);
+                instr.opcode = (instr0 & 0xf0) >> 4;
+                instr.regA = instr0 & 0xf;
+                instr.regB = (instr1 & 0xf0) >> 4;
+                instr.immval = (((uint16_t)instr0 & 0x0f) << 8) | (uint16_t)instr1;
+                instr.secondbyte = instr1;
+                nec->decoded_imm = -1;
+        }
 
         gmnec16_opf opfs[] = {
 
-                gmnec16_eops, /* 0 (with 4 base opcodes + 5 IE opcodes + 6 SE opcodes + 2 ME opcodes) */
+                gmnec16_eops, /* 0 (with 4 base opcodes + 11 IE opcodes + 7 SE opcodes + 11 ME opcodes) */
                 gmnec16_jmp, /* 1 */
                 gmnec16_gm, /* 2 */
                 gmnec16_sm, /* 3 */
@@ -0,0 +1,917 @@
+/*
+ *
+ * Copyright (c) 2022 GalaxianMonster
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+*/
+
+/* In-process NEC16 assembler, the same syntax as gmnec16asm.py (C89 compatible) */
+
+#ifndef LIBGMNEC16ASM_HEADER
+#define LIBGMNEC16ASM_HEADER
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * Usage
+ *
+ *    GM_NEC16_Asm as;
+ *    gmnec16asm_init(&as);
+ *    if(gmnec16asm_assemble(&as, src, src_len, 3, rom, sizeof(rom), &rom_len) < 0)
+ *    {
+ *            printf("line %lu: %s\n", as.error.line, as.error.message);
+ *    }
+ *    gmnec16asm_free(&as);
+ *
+ * One GM_NEC16_Asm can assemble any number of sources, its tables are kept between calls.
+ * Label names point into the source, so gmnec16asm_label only works while it is still around.
+ * Differences from gmnec16asm.py: labels that are never defined are an error instead of 0,
+ * tabs separate tokens like spaces and .string keeps runs of spaces as written.
+ * Directives only used for objects (.section, .global) are accepted and ignored.
+ *
+ */
+
+#define GM_NEC16_ASM_OK 0
+#define GM_NEC16_ASM_ERR_INSTRUCTION -1
+#define GM_NEC16_ASM_ERR_REGISTER -2
+#define GM_NEC16_ASM_ERR_OPERANDS -3
+#define GM_NEC16_ASM_ERR_NUMBER -4
+#define GM_NEC16_ASM_ERR_LABEL -5
+#define GM_NEC16_ASM_ERR_DIRECTIVE -6
+#define GM_NEC16_ASM_ERR_OUTPUT -7
+#define GM_NEC16_ASM_ERR_MEMORY -8
+
+#define GM_NEC16_ASM_MAX_TOKENS 8
+
+typedef struct __GM_NEC16_ASM_ERROR
+{
+        int code; /* GM_NEC16_ASM_ERR_* */
+        unsigned long line; /* 1 based, 0 when the error isn't about a line */
+        char message[128];
+} GM_NEC16_AsmError;
+
+typedef struct __GM_NEC16_ASM_LABEL
+{
+        const char* name; /* Points into the source, NULL for a free slot */
+        size_t name_len;
+        uint32_t hash;
+        uint32_t value;
+        int defined;
+        long fixups; /* First pending fixup or -1 */
+} GM_NEC16_AsmLabel;
+
+typedef struct __GM_NEC16_ASM_FIXUP
+{
+        size_t at; /* Offset in the output */
+        uint8_t size; /* 1 or 2 bytes */
+        unsigned long line;
+        long next;
+} GM_NEC16_AsmFixup;
+
+typedef struct __GM_NEC16_ASM
+{
+        GM_NEC16_AsmLabel* labels;
+        size_t label_cap; /* Always a power of 2 */
+        size_t label_count;
+        GM_NEC16_AsmFixup* fixups;
+        size_t fixup_cap;
+        size_t fixup_count;
+        uint8_t* out;
+        size_t out_cap;
+        size_t out_len;
+        uint32_t pc;
+        unsigned long line;
+        GM_NEC16_AsmError error;
+} GM_NEC16_Asm;
+
+typedef struct __GM_NEC16_ASM_TOKEN
+{
+        const char* str;
+        size_t len;
+} GM_NEC16_AsmToken;
+
+/* Types of NEC16 opcodes, numbered like in gmnec16asm.py */
+typedef struct __GM_NEC16_ASM_OPCODE
+{
+        const char* name;
+        uint8_t type;
+        uint8_t op;
+        uint8_t extra;
+} GM_NEC16_AsmOpcode;
+
+const GM_NEC16_AsmOpcode gmnec16asm_opcodes[] = {
+        {"nop", 8, 0, 0},
+        {"eq", 7, 1, 0},
+        {"gt", 7, 2, 0},
+        {"lt", 7, 3, 0},
+        {"set", 6, 4, 0},
+        {"cjmp", 5, 5, 0},
+        {"cp", 7, 6, 0},
+        {"swap", 7, 7, 0},
+        {"ujmp", 5, 8, 0},
+        {"addi", 6, 10, 0},
+        {"subi", 6, 11, 0},
+        {"eqi", 17, 12, 1},
+        {"gti", 17, 12, 2},
+        {"lti", 17, 12, 3},
+        {"beq", 18, 13, 0},
+        {"bne", 18, 14, 0},
+        {"blt", 18, 15, 0},
+        {"bgt", 18, 15, 1},
+        {"pushi", 9, 0, 0},
+        {"pushr", 10, 1, 0},
+        {"pop", 10, 2, 0},
+        {"callr", 10, 4, 0},
+        {"calla", 9, 3, 0},
+        {"ret", 11, 5, 0},
+        {"hlt", 11, 8, 0},
+        {"setar", 12, 6, 0},
+        {"setra", 13, 7, 0},
+        {"memcpy", 14, 9, 0},
+        {"memset", 14, 9, 1},
+        {"memcmp", 14, 9, 2},
+        {"xchg", 19, 14, 0},
+        {"cas", 14, 14, 1},
+        {"ldw", 15, 10, 0},
+        {"stw", 16, 11, 0},
+        {"ldwp", 15, 12, 0},
+        {"stwp", 16, 13, 0},
+        {"jmp", 3, 1, 0},
+        {"gm", 3, 2, 0},
+        {"sm", 3, 3, 0},
+        {"or", 4, 4, 0},
+        {"orr", 2, 5, 0},
+        {"and", 2, 6, 0},
+        {"xor", 2, 7, 0},
+        {"not", 3, 8, 0},
+        {"shl", 2, 9, 0},
+        {"shr", 2, 10, 0},
+        {"add", 2, 11, 0},
+        {"sub", 2, 12, 0},
+        {"mul", 2, 13, 0},
+        {"div", 2, 14, 0},
+        {"mod", 2, 15, 0},
+        {NULL, 0, 0, 0}
+};
+
+void gmnec16asm_init(GM_NEC16_Asm* as)
+{
+        memset(as, 0, sizeof(GM_NEC16_Asm));
+}
+
+void gmnec16asm_free(GM_NEC16_Asm* as)
+{
+        free(as->labels);
+        free(as->fixups);
+        gmnec16asm_init(as);
+}
+
+int gmnec16asm_error(GM_NEC16_Asm* as, int code, const char* msg, GM_NEC16_AsmToken* tok)
+{
+        as->error.code = code;
+        as->error.line = as->line;
+        if(tok != NULL)
+        {
+                int len = tok->len > 64 ? 64 : (int)tok->len;
+                sprintf(as->error.message, "%s \"%.*s\"", msg, len, tok->str);
+        }
+        else
+        {
+                sprintf(as->error.message, "%.120s", msg);
+        }
+        return code;
+}
+
+uint32_t gmnec16asm_hash(const char* str, size_t len)
+{
+        uint32_t hash = 2166136261u;
+        size_t i;
+
+        for(i = 0; i < len; i++)
+        {
+                hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+        }
+        return hash;
+}
+
+/* Find a label or make an undefined one */
+GM_NEC16_AsmLabel* gmnec16asm_find_label(GM_NEC16_Asm* as, const char* name, size_t name_len)
+{
+        uint32_t hash = gmnec16asm_hash(name, name_len);
+        size_t i;
+
+        if((as->label_count + 1) * 2 > as->label_cap)
+        {
+                size_t new_cap = as->label_cap == 0 ? 256 : as->label_cap * 2;
+                GM_NEC16_AsmLabel* new_labels = (GM_NEC16_AsmLabel*)calloc(new_cap, sizeof(GM_NEC16_AsmLabel));
+                if(new_labels == NULL)
+                {
+                        return NULL;
+                }
+                for(i = 0; i < as->label_cap; i++)
+                {
+                        if(as->labels[i].name != NULL)
+                        {
+                                size_t j = as->labels[i].hash & (new_cap - 1);
+                                while(new_labels[j].name != NULL)
+                                {
+                                        j = (j + 1) & (new_cap - 1);
+                                }
+                                new_labels[j] = as->labels[i];
+                        }
+                }
+                free(as->labels);
+                as->labels = new_labels;
+                as->label_cap = new_cap;
+        }
+
+        i = hash & (as->label_cap - 1);
+        while(as->labels[i].name != NULL)
+        {
+                if(as->labels[i].hash == hash && as->labels[i].name_len == name_len && memcmp(as->labels[i].name, name, name_len) == 0)
+                {
+                        return &as->labels[i];
+                }
+                i = (i + 1) & (as->label_cap - 1);
+        }
+        as->labels[i].name = name;
+        as->labels[i].name_len = name_len;
+        as->labels[i].hash = hash;
+        as->labels[i].value = 0;
+        as->labels[i].defined = 0;
+        as->labels[i].fixups = -1;
+        as->label_count++;
+        return &as->labels[i];
+}
+
+/* Look up the address of a label after assembling */
+int gmnec16asm_label(GM_NEC16_Asm* as, const char* name, uint16_t* value)
+{
+        size_t len = strlen(name);
+        uint32_t hash = gmnec16asm_hash(name, len);
+        size_t i;
+
+        if(as->label_cap == 0)
+        {
+                return GM_NEC16_ASM_ERR_LABEL;
+        }
+        i = hash & (as->label_cap - 1);
+        while(as->labels[i].name != NULL)
+        {
+                if(as->labels[i].hash == hash && as->labels[i].name_len == len && memcmp(as->labels[i].name, name, len) == 0 && as->labels[i].defined)
+                {
+                        *value = (uint16_t)as->labels[i].value;
+                        return GM_NEC16_ASM_OK;
+                }
+                i = (i + 1) & (as->label_cap - 1);
+        }
+        return GM_NEC16_ASM_ERR_LABEL;
+}
+
+int gmnec16asm_emit(GM_NEC16_Asm* as, const uint8_t* b, size_t len)
+{
+        if(as->out_len + len > as->out_cap)
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_OUTPUT, "Output buffer is full", NULL);
+        }
+        memcpy(as->out + as->out_len, b, len);
+        as->out_len += len;
+        as->pc += (uint32_t)len;
+        return GM_NEC16_ASM_OK;
+}
+
+int gmnec16asm_put_value(GM_NEC16_Asm* as, size_t at, uint8_t size, uint32_t value)
+{
+        if(value >= ((uint32_t)1 << (8 * size)))
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_NUMBER, size == 1 ? "Value doesn't fit in 1 byte" : "Value doesn't fit in 2 bytes", NULL);
+        }
+        as->out[at] = (uint8_t)(value & 0xff);
+        if(size == 2)
+        {
+                as->out[at + 1] = (uint8_t)((value >> 8) & 0xff);
+        }
+        return GM_NEC16_ASM_OK;
+}
+
+/* Plain number, 0x/0b/0o prefixes or decimal */
+int gmnec16asm_number(GM_NEC16_Asm* as, GM_NEC16_AsmToken* tok, uint32_t* value)
+{
+        const char* s = tok->str;
+        size_t len = tok->len;
+        uint32_t base = 10;
+        uint32_t v = 0;
+        size_t i;
+
+        if(len >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'b' || s[1] == 'o'))
+        {
+                base = s[1] == 'x' ? 16 : (s[1] == 'b' ? 2 : 8);
+                s += 2;
+                len -= 2;
+        }
+        if(len == 0)
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_NUMBER, "Invalid number argument", tok);
+        }
+        for(i = 0; i < len; i++)
+        {
+                uint32_t d;
+                char c = s[i];
+                if(c >= '0' && c <= '9')
+                {
+                        d = (uint32_t)(c - '0');
+                }
+                else if(c >= 'a' && c <= 'f')
+                {
+                        d = (uint32_t)(c - 'a' + 10);
+                }
+                else if(c >= 'A' && c <= 'F')
+                {
+                        d = (uint32_t)(c - 'A' + 10);
+                }
+                else
+                {
+                        d = base;
+                }
+                if(d >= base || v > 0xffffff)
+                {
+                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_NUMBER, "Invalid number argument", tok);
+                }
+                v = v * base + d;
+        }
+        *value = v;
+        return GM_NEC16_ASM_OK;
+}
+
+/* Number or ::label for the value at the current output offset + value_offset */
+int gmnec16asm_value(GM_NEC16_Asm* as, GM_NEC16_AsmToken* tok, size_t value_offset, uint8_t size, uint32_t* value)
+{
+        int stat;
+
+        if(tok->len >= 2 && tok->str[0] == ':' && tok->str[1] == ':')
+        {
+                GM_NEC16_AsmLabel* label = gmnec16asm_find_label(as, tok->str + 2, tok->len - 2);
+                if(label == NULL)
+                {
+                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_MEMORY, "Out of memory", NULL);
+                }
+                if(label->defined)
+                {
+                        *value = label->value;
+                }
+                else
+                {
+                        if(as->fixup_count == as->fixup_cap)
+                        {
+                                size_t new_cap = as->fixup_cap == 0 ? 256 : as->fixup_cap * 2;
+                                GM_NEC16_AsmFixup* new_fixups = (GM_NEC16_AsmFixup*)realloc(as->fixups, new_cap * sizeof(GM_NEC16_AsmFixup));
+                                if(new_fixups == NULL)
+                                {
+                                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_MEMORY, "Out of memory", NULL);
+                                }
+                                as->fixups = new_fixups;
+                                as->fixup_cap = new_cap;
+                        }
+                        as->fixups[as->fixup_count].at = as->out_len + value_offset;
+                        as->fixups[as->fixup_count].size = size;
+                        as->fixups[as->fixup_count].line = as->line;
+                        as->fixups[as->fixup_count].next = label->fixups;
+                        label->fixups = (long)as->fixup_count;
+                        as->fixup_count++;
+                        *value = 0;
+                }
+        }
+        else
+        {
+                stat = gmnec16asm_number(as, tok, value);
+                if(stat < 0)
+                {
+                        return stat;
+                }
+        }
+        if(*value >= ((uint32_t)1 << (8 * size)))
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_NUMBER, size == 1 ? "Value doesn't fit in 1 byte" : "Value doesn't fit in 2 bytes", tok);
+        }
+        return GM_NEC16_ASM_OK;
+}
+
+int gmnec16asm_reg(GM_NEC16_Asm* as, GM_NEC16_AsmToken* tok, uint8_t* r)
+{
+        const char* s = tok->str;
+        size_t len = tok->len;
+
+        if(len >= 2 && len <= 3 && s[0] == 'r' && s[1] >= '0' && s[1] <= '9')
+        {
+                if(len == 2)
+                {
+                        *r = (uint8_t)(s[1] - '0');
+                        return GM_NEC16_ASM_OK;
+                }
+                if(s[1] == '1' && s[2] >= '0' && s[2] <= '5')
+                {
+                        *r = (uint8_t)(10 + s[2] - '0');
+                        return GM_NEC16_ASM_OK;
+                }
+        }
+        if(len == 3 && memcmp(s, "acc", 3) == 0) { *r = 0; return GM_NEC16_ASM_OK; }
+        if(len == 3 && memcmp(s, "idx", 3) == 0) { *r = 1; return GM_NEC16_ASM_OK; }
+        if(len == 3 && memcmp(s, "cdr", 3) == 0) { *r = 2; return GM_NEC16_ASM_OK; }
+        if(len == 2 && memcmp(s, "pc", 2) == 0) { *r = 15; return GM_NEC16_ASM_OK; }
+        if(len == 2 && memcmp(s, "ip", 2) == 0) { *r = 15; return GM_NEC16_ASM_OK; }
+        if(len == 2 && memcmp(s, "sp", 2) == 0) { *r = 13; return GM_NEC16_ASM_OK; }
+        if(len == 2 && memcmp(s, "sb", 2) == 0) { *r = 12; return GM_NEC16_ASM_OK; }
+        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_REGISTER, "Invalid register", tok);
+}
+
+/* Signed 12 bit offset of LDW/STW */
+int gmnec16asm_offset(GM_NEC16_Asm* as, GM_NEC16_AsmToken* tok, uint16_t* off)
+{
+        GM_NEC16_AsmToken num = *tok;
+        int negative = 0;
+        uint32_t v;
+        int stat;
+
+        if(num.len >= 1 && num.str[0] == '-')
+        {
+                negative = 1;
+                num.str++;
+                num.len--;
+        }
+        stat = gmnec16asm_number(as, &num, &v);
+        if(stat < 0)
+        {
+                return stat;
+        }
+        if((negative && v > 2048) || (!negative && v > 2047))
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_NUMBER, "Offsets must be in the range -2048 to 2047", tok);
+        }
+        *off = (uint16_t)((negative ? (0x1000 - v) : v) & 0xfff);
+        return GM_NEC16_ASM_OK;
+}
+
+int gmnec16asm_is_space(char c)
+{
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+/* Split a line into tokens, returns the total number of tokens (only the first GM_NEC16_ASM_MAX_TOKENS are kept) */
+int gmnec16asm_tokenize(const char* line, size_t len, int commas, GM_NEC16_AsmToken* toks)
+{
+        size_t i = 0;
+        int count = 0;
+
+        while(i < len)
+        {
+                size_t start;
+                while(i < len && (gmnec16asm_is_space(line[i]) || (commas && line[i] == ',')))
+                {
+                        i++;
+                }
+                if(i >= len)
+                {
+                        break;
+                }
+                start = i;
+                while(i < len && !gmnec16asm_is_space(line[i]) && !(commas && line[i] == ','))
+                {
+                        i++;
+                }
+                if(count < GM_NEC16_ASM_MAX_TOKENS)
+                {
+                        toks[count].str = line + start;
+                        toks[count].len = i - start;
+                }
+                count++;
+        }
+        return count;
+}
+
+/* In place str.replace(), to is never longer than from */
+size_t gmnec16asm_replace(char* buf, size_t len, const char* from, const char* to)
+{
+        size_t from_len = strlen(from);
+        size_t to_len = strlen(to);
+        size_t r = 0;
+        size_t w = 0;
+
+        while(r < len)
+        {
+                if(r + from_len <= len && memcmp(buf + r, from, from_len) == 0)
+                {
+                        memcpy(buf + w, to, to_len);
+                        w += to_len;
+                        r += from_len;
+                }
+                else
+                {
+                        buf[w++] = buf[r++];
+                }
+        }
+        return w;
+}
+
+int gmnec16asm_directive(GM_NEC16_Asm* as, const char* line, size_t len)
+{
+        GM_NEC16_AsmToken toks[GM_NEC16_ASM_MAX_TOKENS];
+        int count = gmnec16asm_tokenize(line, len, 0, toks);
+        uint32_t value;
+        int stat;
+
+        if(toks[0].len == 7 && memcmp(toks[0].str, ".string", 7) == 0 && count >= 2)
+        {
+                /* Same escapes, in the same order, as gmnec16asm.py */
+                size_t str_len = (size_t)(line + len - toks[1].str);
+                char* buf = (char*)malloc(str_len);
+                size_t i;
+                if(buf == NULL)
+                {
+                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_MEMORY, "Out of memory", NULL);
+                }
+                memcpy(buf, toks[1].str, str_len);
+                str_len = gmnec16asm_replace(buf, str_len, "\\n", "\n");
+                str_len = gmnec16asm_replace(buf, str_len, "\\r", "\r");
+                str_len = gmnec16asm_replace(buf, str_len, "\\t", "\t");
+                str_len = gmnec16asm_replace(buf, str_len, "\\\\", "\\");
+                str_len = gmnec16asm_replace(buf, str_len, "\"", "");
+                str_len = gmnec16asm_replace(buf, str_len, "\\0", "");
+                for(i = 0; i < str_len; i++)
+                {
+                        if((uint8_t)buf[i] >= 0x80)
+                        {
+                                free(buf);
+                                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_DIRECTIVE, "'.string' only supports ASCII", NULL);
+                        }
+                }
+                stat = gmnec16asm_emit(as, (uint8_t*)buf, str_len);
+                free(buf);
+                return stat;
+        }
+        /* Like gmnec16asm.py, the other directives take exactly 1 argument and are skipped otherwise */
+        if(count != 2)
+        {
+                return GM_NEC16_ASM_OK;
+        }
+        if(toks[0].len == 5 && memcmp(toks[0].str, ".byte", 5) == 0)
+        {
+                uint8_t b;
+                stat = gmnec16asm_value(as, &toks[1], 0, 1, &value);
+                if(stat == GM_NEC16_ASM_ERR_NUMBER)
+                {
+                        sprintf(as->error.message, "'.byte' only supports values 0 to 255");
+                }
+                if(stat < 0)
+                {
+                        return stat;
+                }
+                b = (uint8_t)value;
+                return gmnec16asm_emit(as, &b, 1);
+        }
+        if(toks[0].len == 7 && memcmp(toks[0].str, ".setapc", 7) == 0)
+        {
+                stat = gmnec16asm_number(as, &toks[1], &value);
+                if(stat < 0)
+                {
+                        return stat;
+                }
+                as->pc = value;
+                return GM_NEC16_ASM_OK;
+        }
+        if(toks[0].len == 7 && memcmp(toks[0].str, ".jlabel", 7) == 0)
+        {
+                GM_NEC16_AsmLabel* label = gmnec16asm_find_label(as, toks[1].str, toks[1].len);
+                long fix;
+                if(label == NULL)
+                {
+                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_MEMORY, "Out of memory", NULL);
+                }
+                for(fix = label->fixups; fix >= 0; fix = as->fixups[fix].next)
+                {
+                        stat = gmnec16asm_put_value(as, as->fixups[fix].at, as->fixups[fix].size, as->pc);
+                        if(stat < 0)
+                        {
+                                return stat;
+                        }
+                }
+                /* Pending fixups stay on the label, a label defined again patches them again like gmnec16asm.py does */
+                label->value = as->pc;
+                label->defined = 1;
+                return GM_NEC16_ASM_OK;
+        }
+        return GM_NEC16_ASM_OK;
+}
+
+/* Check the operand count, an extra token is only allowed when it starts a comment */
+int gmnec16asm_operands(GM_NEC16_Asm* as, int count, GM_NEC16_AsmToken* toks, int needed, const char* msg)
+{
+        if(count < needed + 1)
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_OPERANDS, msg, NULL);
+        }
+        if(count > needed + 1 && toks[needed + 1].str[0] != ';')
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_OPERANDS, "Additional arguments to this instruction type are not allowed", NULL);
+        }
+        return GM_NEC16_ASM_OK;
+}
+
+#define gmnec16asm_check(x) stat = (x); if(stat < 0) { return stat; }
+
+int gmnec16asm_instruction(GM_NEC16_Asm* as, const char* line, size_t len)
+{
+        GM_NEC16_AsmToken toks[GM_NEC16_ASM_MAX_TOKENS];
+        const GM_NEC16_AsmOpcode* opc;
+        int count = gmnec16asm_tokenize(line, len, 1, toks);
+        uint8_t b[4];
+        uint8_t rA;
+        uint8_t rB;
+        uint8_t rC;
+        uint32_t value;
+        uint16_t off;
+        char mnemonic[8];
+        size_t i;
+        int stat;
+
+        if(toks[0].len >= sizeof(mnemonic))
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_INSTRUCTION, "Invalid instruction", &toks[0]);
+        }
+        for(i = 0; i < toks[0].len; i++)
+        {
+                char c = toks[0].str[i];
+                mnemonic[i] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+        }
+        mnemonic[toks[0].len] = 0;
+        for(opc = gmnec16asm_opcodes; opc->name != NULL; opc++)
+        {
+                if(opc->name[0] == mnemonic[0] && strcmp(opc->name, mnemonic) == 0)
+                {
+                        break;
+                }
+        }
+        if(opc->name == NULL)
+        {
+                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_INSTRUCTION, "Invalid instruction", &toks[0]);
+        }
+
+        switch(opc->type)
+        {
+                case 2:
+                case 7:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 2, "2 registers needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[2], &rB));
+                        if(opc->type == 2)
+                        {
+                                b[0] = (uint8_t)((opc->op << 4) | rA);
+                                b[1] = (uint8_t)(rB << 4);
+                        }
+                        else
+                        {
+                                b[0] = opc->op;
+                                b[1] = (uint8_t)((rA << 4) | rB);
+                        }
+                        return gmnec16asm_emit(as, b, 2);
+                case 3:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 1, "1 register needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        b[0] = (uint8_t)((opc->op << 4) | rA);
+                        b[1] = 0;
+                        return gmnec16asm_emit(as, b, 2);
+                case 4:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 2, "1 register and an immediate value are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_value(as, &toks[2], 1, 1, &value));
+                        b[0] = (uint8_t)((opc->op << 4) | rA);
+                        b[1] = (uint8_t)value;
+                        return gmnec16asm_emit(as, b, 2);
+                case 5:
+                case 9:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 1, "1 immediate value needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_value(as, &toks[1], 2, 2, &value));
+                        b[0] = opc->type == 5 ? opc->op : 9;
+                        b[1] = opc->type == 5 ? 0 : (uint8_t)(opc->op << 4);
+                        b[2] = (uint8_t)(value & 0xff);
+                        b[3] = (uint8_t)(value >> 8);
+                        return gmnec16asm_emit(as, b, 4);
+                case 6:
+                case 17:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 2, "1 register and an immediate value are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_value(as, &toks[2], 2, 2, &value));
+                        b[0] = opc->op;
+                        b[1] = (uint8_t)((rA << 4) | (opc->type == 17 ? opc->extra : 0));
+                        b[2] = (uint8_t)(value & 0xff);
+                        b[3] = (uint8_t)(value >> 8);
+                        return gmnec16asm_emit(as, b, 4);
+                case 8:
+                        b[0] = 0;
+                        b[1] = 0;
+                        return gmnec16asm_emit(as, b, 2);
+                case 10:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 1, "1 register is needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        b[0] = 9;
+                        b[1] = (uint8_t)((opc->op << 4) | rA);
+                        return gmnec16asm_emit(as, b, 2);
+                case 11:
+                        b[0] = 9;
+                        b[1] = (uint8_t)(opc->op << 4);
+                        return gmnec16asm_emit(as, b, 2);
+                case 12:
+                case 13:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 2, "1 immediate value/address and 1 register are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[opc->type == 12 ? 2 : 1], &rA));
+                        gmnec16asm_check(gmnec16asm_value(as, &toks[opc->type == 12 ? 1 : 2], 2, 2, &value));
+                        b[0] = 9;
+                        b[1] = (uint8_t)((opc->op << 4) | rA);
+                        b[2] = (uint8_t)(value & 0xff);
+                        b[3] = (uint8_t)(value >> 8);
+                        return gmnec16asm_emit(as, b, 4);
+                case 14:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 3, "3 registers are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[2], &rB));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[3], &rC));
+                        b[0] = 9;
+                        b[1] = (uint8_t)((opc->op << 4) | rA);
+                        b[2] = (uint8_t)((rB << 4) | rC);
+                        b[3] = opc->extra;
+                        return gmnec16asm_emit(as, b, 4);
+                case 19:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 2, "2 registers are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[2], &rB));
+                        b[0] = 9;
+                        b[1] = (uint8_t)((opc->op << 4) | rA);
+                        b[2] = (uint8_t)(rB << 4);
+                        b[3] = opc->extra;
+                        return gmnec16asm_emit(as, b, 4);
+                case 15:
+                case 16:
+                {
+                        /* The offset may be left out */
+                        GM_NEC16_AsmToken zero;
+                        GM_NEC16_AsmToken* rtok;
+                        GM_NEC16_AsmToken* basetok;
+                        GM_NEC16_AsmToken* offtok;
+                        if(count < 3)
+                        {
+                                return gmnec16asm_error(as, GM_NEC16_ASM_ERR_OPERANDS, "1 register, 1 base register and an optional offset are needed for this instruction type", NULL);
+                        }
+                        zero.str = "0";
+                        zero.len = 1;
+                        if(count == 3 || toks[3].str[0] == ';')
+                        {
+                                offtok = &zero;
+                                rtok = &toks[opc->type == 15 ? 1 : 2];
+                                basetok = &toks[opc->type == 15 ? 2 : 1];
+                        }
+                        else
+                        {
+                                gmnec16asm_check(gmnec16asm_operands(as, count, toks, 3, ""));
+                                offtok = &toks[opc->type == 15 ? 3 : 2];
+                                rtok = &toks[opc->type == 15 ? 1 : 3];
+                                basetok = &toks[1 + (opc->type == 15)];
+                        }
+                        gmnec16asm_check(gmnec16asm_reg(as, rtok, &rA));
+                        gmnec16asm_check(gmnec16asm_reg(as, basetok, &rB));
+                        gmnec16asm_check(gmnec16asm_offset(as, offtok, &off));
+                        b[0] = 9;
+                        b[1] = (uint8_t)((opc->op << 4) | rA);
+                        b[2] = (uint8_t)((rB << 4) | (off >> 8));
+                        b[3] = (uint8_t)(off & 0xff);
+                        return gmnec16asm_emit(as, b, 4);
+                }
+                case 18:
+                        gmnec16asm_check(gmnec16asm_operands(as, count, toks, 3, "2 registers and an immediate value/address are needed for this instruction type"));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[1], &rA));
+                        gmnec16asm_check(gmnec16asm_reg(as, &toks[2], &rB));
+                        gmnec16asm_check(gmnec16asm_value(as, &toks[3], 2, 2, &value));
+                        if(opc->extra == 1)
+                        {
+                                rC = rA;
+                                rA = rB;
+                                rB = rC;
+                        }
+                        b[0] = opc->op;
+                        b[1] = (uint8_t)((rA << 4) | rB);
+                        b[2] = (uint8_t)(value & 0xff);
+                        b[3] = (uint8_t)(value >> 8);
+                        return gmnec16asm_emit(as, b, 4);
+                default:
+                        break;
+        }
+        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_INSTRUCTION, "Invalid instruction", &toks[0]);
+}
+
+#undef gmnec16asm_check
+
+/* Assemble src into out, *out_len is the number of bytes written */
+/* Returns GM_NEC16_ASM_OK or a GM_NEC16_ASM_ERR_* code with as->error filled in */
+int gmnec16asm_assemble(GM_NEC16_Asm* as, const char* src, size_t src_len, uint16_t start_pc, uint8_t* out, size_t out_cap, size_t* out_len)
+{
+        size_t pos = 0;
+        size_t i;
+        int stat;
+
+        if(as->labels != NULL)
+        {
+                memset(as->labels, 0, as->label_cap * sizeof(GM_NEC16_AsmLabel));
+        }
+        as->label_count = 0;
+        as->fixup_count = 0;
+        as->out = out;
+        as->out_cap = out_cap;
+        as->out_len = 0;
+        as->pc = start_pc;
+        as->line = 0;
+        as->error.code = GM_NEC16_ASM_OK;
+        as->error.line = 0;
+        as->error.message[0] = 0;
+        *out_len = 0;
+
+        while(pos < src_len)
+        {
+                const char* line = src + pos;
+                const char* nl = (const char*)memchr(line, '\n', src_len - pos);
+                size_t len = nl == NULL ? src_len - pos : (size_t)(nl - line);
+                pos += len + 1;
+                as->line++;
+
+                while(len > 0 && gmnec16asm_is_space(line[len - 1]))
+                {
+                        len--;
+                }
+                while(len > 0 && gmnec16asm_is_space(line[0]))
+                {
+                        line++;
+                        len--;
+                }
+                if(len == 0 || line[0] == ';')
+                {
+                        continue;
+                }
+                if(line[0] == '.')
+                {
+                        stat = gmnec16asm_directive(as, line, len);
+                }
+                else
+                {
+                        stat = gmnec16asm_instruction(as, line, len);
+                }
+                if(stat < 0)
+                {
+                        *out_len = as->out_len;
+                        return stat;
+                }
+        }
+
+        for(i = 0; i < as->label_cap; i++)
+        {
+                if(as->labels[i].name != NULL && !as->labels[i].defined)
+                {
+                        GM_NEC16_AsmToken tok;
+                        tok.str = as->labels[i].name;
+                        tok.len = as->labels[i].name_len;
+                        as->line = as->fixups[as->labels[i].fixups].line;
+                        *out_len = as->out_len;
+                        return gmnec16asm_error(as, GM_NEC16_ASM_ERR_LABEL, "Label is never defined", &tok);
+                }
+        }
+        *out_len = as->out_len;
+        return GM_NEC16_ASM_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,153 +1,494 @@
 /* TIOS, a simple I/O system for NEC16 */
 
-#include <libgmnec16.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
+#include "tios.h"
 
-/* addr 0 - exit, addr 1 - input, addr 2 - output */
-/* 32 KiB ROM starts at addr 3 */
-/* addr (32 * 1024 + 3) to addr (64 * 1024 - 1) are the address space for RAM */
-
-int g_DEBUG_ENABLED = 0;
-#define debugexec(f) if(g_DEBUG_ENABLED == 1) { f; }
-
-typedef struct __COMPUTER
+/* Execution profile (--profile=<file>) for gmnec16layout.py */
+/* Counts every executed PC and every step that didn't just go to one of the next 2 instructions */
+typedef struct __PROFILE
 {
-    GM_NEC16 cpu;
-    uint8_t memory[0x10000 - 3];
-    uint8_t exit_flag;
-} computer_t;
+    uint64_t* pc_counts;
+    uint32_t* edge_keys; /* from << 16 | to, PROFILE_FREE_KEY for free slots */
+    uint64_t* edge_counts;
+    uint32_t edge_cap;
+    uint32_t edge_count;
+} profile_t;
+
+#define PROFILE_FREE_KEY 0xffffffffu
 
-int tios_mmu_read(void* data, uint16_t addr, uint8_t* ib)
+int profile_alloc_edges(profile_t* prof, uint32_t cap)
 {
-    computer_t com = *(computer_t*)(data);
+    uint32_t* old_keys = prof->edge_keys;
+    uint64_t* old_counts = prof->edge_counts;
+    uint32_t old_cap = prof->edge_cap;
+    uint32_t i;
 
-    debugexec(printf("\n[READ_REQ] >> addr:%04X\n", addr));
-    switch(addr)
+    prof->edge_keys = malloc(cap * sizeof(uint32_t));
+    prof->edge_counts = calloc(cap, sizeof(uint64_t));
+    if(prof->edge_keys == NULL || prof->edge_counts == NULL)
+    {
+        return -1;
+    }
+    memset(prof->edge_keys, 0xff, cap * sizeof(uint32_t));
+    prof->edge_cap = cap;
+    for(i = 0; i < old_cap; i++)
     {
-        case 0: return GM_NEC16_ADDRINVALID;
-        case 2: return GM_NEC16_ADDRINVALID;
-        case 1:
-            scanf("%c", (char*)ib);
-            break;
-        default:
-            debugexec(printf("\n[READ_REQ] >> ib:%02X\n", com.memory[addr - 3]));
-            *ib = com.memory[addr - 3];
-            break;
+        if(old_keys[i] != PROFILE_FREE_KEY)
+        {
+            uint32_t j = (old_keys[i] * 2654435761u) & (cap - 1);
+            while(prof->edge_keys[j] != PROFILE_FREE_KEY)
+            {
+                j = (j + 1) & (cap - 1);
+            }
+            prof->edge_keys[j] = old_keys[i];
+            prof->edge_counts[j] = old_counts[i];
+        }
     }
+    free(old_keys);
+    free(old_counts);
     return 0;
 }
 
-char* get_error_type(int errcode)
+int profile_init(profile_t* prof)
 {
-
-    switch(errcode)
+    memset(prof, 0, sizeof(profile_t));
+    prof->pc_counts = calloc(0x10000, sizeof(uint64_t));
+    if(prof->pc_counts == NULL)
     {
-        case GM_NEC16_ADDRINVALID:
-            return "Address invalid";
-        case GM_NEC16_INSTRUCTIONINVALID:
-            return "Instruction invalid";
-        default:
-            return "Unknown error";
+        return -1;
     }
-
+    return profile_alloc_edges(prof, 1024);
 }
 
-int tios_mmu_write(void* data, uint16_t addr, uint8_t ob)
+void profile_step(profile_t* prof, uint16_t from, uint16_t to)
 {
-    computer_t* comptr = (computer_t*)(data);
+    uint32_t key;
+    uint32_t i;
 
-    debugexec(printf("\n[WRITE_REQ] >> addr:%04X ob:%02X\n", addr, ob));
-    switch(addr)
+    prof->pc_counts[from]++;
+    if((uint16_t)(to - from) == 2 || (uint16_t)(to - from) == 4)
     {
-        case 0: comptr->exit_flag = 1; break;
-        case 2: printf("%c", ob); break;
-        case 1: return GM_NEC16_ADDRINVALID;
-        default:
-            comptr->memory[addr - 3] = ob;
-            break;
+        return;
     }
-    return 0;
+    if((prof->edge_count + 1) * 2 > prof->edge_cap && profile_alloc_edges(prof, prof->edge_cap * 2) < 0)
+    {
+        return;
+    }
+    key = ((uint32_t)from << 16) | to;
+    i = (key * 2654435761u) & (prof->edge_cap - 1);
+    while(prof->edge_keys[i] != key && prof->edge_keys[i] != PROFILE_FREE_KEY)
+    {
+        i = (i + 1) & (prof->edge_cap - 1);
+    }
+    if(prof->edge_keys[i] == PROFILE_FREE_KEY)
+    {
+        prof->edge_keys[i] = key;
+        prof->edge_count++;
+    }
+    prof->edge_counts[i]++;
 }
 
-int loadrom(computer_t* com, const char* filename)
+int profile_write(profile_t* prof, const char* filename)
 {
-    FILE* fptr = fopen(filename, "rb");
+    FILE* fptr = fopen(filename, "w");
+    uint32_t i;
 
     if(fptr == NULL)
     {
         printf("[ERROR] >> Error opening '%s'\n", filename);
         return -1;
     }
-    fread(com->memory, 1, 32*1024, fptr);
+    fprintf(fptr, "; NEC16 profile\n");
+    for(i = 0; i < 0x10000; i++)
+    {
+        if(prof->pc_counts[i] != 0)
+        {
+            fprintf(fptr, "pc 0x%04X %llu\n", i, (unsigned long long)prof->pc_counts[i]);
+        }
+    }
+    for(i = 0; i < prof->edge_cap; i++)
+    {
+        if(prof->edge_keys[i] != PROFILE_FREE_KEY)
+        {
+            fprintf(fptr, "edge 0x%04X 0x%04X %llu\n", prof->edge_keys[i] >> 16, prof->edge_keys[i] & 0xffff, (unsigned long long)prof->edge_counts[i]);
+        }
+    }
     fclose(fptr);
     return 0;
 }
 
-int main(int args, char** argv)
+/* Memory analysis (--heatmap=<file>) for gmnec16heat.py */
+/* Counts reads, writes and executions of every address, data accesses are counted on the bus so the fast memory path is off */
+/* Reads of the running instruction's own 4 bytes are taken as fetches and only counted as its execution */
+/* The working set of a window (--heatmap-window=<instructions>) is the number of 64 byte lines it touched */
+#define HEATMAP_LINE_SHIFT 6
+#define HEATMAP_LINES (0x10000 >> HEATMAP_LINE_SHIFT)
+#define HEATMAP_DEFAULT_WINDOW 100000
+
+typedef struct __HEATMAP
 {
-    int instr_counts = 0;
-    int instr_count = 0;
-    int instr_lim_enabled = 0;
-    computer_t com;
-    com.exit_flag = 0;
-    com.cpu.bus_read = tios_mmu_read;
-    com.cpu.bus_write = tios_mmu_write;
-    com.cpu.data = (void*)&com;
-    com.cpu.regs[GM_NEC16_PC] = 3;
+    uint64_t* counts; /* Read, write and execute count of every address */
+    uint8_t window_lines[HEATMAP_LINES];
+    uint32_t window_touched;
+    uint64_t window_len;
+    uint64_t window_pos;
+    uint32_t* window_sizes; /* Lines touched by every finished window */
+    uint32_t* window_pages; /* 256 byte pages touched by every finished window */
+    uint32_t window_count;
+    uint32_t window_cap;
+    uint32_t ram_exec[0x10000 - (32 * 1024 + 3)]; /* Steps that went to code in RAM, by address */
+    uint16_t pc; /* Of the running instruction */
+} heatmap_t;
+
+heatmap_t* g_HEATMAP = NULL;
 
-    if(args < 2)
+int heatmap_init(heatmap_t* heat, uint64_t window_len)
+{
+    memset(heat, 0, sizeof(heatmap_t));
+    heat->counts = calloc(0x10000 * 3, sizeof(uint64_t));
+    heat->window_cap = 1024;
+    heat->window_sizes = malloc(heat->window_cap * sizeof(uint32_t));
+    heat->window_pages = malloc(heat->window_cap * sizeof(uint32_t));
+    heat->window_len = window_len;
+    if(heat->counts == NULL || heat->window_sizes == NULL || heat->window_pages == NULL)
     {
-        printf("No file to execute.\n");
-        return 0;
+        return -1;
     }
-    if(args >= 3)
+    return 0;
+}
+
+void heatmap_touch(heatmap_t* heat, uint16_t addr, int kind)
+{
+    uint32_t line = addr >> HEATMAP_LINE_SHIFT;
+
+    heat->counts[(uint32_t)addr * 3 + (uint32_t)kind]++;
+    if(heat->window_lines[line] == 0)
     {
-        if(strcmp("-d", argv[2]) == 0)
+        heat->window_lines[line] = 1;
+        heat->window_touched++;
+    }
+}
+
+void heatmap_end_window(heatmap_t* heat)
+{
+    uint32_t pages = 0;
+    uint32_t line;
+
+    if(heat->window_count == heat->window_cap)
+    {
+        uint32_t* sizes = realloc(heat->window_sizes, heat->window_cap * 2 * sizeof(uint32_t));
+        uint32_t* page_counts = realloc(heat->window_pages, heat->window_cap * 2 * sizeof(uint32_t));
+
+        if(sizes != NULL)
         {
-            g_DEBUG_ENABLED = 1;
+            heat->window_sizes = sizes;
         }
+        if(page_counts != NULL)
+        {
+            heat->window_pages = page_counts;
+        }
+        if(sizes == NULL || page_counts == NULL)
+        {
+            /* Keep the windows so far */
+            return;
+        }
+        heat->window_cap *= 2;
     }
-    if(args >= 4)
+    for(line = 0; line < HEATMAP_LINES; line += GM_NEC16_PAGE_SIZE >> HEATMAP_LINE_SHIFT)
     {
-        instr_counts = atoi(argv[3]);
-        instr_lim_enabled = 1;
+        if(memchr(&heat->window_lines[line], 1, GM_NEC16_PAGE_SIZE >> HEATMAP_LINE_SHIFT) != NULL)
+        {
+            pages++;
+        }
     }
+    heat->window_sizes[heat->window_count] = heat->window_touched;
+    heat->window_pages[heat->window_count] = pages;
+    heat->window_count++;
+    memset(heat->window_lines, 0, sizeof(heat->window_lines));
+    heat->window_touched = 0;
+    heat->window_pos = 0;
+}
 
-    if(loadrom(&com, argv[1]) < 0)
+void heatmap_step(heatmap_t* heat, uint16_t from, uint16_t to)
+{
+    heatmap_touch(heat, from, 2);
+    heat->pc = to;
+    if(to >= (32 * 1024 + 3))
     {
+        heat->ram_exec[to - (32 * 1024 + 3)]++;
+    }
+    heat->window_pos++;
+    if(heat->window_pos == heat->window_len)
+    {
+        heatmap_end_window(heat);
+    }
+}
 
-        return 1;
+int heatmap_read(void* data, uint16_t addr, uint8_t* ib)
+{
+    int result = tios_mmu_read(data, addr, ib);
+
+    /* A console read that would block is done again later */
+    if((uint16_t)(addr - g_HEATMAP->pc) >= 4 && result != TIOS_WOULD_BLOCK)
+    {
+        heatmap_touch(g_HEATMAP, addr, 0);
+    }
+    return result;
+}
+
+int heatmap_write(void* data, uint16_t addr, uint8_t ob)
+{
+    heatmap_touch(g_HEATMAP, addr, 1);
+    return tios_mmu_write(data, addr, ob);
+}
+
+int heatmap_atomic(void* data, uint16_t addr, uint8_t kind, uint16_t expected, uint16_t* val)
+{
+    heatmap_touch(g_HEATMAP, addr, 0);
+    heatmap_touch(g_HEATMAP, (uint16_t)(addr + 1), 0);
+    heatmap_touch(g_HEATMAP, addr, 1);
+    heatmap_touch(g_HEATMAP, (uint16_t)(addr + 1), 1);
+    return tios_mmu_atomic(data, addr, kind, expected, val);
+}
+
+int heatmap_write_file(heatmap_t* heat, const char* filename)
+{
+    FILE* fptr = fopen(filename, "w");
+    uint32_t i;
+
+    if(fptr == NULL)
+    {
+        printf("[ERROR] >> Error opening '%s'\n", filename);
+        return -1;
+    }
+    if(heat->window_pos > 0)
+    {
+        heatmap_end_window(heat);
+    }
+    fprintf(fptr, "; NEC16 heatmap\n");
+    fprintf(fptr, "window %llu\n", (unsigned long long)heat->window_len);
+    for(i = 0; i < 0x10000; i++)
+    {
+        uint64_t* c = &heat->counts[i * 3];
+
+        if(c[0] != 0 || c[1] != 0 || c[2] != 0)
+        {
+            fprintf(fptr, "addr 0x%04X %llu %llu %llu\n", i, (unsigned long long)c[0], (unsigned long long)c[1], (unsigned long long)c[2]);
+        }
+    }
+    for(i = 0; i < heat->window_count; i++)
+    {
+        fprintf(fptr, "ws %u %u %u\n", i, heat->window_sizes[i], heat->window_pages[i]);
+    }
+    for(i = 0; i < sizeof(heat->ram_exec) / sizeof(heat->ram_exec[0]); i++)
+    {
+        if(heat->ram_exec[i] != 0)
+        {
+            fprintf(fptr, "ramexec 0x%04X %u\n", i + (32 * 1024 + 3), heat->ram_exec[i]);
+        }
+    }
+    fclose(fptr);
+    return 0;
+}
+
+/* Per step hook of --profile and --heatmap */
+typedef struct __ANALYSIS
+{
+    profile_t* prof;
+    heatmap_t* heat;
+} analysis_t;
 
+void analysis_hook(void* data, core_t* core, uint16_t from)
+{
+    analysis_t* an = (analysis_t*)data;
+
+    if(an->prof != NULL)
+    {
+        profile_step(an->prof, from, core->cpu.regs[GM_NEC16_PC]);
     }
+    if(an->heat != NULL)
+    {
+        heatmap_step(an->heat, from, core->cpu.regs[GM_NEC16_PC]);
+    }
+}
 
-    while(com.exit_flag != 1)
+/* Hibernation (--hibernate=<file>), SIGUSR1 stops the machine between instructions and its state is written to the file */
+/* The state is also written when the instruction limit stops the machine, a machine that exited or failed leaves none */
+/* A guest waiting for console input hibernates at once, before the read */
+computer_t* g_HIBERNATE_MACHINE = NULL;
+volatile sig_atomic_t g_HIBERNATING = 0;
+
+void hibernate_signal(int sig)
+{
+    (void)sig;
+    if(g_HIBERNATE_MACHINE != NULL && g_HIBERNATE_MACHINE->exit_flag == 0)
     {
-        int inres;
+        g_HIBERNATING = 1;
+        g_HIBERNATE_MACHINE->exit_flag = 1;
+    }
+}
 
-        if(instr_lim_enabled)
+int hibernate_write(computer_t* com, const char* filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0)
+    {
+        printf("[ERROR] >> Can't create '%s'\n", filename);
+        return -1;
+    }
+    if(tios_hibernate(com, fd) < 0 || close(fd) < 0)
+    {
+        printf("[ERROR] >> Error writing '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int args, char** argv)
+{
+    int instr_counts = 0;
+    int instr_lim_enabled = 0;
+    int positional = 0;
+    int i;
+    const char* profile_file = NULL;
+    const char* heatmap_file = NULL;
+    const char* hibernate_file = NULL;
+    long heatmap_window = HEATMAP_DEFAULT_WINDOW;
+    tios_config_t conf;
+    profile_t prof;
+    analysis_t an;
+    computer_t com;
+    sched_t sched;
+    guest_t* guest;
+
+    tios_config_init(&conf);
+
+    /* tios <rom> [-d] [instruction limit] [--options], options may go anywhere, the ROM is ignored with --resume */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
         {
-            instr_count += 1;
-            if(instr_count >= instr_counts)
+            int parsed = tios_parse_option(&conf, argv[i]);
+
+            if(parsed < 0)
             {
-                break;
+                return 1;
             }
+            if(parsed == 0 && strncmp(argv[i], "--profile=", 10) == 0)
+            {
+                profile_file = argv[i] + 10;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--heatmap=", 10) == 0)
+            {
+                heatmap_file = argv[i] + 10;
+                conf.bus_only = 1;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--hibernate=", 12) == 0)
+            {
+                hibernate_file = argv[i] + 12;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--heatmap-window=", 17) == 0)
+            {
+                heatmap_window = atol(argv[i] + 17);
+                if(heatmap_window <= 0)
+                {
+                    printf("[ERROR] >> The heatmap window has to be at least 1 instruction\n");
+                    return 1;
+                }
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
         }
-        inres = gmnec16_instr_step(&(com.cpu));
-
-        if(com.cpu.regs[GM_NEC16_PC] >= (32 * 1024 + 3))
+        positional++;
+        if(positional == 1)
+        {
+            conf.rom_file = argv[i];
+        }
+        if(positional == 2 && strcmp("-d", argv[i]) == 0)
+        {
+            g_DEBUG_ENABLED = 1;
+        }
+        if(positional == 3)
         {
-            printf("[ERROR] >> Attempted to execute code from RAM\n");
-            com.exit_flag = 1;
+            instr_counts = atoi(argv[i]);
+            instr_lim_enabled = 1;
         }
-        if(inres < 0)
+    }
+    if(conf.rom_file == NULL && conf.resume_file == NULL)
+    {
+        printf("No file to execute.\n");
+        return 0;
+    }
+    prof.pc_counts = NULL;
+    if(profile_file != NULL && profile_init(&prof) < 0)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    if(heatmap_file != NULL)
+    {
+        g_HEATMAP = malloc(sizeof(heatmap_t));
+        if(g_HEATMAP == NULL || heatmap_init(g_HEATMAP, (uint64_t)heatmap_window) < 0)
         {
-            printf("[ERROR] >> Received error code %d, '%s'\n", inres, get_error_type(inres));
-            com.exit_flag = 1;
+            printf("[ERROR] >> Out of memory\n");
+            return 1;
         }
     }
+    if(tios_init(&com, &conf) < 0)
+    {
+        return 1;
+    }
+    if(g_HEATMAP != NULL)
+    {
+        com.cores[0].cpu.bus_read = heatmap_read;
+        com.cores[0].cpu.bus_write = heatmap_write;
+        com.cores[0].cpu.bus_atomic = heatmap_atomic;
+        g_HEATMAP->pc = com.cores[0].cpu.regs[GM_NEC16_PC];
+    }
+    sched_init(&sched, TIOS_STATS_SLICE);
+    guest = sched_add(&sched, &com.cores[0]);
+    if(guest == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    if(instr_lim_enabled)
+    {
+        /* The limit counts the instruction it stops at */
+        guest->budget = (instr_counts > 0) ? (uint64_t)(instr_counts - 1) : 0;
+    }
+    an.prof = (prof.pc_counts != NULL) ? &prof : NULL;
+    an.heat = g_HEATMAP;
+    if(an.prof != NULL || an.heat != NULL)
+    {
+        guest->hook = analysis_hook;
+        guest->hook_data = &an;
+    }
+    if(hibernate_file != NULL)
+    {
+        g_HIBERNATE_MACHINE = &com;
+        signal(SIGUSR1, hibernate_signal);
+    }
+    sched_run(&sched);
+    tios_stats_close(&com);
+
+    fflush(stdout);
+    if(hibernate_file != NULL && (g_HIBERNATING || com.exit_flag == 0) && hibernate_write(&com, hibernate_file) < 0)
+    {
+        return 1;
+    }
+    if(prof.pc_counts != NULL)
+    {
+        profile_write(&prof, profile_file);
+    }
+    if(g_HEATMAP != NULL)
+    {
+        heatmap_write_file(g_HEATMAP, heatmap_file);
+    }
 
     return 0;
 }
@@ -0,0 +1,2271 @@
+/* TIOS, a simple I/O system for NEC16 */
+/* The machine itself, shared by the tios front ends */
+
+#ifndef TIOS_HEADER
+#define TIOS_HEADER
+
+#include <libgmnec16.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+
+/* addr 0 - exit, addr 1 - input, addr 2 - output */
+/* 32 KiB ROM starts at addr 3 */
+/* addr (32 * 1024 + 3) to addr (64 * 1024 - 1) are the address space for RAM */
+
+/* ROM images are either raw (loaded at addr 3, execution starts there) or ROM containers made by gmnec16rom.py */
+/* Container header (little endian): "NEC16ROM", version (2), header size (2), entry point (2), segment count (2), */
+/* CRC-32 of the whole file with the CRC field zeroed (4), followed by the segment table */
+/* Segment: load address (2), flags (2, 0 for now), length (4), file offset (4) */
+/* Segment data whose file offset equals its load address modulo the host page size is mapped straight from the file */
+#define TIOS_ROM_MAGIC "NEC16ROM"
+#define TIOS_ROM_VERSION 1
+#define TIOS_ROM_HEADER_SIZE 20
+#define TIOS_ROM_SEGMENT_SIZE 12
+#define TIOS_ROM_CRC_OFFSET 16
+
+/* A halted CPU sleeps until input arrives or the timer ticks */
+#define TIOS_HALT_TICK_MS 10
+
+/* The console is read with read(2) into input_pending, never through stdio, so TIOS always holds the input it took */
+#define TIOS_CONSOLE_CHUNK 4096
+
+/* Result of a console read with no input yet on a machine that mustn't block (under the scheduler), not an error */
+/* The instruction hasn't happened, tios_step puts the PC back so it runs again once there is input */
+#define TIOS_WOULD_BLOCK -16
+
+/* Extended I/O page, device registers replace the last page of RAM when a device is attached */
+#define TIOS_XIO_BASE 0xff00
+
+/* Block device (--blockdev=<file>), the file is seen through a 4 KiB window of RAM */
+/* Registers are little endian, the window shows the file from offset BANK * TIOS_BLK_WINDOW_SIZE */
+/* Bytes after the end of the file read as 0, writes to the window are never written back to the file */
+#define TIOS_BLK_WINDOW 0xe000
+#define TIOS_BLK_WINDOW_SIZE 0x1000
+#define TIOS_BLK_BANK 0xff00 /* 4 bytes */
+#define TIOS_BLK_SIZE 0xff04 /* 8 bytes, read only, size of the file */
+#define TIOS_BLK_STATUS 0xff0c /* read only, 1 when a file is attached */
+
+/* Bank switching (--banks=<count>), the address space is cut into 8 windows of 8 KiB */
+/* Banks 0 - 7 are the windows' own memory, banks 8 and up are the extra ones, a window shows the bank in its register */
+/* Only windows 5 - 7 (0xa000 - 0xffff) can be switched, device pages stay on top of whatever bank is shown */
+/* Banks 0 - 4 hold ROM (and the end of its last immediate at 0x8000 - 0x8002), a switched window can't show them */
+/* so the predecoded ROM is never written behind its back. Each byte written to a register is applied on its own, */
+/* a value that is one of those banks or a bank that doesn't exist leaves the window and its register as they were */
+#define TIOS_BANK_SIZE 0x2000
+#define TIOS_BANK_WINDOWS 8
+#define TIOS_BANK_FIRST_SWITCHED 5
+#define TIOS_BANK_MAX_EXTRA (0x10000 - TIOS_BANK_WINDOWS)
+#define TIOS_BANK_COUNT 0xff0e /* 2 bytes, read only, number of extra banks */
+#define TIOS_BANK_REGS 0xff10 /* 2 bytes per window */
+
+/* Cores (tiosmp), every core has its own registers over the same memory and devices, all of them start at the entry point */
+/* See the memory ordering of libgmnec16.h, TIOS makes XCHG/CAS on memory atomic with the host's atomics */
+#define TIOS_MAX_CORES 16
+#define TIOS_CORE_ID 0xff20 /* 2 bytes, read only, id of the reading core (0 boots first) */
+#define TIOS_CORE_COUNT 0xff22 /* 2 bytes, read only */
+
+/* Channels (tiospipe), byte queues between machines in the same process, each machine has at most 1 in and 1 out */
+/* By default a send to a full channel and a receive from an empty one wait for the other machine */
+/* Without blocking a full send is dropped and an empty receive reads 0, so the guest checks the status first */
+/* Once the other machine stops, receives read 0 after the last byte and sends are dropped */
+#define TIOS_CHAN_SEND 0xff30 /* write only */
+#define TIOS_CHAN_RECV 0xff31 /* read only */
+#define TIOS_CHAN_STATUS 0xff32 /* read only, TIOS_CHAN_* bits */
+#define TIOS_CHAN_CONTROL 0xff33 /* bit 0 - block (1 at start) */
+#define TIOS_CHAN_CAN_RECV 0x01
+#define TIOS_CHAN_CAN_SEND 0x02
+#define TIOS_CHAN_IN_CLOSED 0x04 /* No more bytes will arrive */
+#define TIOS_CHAN_OUT_CLOSED 0x08 /* Nobody reads what is sent */
+#define TIOS_CHAN_DEFAULT_SIZE 0x10000
+#define TIOS_CHAN_SPINS 1000 /* Status checks before a waiting machine sleeps */
+
+/* Clocks (--clock), reading byte 0 of a counter latches all 8 bytes for the reading core, the other bytes read the latch */
+/* so a counter is read with LDW from the lowest word up, the counters are worked out on a read and cost nothing in between */
+#define TIOS_CLOCK_INSTRS 0xff40 /* 8 bytes, read only, instructions the reading core retired before the reading one */
+#define TIOS_CLOCK_USEC 0xff48 /* 8 bytes, read only, microseconds of the host's monotonic clock since the machine started */
+
+/* Instructions in the whole pages of ROM (0x0000 - 0x7fff) are predecoded, 0 - 2 are I/O */
+#define TIOS_DECODED_LEN 0x8000
+
+/* Live stats (--stats), every machine publishes a tios_stats_t in the shared memory segment /tios.<pid>.<machine> */
+/* Front ends publish after every slice of TIOS_STATS_SLICE instructions and whenever a core halts, never per instruction */
+/* The segment is removed when the machine stops normally, tiostop shows (and cleans) the ones left by killed processes */
+#define TIOS_STATS_MAGIC "TIOSSTAT"
+#define TIOS_STATS_VERSION 1
+#define TIOS_STATS_PREFIX "tios."
+#define TIOS_STATS_SLICE 0x10000
+#define TIOS_STATS_MAX_NAMES 64 /* Machines per process whose segments are removed when it is killed */
+#define TIOS_STATS_RATE_NS 500000000ull /* instrs_per_sec is measured over at least this long */
+#define TIOS_STATE_RUNNING 0
+#define TIOS_STATE_HALTED 1 /* Every core halted, waiting for input or the timer */
+#define TIOS_STATE_INPUT 2 /* Blocked reading addr 1 */
+
+/* Hibernation (--resume=<file>, tios --hibernate=<file>), the whole machine in a versioned state file */
+/* File (little endian): "NEC16HIB", version (2), 0 (2), then records of tag (4), body length (4) and body */
+/* MACH (first): core count (2), TIOS_HIB_* flags (2), bank count (4), bank registers (2 each), blockdev bank (4), */
+/* blockdev size (8), microseconds since the machine started (8) */
+/* CORE (every core): id (2), registers (2 each), instrs, bus reads, bus writes, input bytes, output bytes, clock latches (8 each) */
+/* PAGE (every 256 byte page that isn't all 0): space (1, TIOS_HIB_SPACE_*), page number (4), the page as runs, a control */
+/* byte c below 128 is followed by c + 1 literal bytes, any other by 1 byte repeated c - 125 times */
+/* INPT: input that was read from the console but not by the guest yet, it is replayed before the console on resume */
+/* END (last): CRC-32 of everything before it, unknown records are skipped */
+/* Files are streamed through a small buffer, the blockdev file itself is not saved, resume attaches it again with --blockdev */
+#define TIOS_HIB_MAGIC "NEC16HIB"
+#define TIOS_HIB_VERSION 1
+#define TIOS_HIB_BUF_SIZE 4096
+#define TIOS_HIB_SMP 0x01
+#define TIOS_HIB_CLOCK 0x02
+#define TIOS_HIB_BLOCKDEV 0x04
+#define TIOS_HIB_SPACE_MEMORY 0
+#define TIOS_HIB_SPACE_BANKS 1
+
+int g_DEBUG_ENABLED = 0;
+#define debugexec(f) if(g_DEBUG_ENABLED == 1) { f; }
+
+typedef struct __BLOCKDEV
+{
+    uint8_t* file; /* The whole file, mmapped and rounded up to whole windows */
+    uint64_t size;
+    uint64_t map_size;
+    uint32_t bank;
+    uint8_t* zero_window; /* Shown for banks after the end of the file */
+} blockdev_t;
+
+/* Single producer, single consumer ring, head and tail live on their own cache lines */
+/* The lock and wake are only used to sleep on a full or empty ring */
+typedef struct __CHANNEL
+{
+    uint8_t* buf;
+    uint32_t mask; /* size - 1, size is a power of 2 */
+    uint32_t head __attribute__((aligned(64))); /* Written by the consumer only */
+    uint32_t tail __attribute__((aligned(64))); /* Written by the producer only */
+    uint8_t writer_closed __attribute__((aligned(64)));
+    uint8_t reader_closed;
+    uint32_t sleeping; /* Threads waiting on wake */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} channel_t;
+
+typedef struct __CORE
+{
+    GM_NEC16 cpu;
+    struct __COMPUTER* com;
+    uint16_t id;
+    uint64_t instrs; /* Retired instructions, up to the start of the current run (see tios_run) */
+    uint64_t run_len; /* Instructions of the current run */
+    uint64_t run_left; /* Still to go, the counter of the run loop itself */
+    uint64_t clock_latch[2]; /* TIOS_CLOCK_INSTRS and TIOS_CLOCK_USEC */
+    uint64_t bus_reads; /* Accesses that went through the bus, the fast memory path is not counted */
+    uint64_t bus_writes;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+} core_t;
+
+/* Fixed layout, readers copy it while seq is even and unchanged */
+typedef struct __TIOS_STATS
+{
+    char magic[8]; /* TIOS_STATS_MAGIC */
+    uint32_t version; /* TIOS_STATS_VERSION */
+    uint32_t seq; /* Odd while being written */
+    uint32_t pid;
+    uint32_t machine; /* Machines of the same process count up from 0 */
+    uint32_t core_count;
+    uint32_t state; /* TIOS_STATE_* */
+    uint64_t start_ns; /* CLOCK_MONOTONIC */
+    uint64_t update_ns;
+    uint64_t instrs;
+    uint64_t instrs_per_sec;
+    uint64_t bus_reads;
+    uint64_t bus_writes;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+    uint16_t pc[TIOS_MAX_CORES];
+    char rom[128];
+} tios_stats_t;
+
+/* Machine options shared by the front ends */
+typedef struct __TIOS_CONFIG
+{
+    const char* rom_file;
+    const char* blockdev_file;
+    int bank_count;
+    int core_count;
+    int smp; /* The core registers are there even with 1 core */
+    int stats;
+    int clock;
+    int bus_only; /* Every ROM and RAM access goes through the bus, like in debug mode */
+    const char* resume_file; /* Hibernated machine to resume instead of loading rom_file */
+    const struct __COMPUTER* image; /* Machine that loaded the ROM already, its memory and predecoded ROM are used instead of rom_file */
+    const uint8_t* rom_data; /* Raw image (loaded at addr 3) to use instead of rom_file, for tools that build ROMs in memory */
+    size_t rom_len;
+    int headless; /* Console input comes from input_pending only and output goes to the output buffer */
+} tios_config_t;
+
+typedef struct __COMPUTER
+{
+    core_t* cores; /* The bus data of every core is its core_t */
+    uint32_t core_count;
+    uint8_t smp;
+    uint8_t* memory; /* 64 KiB, indexed by address (0 - 2 unused) */
+    uint8_t* host_pages[GM_NEC16_PAGE_COUNT]; /* Host memory of every page, NULL for the extended I/O page */
+    blockdev_t blk;
+    uint8_t* banks; /* Extra banks */
+    uint32_t bank_count;
+    uint16_t bank_regs[TIOS_BANK_WINDOWS];
+    channel_t* chan_in;
+    channel_t* chan_out;
+    uint8_t chan_control;
+    pthread_mutex_t chan_locks[2]; /* Receive and send, each end of a ring is used by one core at a time */
+    pthread_mutex_t xio_lock; /* Device registers are written by one core at a time */
+    uint8_t xio_enabled;
+    volatile uint8_t exit_flag;
+    volatile uint8_t input_eof;
+    uint8_t* input_pending; /* Console input not read by the guest yet (or the whole input of a headless machine) */
+    uint32_t input_pending_len;
+    uint32_t input_pending_pos;
+    uint32_t input_pending_cap; /* 0 until the console is read into it */
+    uint8_t input_nonblock; /* Console reads return TIOS_WOULD_BLOCK instead of waiting */
+    pthread_mutex_t input_lock; /* Console reads of every core */
+    uint8_t headless;
+    uint8_t* output; /* Console output of a headless machine */
+    size_t output_len;
+    size_t output_cap;
+    GM_NEC16_Decoded* decoded; /* Predecoded ROM, NULL when it isn't predecoded */
+    uint8_t decoded_owned; /* 0 when the table is the image's */
+    uint8_t clock_enabled;
+    uint8_t bus_only; /* No fast memory path, in debug mode and when asked for */
+    uint64_t start_ns;
+    tios_stats_t* stats; /* NULL without --stats */
+    char stats_name[64];
+    pthread_mutex_t stats_lock;
+    uint64_t rate_ns; /* Start of the current rate measurement */
+    uint64_t rate_instrs;
+} computer_t;
+
+uint32_t g_TIOS_MACHINES = 0;
+char g_TIOS_STATS_NAMES[TIOS_STATS_MAX_NAMES][64]; /* Segments to remove on SIGINT and SIGTERM */
+
+/* size is rounded up to a power of 2 */
+int channel_init(channel_t* ch, uint32_t size)
+{
+    uint32_t real_size = 1;
+
+    while(real_size < size)
+    {
+        real_size <<= 1;
+    }
+    memset(ch, 0, sizeof(channel_t));
+    ch->buf = malloc(real_size);
+    if(ch->buf == NULL)
+    {
+        return -1;
+    }
+    ch->mask = real_size - 1;
+    pthread_mutex_init(&ch->lock, NULL);
+    pthread_cond_init(&ch->wake, NULL);
+    return 0;
+}
+
+void channel_wake(channel_t* ch)
+{
+    if(__atomic_load_n(&ch->sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&ch->lock);
+        pthread_cond_broadcast(&ch->wake);
+        pthread_mutex_unlock(&ch->lock);
+    }
+}
+
+void channel_close_writer(channel_t* ch)
+{
+    __atomic_store_n(&ch->writer_closed, 1, __ATOMIC_SEQ_CST);
+    channel_wake(ch);
+}
+
+void channel_close_reader(channel_t* ch)
+{
+    __atomic_store_n(&ch->reader_closed, 1, __ATOMIC_SEQ_CST);
+    channel_wake(ch);
+}
+
+/* TIOS_CHAN_* bits as seen by the reader (in) or the writer (out) */
+uint8_t channel_status(channel_t* ch, int in)
+{
+    uint32_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+
+    if(in)
+    {
+        return (uint8_t)((head != tail ? TIOS_CHAN_CAN_RECV : 0) | (head == tail && __atomic_load_n(&ch->writer_closed, __ATOMIC_ACQUIRE) ? TIOS_CHAN_IN_CLOSED : 0));
+    }
+    if(__atomic_load_n(&ch->reader_closed, __ATOMIC_ACQUIRE))
+    {
+        return TIOS_CHAN_OUT_CLOSED;
+    }
+    return (tail - head <= ch->mask) ? TIOS_CHAN_CAN_SEND : 0;
+}
+
+/* Sleep until the status has one of the bits in want, *stop is set or TIOS_HALT_TICK_MS passed */
+void channel_wait(channel_t* ch, int in, uint8_t want, volatile uint8_t* stop)
+{
+    struct timespec until;
+
+    pthread_mutex_lock(&ch->lock);
+    __atomic_add_fetch(&ch->sleeping, 1, __ATOMIC_SEQ_CST);
+    if((channel_status(ch, in) & want) == 0 && *stop == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TIOS_HALT_TICK_MS * 1000000L;
+        if(until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&ch->wake, &ch->lock, &until);
+    }
+    __atomic_sub_fetch(&ch->sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+/* Returns 1 when the byte was queued */
+int channel_send(channel_t* ch, uint8_t ob, int block, volatile uint8_t* stop)
+{
+    uint8_t status = channel_status(ch, 0);
+    uint32_t tail;
+    int spins = 0;
+
+    while(block && (status & (TIOS_CHAN_CAN_SEND | TIOS_CHAN_OUT_CLOSED)) == 0 && *stop == 0)
+    {
+        if(++spins > TIOS_CHAN_SPINS)
+        {
+            channel_wait(ch, 0, TIOS_CHAN_CAN_SEND | TIOS_CHAN_OUT_CLOSED, stop);
+        }
+        status = channel_status(ch, 0);
+    }
+    if((status & TIOS_CHAN_CAN_SEND) == 0)
+    {
+        return 0;
+    }
+    tail = ch->tail;
+    ch->buf[tail & ch->mask] = ob;
+    __atomic_store_n(&ch->tail, tail + 1, __ATOMIC_SEQ_CST);
+    channel_wake(ch);
+    return 1;
+}
+
+/* Returns 1 when a byte was taken */
+int channel_recv(channel_t* ch, uint8_t* ib, int block, volatile uint8_t* stop)
+{
+    uint8_t status = channel_status(ch, 1);
+    uint32_t head;
+    int spins = 0;
+
+    while(block && (status & (TIOS_CHAN_CAN_RECV | TIOS_CHAN_IN_CLOSED)) == 0 && *stop == 0)
+    {
+        if(++spins > TIOS_CHAN_SPINS)
+        {
+            channel_wait(ch, 1, TIOS_CHAN_CAN_RECV | TIOS_CHAN_IN_CLOSED, stop);
+        }
+        status = channel_status(ch, 1);
+    }
+    if((status & TIOS_CHAN_CAN_RECV) == 0)
+    {
+        *ib = 0;
+        return 0;
+    }
+    head = ch->head;
+    *ib = ch->buf[head & ch->mask];
+    __atomic_store_n(&ch->head, head + 1, __ATOMIC_SEQ_CST);
+    channel_wake(ch);
+    return 1;
+}
+
+/* Point the whole pages of [addr, addr + len) to host, for the bus and (unless debugging) the fast memory path of the cores */
+void tios_map(computer_t* com, uint16_t addr, uint32_t len, uint8_t* host)
+{
+    uint32_t i;
+
+    for(i = 0; i < len; i += GM_NEC16_PAGE_SIZE)
+    {
+        com->host_pages[(addr + i) >> GM_NEC16_PAGE_SHIFT] = (host == NULL) ? NULL : host + i;
+    }
+    if(!com->bus_only && addr != 0)
+    {
+        for(i = 0; i < com->core_count; i++)
+        {
+            gmnec16_map_pages(&com->cores[i].cpu, addr, len, host);
+        }
+    }
+}
+
+int blockdev_open(computer_t* com, const char* filename)
+{
+    blockdev_t* blk = &com->blk;
+    uint64_t align = TIOS_BLK_WINDOW_SIZE;
+    struct stat st;
+    void* base;
+    int fd = open(filename, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("[ERROR] >> Error opening '%s'\n", filename);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    if((uint64_t)sysconf(_SC_PAGESIZE) > align)
+    {
+        align = (uint64_t)sysconf(_SC_PAGESIZE);
+    }
+    blk->size = (uint64_t)st.st_size;
+    blk->map_size = (blk->size + align - 1) / align * align;
+    if(blk->map_size == 0)
+    {
+        blk->map_size = align;
+    }
+    /* Reserve zeroed memory for whole windows first, so reading past the end of the file never faults */
+    base = mmap(NULL, blk->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    blk->zero_window = mmap(NULL, TIOS_BLK_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED || blk->zero_window == MAP_FAILED
+        || (blk->size > 0 && mmap(base, blk->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED))
+    {
+        printf("[ERROR] >> Error mapping '%s'\n", filename);
+        /* tios_free only unmaps a block device that opened */
+        if(base != MAP_FAILED)
+        {
+            munmap(base, blk->map_size);
+        }
+        if(blk->zero_window != MAP_FAILED)
+        {
+            munmap(blk->zero_window, TIOS_BLK_WINDOW_SIZE);
+        }
+        blk->zero_window = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    blk->file = (uint8_t*)base;
+    blk->bank = 0;
+    return 0;
+}
+
+void blockdev_map(computer_t* com)
+{
+    blockdev_t* blk = &com->blk;
+    uint64_t offset = (uint64_t)blk->bank * TIOS_BLK_WINDOW_SIZE;
+
+    if(offset < blk->map_size)
+    {
+        tios_map(com, TIOS_BLK_WINDOW, TIOS_BLK_WINDOW_SIZE, blk->file + offset);
+    }
+    else
+    {
+        memset(blk->zero_window, 0, TIOS_BLK_WINDOW_SIZE);
+        tios_map(com, TIOS_BLK_WINDOW, TIOS_BLK_WINDOW_SIZE, blk->zero_window);
+    }
+}
+
+/* Show bank in a switched window, returns -1 (and changes nothing) when the window can't show it */
+int bank_map(computer_t* com, uint32_t window, uint32_t bank)
+{
+    uint8_t* host;
+
+    if(bank < TIOS_BANK_FIRST_SWITCHED)
+    {
+        return -1;
+    }
+    else if(bank < TIOS_BANK_WINDOWS)
+    {
+        host = com->memory + bank * TIOS_BANK_SIZE;
+    }
+    else if(bank - TIOS_BANK_WINDOWS < com->bank_count)
+    {
+        host = com->banks + (size_t)(bank - TIOS_BANK_WINDOWS) * TIOS_BANK_SIZE;
+    }
+    else
+    {
+        return -1;
+    }
+    com->bank_regs[window] = (uint16_t)bank;
+    tios_map(com, (uint16_t)(window * TIOS_BANK_SIZE), TIOS_BANK_SIZE, host);
+    if(com->blk.file != NULL && window == TIOS_BLK_WINDOW / TIOS_BANK_SIZE)
+    {
+        blockdev_map(com);
+    }
+    if(com->xio_enabled && window == TIOS_XIO_BASE / TIOS_BANK_SIZE)
+    {
+        tios_map(com, TIOS_XIO_BASE, GM_NEC16_PAGE_SIZE, NULL);
+    }
+    return 0;
+}
+
+uint64_t tios_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void tios_stats_signal(int sig)
+{
+    uint32_t i;
+
+    for(i = 0; i < g_TIOS_MACHINES && i < TIOS_STATS_MAX_NAMES; i++)
+    {
+        if(g_TIOS_STATS_NAMES[i][0] != 0)
+        {
+            shm_unlink(g_TIOS_STATS_NAMES[i]);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Create the stats segment of a machine */
+int tios_stats_open(computer_t* com, const char* rom_file)
+{
+    uint32_t i;
+    int fd;
+
+    com->stats = NULL;
+    pthread_mutex_init(&com->stats_lock, NULL);
+    snprintf(com->stats_name, sizeof(com->stats_name), "/" TIOS_STATS_PREFIX "%u.%u", (unsigned)getpid(), (unsigned)g_TIOS_MACHINES);
+    fd = shm_open(com->stats_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        printf("[ERROR] >> Can't create the stats segment '%s'\n", com->stats_name);
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(tios_stats_t)) < 0)
+    {
+        printf("[ERROR] >> Can't create the stats segment '%s'\n", com->stats_name);
+        close(fd);
+        shm_unlink(com->stats_name);
+        return -1;
+    }
+    com->stats = mmap(NULL, sizeof(tios_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(com->stats == MAP_FAILED)
+    {
+        com->stats = NULL;
+        printf("[ERROR] >> Can't map the stats segment '%s'\n", com->stats_name);
+        shm_unlink(com->stats_name);
+        return -1;
+    }
+    com->stats->version = TIOS_STATS_VERSION;
+    com->stats->pid = (uint32_t)getpid();
+    com->stats->machine = g_TIOS_MACHINES;
+    com->stats->core_count = com->core_count;
+    com->stats->start_ns = tios_now_ns();
+    com->stats->update_ns = com->stats->start_ns;
+    com->rate_ns = com->stats->start_ns;
+    for(i = 0; i < com->core_count; i++)
+    {
+        /* A resumed machine starts with the instructions it ran before */
+        com->rate_instrs += com->cores[i].instrs;
+    }
+    snprintf(com->stats->rom, sizeof(com->stats->rom), "%s", rom_file);
+    if(g_TIOS_MACHINES < TIOS_STATS_MAX_NAMES)
+    {
+        memcpy(g_TIOS_STATS_NAMES[g_TIOS_MACHINES], com->stats_name, sizeof(com->stats_name));
+    }
+    if(g_TIOS_MACHINES == 0)
+    {
+        signal(SIGINT, tios_stats_signal);
+        signal(SIGTERM, tios_stats_signal);
+    }
+    /* Readers skip the segment until the magic is there */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(com->stats->magic, TIOS_STATS_MAGIC, 8);
+    return 0;
+}
+
+void tios_stats_close(computer_t* com)
+{
+    if(com->stats != NULL)
+    {
+        if(com->stats->machine < TIOS_STATS_MAX_NAMES)
+        {
+            g_TIOS_STATS_NAMES[com->stats->machine][0] = 0;
+        }
+        munmap(com->stats, sizeof(tios_stats_t));
+        shm_unlink(com->stats_name);
+        com->stats = NULL;
+    }
+}
+
+/* Just the state, for a core that is about to block */
+void tios_stats_state(computer_t* com, uint32_t state)
+{
+    if(com->stats != NULL)
+    {
+        __atomic_store_n(&com->stats->state, state, __ATOMIC_RELAXED);
+    }
+}
+
+/* Publish the counters of every core, called by the front ends between slices */
+void tios_stats_update(computer_t* com, uint32_t state)
+{
+    tios_stats_t* st = com->stats;
+    uint64_t now;
+    uint64_t instrs = 0;
+    uint64_t counts[4] = {0, 0, 0, 0};
+    uint32_t seq;
+    uint32_t i;
+
+    if(st == NULL)
+    {
+        return;
+    }
+    now = tios_now_ns();
+    pthread_mutex_lock(&com->stats_lock);
+    /* Counters of the other cores may be a slice behind */
+    for(i = 0; i < com->core_count; i++)
+    {
+        core_t* core = &com->cores[i];
+
+        instrs += __atomic_load_n(&core->instrs, __ATOMIC_RELAXED);
+        counts[0] += __atomic_load_n(&core->bus_reads, __ATOMIC_RELAXED);
+        counts[1] += __atomic_load_n(&core->bus_writes, __ATOMIC_RELAXED);
+        counts[2] += __atomic_load_n(&core->input_bytes, __ATOMIC_RELAXED);
+        counts[3] += __atomic_load_n(&core->output_bytes, __ATOMIC_RELAXED);
+    }
+    seq = st->seq;
+    __atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if(now - com->rate_ns >= TIOS_STATS_RATE_NS)
+    {
+        st->instrs_per_sec = (instrs - com->rate_instrs) * 1000000000ull / (now - com->rate_ns);
+        com->rate_ns = now;
+        com->rate_instrs = instrs;
+    }
+    st->update_ns = now;
+    st->state = state;
+    st->instrs = instrs;
+    st->bus_reads = counts[0];
+    st->bus_writes = counts[1];
+    st->input_bytes = counts[2];
+    st->output_bytes = counts[3];
+    for(i = 0; i < com->core_count; i++)
+    {
+        st->pc[i] = com->cores[i].cpu.regs[GM_NEC16_PC];
+    }
+    __atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&com->stats_lock);
+}
+
+/* Copy the stats of another process, returns -1 when they don't settle */
+int tios_stats_read(const tios_stats_t* st, tios_stats_t* out)
+{
+    int tries;
+
+    for(tries = 0; tries < 1000; tries++)
+    {
+        uint32_t seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+
+        if(seq & 1)
+        {
+            continue;
+        }
+        memcpy(out, (const void*)st, sizeof(tios_stats_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&st->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Registers of the extended I/O page, unused ones read as 0 and ignore writes */
+int tios_xio_read(core_t* core, uint16_t addr, uint8_t* ib)
+{
+    computer_t* com = core->com;
+
+    *ib = 0;
+    if(com->blk.file != NULL)
+    {
+        if(addr >= TIOS_BLK_BANK && addr < TIOS_BLK_BANK + 4)
+        {
+            *ib = (uint8_t)(com->blk.bank >> (8 * (addr - TIOS_BLK_BANK)));
+        }
+        if(addr >= TIOS_BLK_SIZE && addr < TIOS_BLK_SIZE + 8)
+        {
+            *ib = (uint8_t)(com->blk.size >> (8 * (addr - TIOS_BLK_SIZE)));
+        }
+        if(addr == TIOS_BLK_STATUS)
+        {
+            *ib = 1;
+        }
+    }
+    if(com->banks != NULL)
+    {
+        if(addr >= TIOS_BANK_COUNT && addr < TIOS_BANK_COUNT + 2)
+        {
+            *ib = (uint8_t)(com->bank_count >> (8 * (addr - TIOS_BANK_COUNT)));
+        }
+        if(addr >= TIOS_BANK_REGS && addr < TIOS_BANK_REGS + 2 * TIOS_BANK_WINDOWS)
+        {
+            *ib = (uint8_t)(com->bank_regs[(addr - TIOS_BANK_REGS) / 2] >> (8 * ((addr - TIOS_BANK_REGS) & 1)));
+        }
+    }
+    if(com->smp)
+    {
+        if(addr >= TIOS_CORE_ID && addr < TIOS_CORE_ID + 2)
+        {
+            *ib = (uint8_t)(core->id >> (8 * (addr - TIOS_CORE_ID)));
+        }
+        if(addr >= TIOS_CORE_COUNT && addr < TIOS_CORE_COUNT + 2)
+        {
+            *ib = (uint8_t)(com->core_count >> (8 * (addr - TIOS_CORE_COUNT)));
+        }
+    }
+    if(com->clock_enabled && addr >= TIOS_CLOCK_INSTRS && addr < TIOS_CLOCK_USEC + 8)
+    {
+        uint32_t which = (addr - TIOS_CLOCK_INSTRS) / 8;
+        uint32_t byte = (addr - TIOS_CLOCK_INSTRS) % 8;
+
+        if(byte == 0)
+        {
+            /* The reading instruction is already counted in the run */
+            core->clock_latch[0] = core->instrs + (core->run_len - core->run_left) - 1;
+            core->clock_latch[1] = (tios_now_ns() - com->start_ns) / 1000;
+        }
+        *ib = (uint8_t)(core->clock_latch[which] >> (8 * byte));
+    }
+    if(com->chan_in != NULL || com->chan_out != NULL)
+    {
+        if(addr == TIOS_CHAN_RECV && com->chan_in != NULL)
+        {
+            pthread_mutex_lock(&com->chan_locks[0]);
+            channel_recv(com->chan_in, ib, com->chan_control & 1, &com->exit_flag);
+            pthread_mutex_unlock(&com->chan_locks[0]);
+        }
+        if(addr == TIOS_CHAN_STATUS)
+        {
+            *ib = (uint8_t)((com->chan_in != NULL ? channel_status(com->chan_in, 1) : TIOS_CHAN_IN_CLOSED)
+                | (com->chan_out != NULL ? channel_status(com->chan_out, 0) : TIOS_CHAN_OUT_CLOSED));
+        }
+        if(addr == TIOS_CHAN_CONTROL)
+        {
+            *ib = com->chan_control;
+        }
+    }
+    return 0;
+}
+
+int tios_xio_write(core_t* core, uint16_t addr, uint8_t ob)
+{
+    computer_t* com = core->com;
+
+    /* Waiting for room must not hold up the other device registers */
+    if(addr == TIOS_CHAN_SEND && com->chan_out != NULL)
+    {
+        pthread_mutex_lock(&com->chan_locks[1]);
+        channel_send(com->chan_out, ob, com->chan_control & 1, &com->exit_flag);
+        pthread_mutex_unlock(&com->chan_locks[1]);
+        return 0;
+    }
+    pthread_mutex_lock(&com->xio_lock);
+    if(com->blk.file != NULL && addr >= TIOS_BLK_BANK && addr < TIOS_BLK_BANK + 4)
+    {
+        uint32_t shift = 8 * (addr - TIOS_BLK_BANK);
+        com->blk.bank = (com->blk.bank & ~((uint32_t)0xff << shift)) | ((uint32_t)ob << shift);
+        blockdev_map(com);
+    }
+    if(com->banks != NULL && addr >= TIOS_BANK_REGS + 2 * TIOS_BANK_FIRST_SWITCHED && addr < TIOS_BANK_REGS + 2 * TIOS_BANK_WINDOWS)
+    {
+        uint32_t window = (addr - TIOS_BANK_REGS) / 2;
+        uint32_t shift = 8 * ((addr - TIOS_BANK_REGS) & 1);
+        bank_map(com, window, (com->bank_regs[window] & ~(0xffu << shift)) | ((uint32_t)ob << shift));
+    }
+    if(addr == TIOS_CHAN_CONTROL && (com->chan_in != NULL || com->chan_out != NULL))
+    {
+        com->chan_control = ob & 1;
+    }
+    pthread_mutex_unlock(&com->xio_lock);
+    return 0;
+}
+
+/* Read what the console has (waiting for at least 1 byte) into input_pending, returns the byte count, 0 at its end or -1 */
+int tios_console_fill(computer_t* com)
+{
+    ssize_t got;
+
+    if(com->input_pending_cap < TIOS_CONSOLE_CHUNK)
+    {
+        uint8_t* buf = realloc(com->input_pending, TIOS_CONSOLE_CHUNK);
+
+        if(buf == NULL)
+        {
+            return -1;
+        }
+        com->input_pending = buf;
+        com->input_pending_cap = TIOS_CONSOLE_CHUNK;
+    }
+    com->input_pending_pos = 0;
+    com->input_pending_len = 0;
+    /* stdio flushed a prompt before reading stdin, do the same */
+    fflush(stdout);
+    do
+    {
+        got = read(STDIN_FILENO, com->input_pending, com->input_pending_cap);
+    }
+    while(got < 0 && errno == EINTR);
+    if(got > 0)
+    {
+        com->input_pending_len = (uint32_t)got;
+    }
+    return (int)got;
+}
+
+/* 1 when a console read wouldn't wait, there is input or its end */
+int tios_console_ready(computer_t* com)
+{
+    struct pollfd pfd;
+
+    if(com->input_eof)
+    {
+        return 1;
+    }
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) != 0;
+}
+
+int tios_mmu_read(void* data, uint16_t addr, uint8_t* ib)
+{
+    core_t* core = (core_t*)(data);
+    computer_t* comptr = core->com;
+
+    debugexec(printf("\n[READ_REQ] >> addr:%04X\n", addr));
+    core->bus_reads++;
+    switch(addr)
+    {
+        case 0: return GM_NEC16_ADDRINVALID;
+        case 2: return GM_NEC16_ADDRINVALID;
+        case 1:
+            pthread_mutex_lock(&comptr->input_lock);
+            if(comptr->input_pending_pos == comptr->input_pending_len && comptr->headless)
+            {
+                /* Nothing after the input but the end of it */
+                *ib = 0;
+                comptr->input_eof = 1;
+            }
+            else if(comptr->input_pending_pos == comptr->input_pending_len && comptr->input_nonblock && !tios_console_ready(comptr))
+            {
+                pthread_mutex_unlock(&comptr->input_lock);
+                return TIOS_WOULD_BLOCK;
+            }
+            else if(comptr->input_pending_pos == comptr->input_pending_len)
+            {
+                tios_stats_state(comptr, TIOS_STATE_INPUT);
+                if(tios_console_fill(comptr) <= 0)
+                {
+                    comptr->input_eof = 1;
+                }
+                tios_stats_state(comptr, TIOS_STATE_RUNNING);
+            }
+            if(comptr->input_pending_pos < comptr->input_pending_len)
+            {
+                *ib = comptr->input_pending[comptr->input_pending_pos++];
+                core->input_bytes++;
+            }
+            pthread_mutex_unlock(&comptr->input_lock);
+            break;
+        default:
+            if(comptr->host_pages[addr >> GM_NEC16_PAGE_SHIFT] == NULL)
+            {
+                return tios_xio_read(core, addr, ib);
+            }
+            *ib = comptr->host_pages[addr >> GM_NEC16_PAGE_SHIFT][addr & (GM_NEC16_PAGE_SIZE - 1)];
+            debugexec(printf("\n[READ_REQ] >> ib:%02X\n", *ib));
+            break;
+    }
+    return 0;
+}
+
+char* get_error_type(int errcode)
+{
+
+    switch(errcode)
+    {
+        case GM_NEC16_ADDRINVALID:
+            return "Address invalid";
+        case GM_NEC16_INSTRUCTIONINVALID:
+            return "Instruction invalid";
+        case GM_NEC16_DIVBYZERO:
+            return "Division by zero";
+        default:
+            return "Unknown error";
+    }
+
+}
+
+/* Append to the output buffer of a headless machine, output that doesn't fit in memory is dropped */
+void tios_output(computer_t* com, uint8_t ob)
+{
+    if(com->output_len == com->output_cap)
+    {
+        size_t cap = (com->output_cap == 0) ? 4096 : com->output_cap * 2;
+        uint8_t* output = realloc(com->output, cap);
+
+        if(output == NULL)
+        {
+            return;
+        }
+        com->output = output;
+        com->output_cap = cap;
+    }
+    com->output[com->output_len++] = ob;
+}
+
+int tios_mmu_write(void* data, uint16_t addr, uint8_t ob)
+{
+    core_t* core = (core_t*)(data);
+    computer_t* comptr = core->com;
+
+    debugexec(printf("\n[WRITE_REQ] >> addr:%04X ob:%02X\n", addr, ob));
+    core->bus_writes++;
+    switch(addr)
+    {
+        case 0: comptr->exit_flag = 1; break;
+        case 2:
+            if(comptr->headless)
+            {
+                tios_output(comptr, ob);
+            }
+            else
+            {
+                printf("%c", ob);
+            }
+            core->output_bytes++;
+            break;
+        case 1: return GM_NEC16_ADDRINVALID;
+        default:
+            if(comptr->host_pages[addr >> GM_NEC16_PAGE_SHIFT] == NULL)
+            {
+                return tios_xio_write(core, addr, ob);
+            }
+            comptr->host_pages[addr >> GM_NEC16_PAGE_SHIFT][addr & (GM_NEC16_PAGE_SIZE - 1)] = ob;
+            break;
+    }
+    return 0;
+}
+
+/* XCHG/CAS, atomic on RAM and ROM, plain reads and writes on I/O and device registers */
+int tios_mmu_atomic(void* data, uint16_t addr, uint8_t kind, uint16_t expected, uint16_t* val)
+{
+    core_t* core = (core_t*)(data);
+    uint8_t* page = core->com->host_pages[addr >> GM_NEC16_PAGE_SHIFT];
+    uint16_t* word;
+    uint16_t old;
+    uint8_t ib[2];
+    int bus_stat;
+
+    debugexec(printf("\n[ATOMIC_REQ] >> addr:%04X kind:%u\n", addr, kind));
+    if(page == NULL || addr < 3)
+    {
+        bus_stat = tios_mmu_read(data, addr, &ib[0]);
+        gmnec16_err_check_0(bus_stat);
+        bus_stat = tios_mmu_read(data, (uint16_t)(addr + 1), &ib[1]);
+        gmnec16_err_check_0(bus_stat);
+        old = (uint16_t)ib[0] | ((uint16_t)ib[1] << 8);
+        if(kind == GM_NEC16_ATOMIC_XCHG || old == expected)
+        {
+            bus_stat = tios_mmu_write(data, addr, (uint8_t)(*val & 0xff));
+            gmnec16_err_check_0(bus_stat);
+            bus_stat = tios_mmu_write(data, (uint16_t)(addr + 1), (uint8_t)(*val >> 8));
+            gmnec16_err_check_0(bus_stat);
+        }
+        *val = old;
+        return 0;
+    }
+    /* Host pages are at least 2 byte aligned, guest words are little endian */
+    word = (uint16_t*)(page + (addr & (GM_NEC16_PAGE_SIZE - 1)));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    expected = __builtin_bswap16(expected);
+    *val = __builtin_bswap16(*val);
+#endif
+    if(kind == GM_NEC16_ATOMIC_XCHG)
+    {
+        *val = __atomic_exchange_n(word, *val, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        old = expected;
+        __atomic_compare_exchange_n(word, &old, *val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        *val = old;
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    *val = __builtin_bswap16(*val);
+#endif
+    return 0;
+}
+
+/* Sleep until input arrives or the timer ticks */
+void tios_wait_input(volatile uint8_t* input_eof)
+{
+    struct pollfd pfd;
+
+    fflush(stdout);
+    if(*input_eof)
+    {
+        usleep(TIOS_HALT_TICK_MS * 1000);
+        return;
+    }
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, TIOS_HALT_TICK_MS) > 0 && (pfd.revents & POLLIN) == 0)
+    {
+        /* Hang up without data, only the timer can wake us from now on */
+        *input_eof = 1;
+    }
+}
+
+void tios_wait_event(computer_t* com)
+{
+    if(com->input_pending_pos < com->input_pending_len)
+    {
+        /* Read from the console already */
+        return;
+    }
+    tios_wait_input(&com->input_eof);
+}
+
+/* Predecode the ROM, cheap enough to do on every load */
+void tios_predecode(computer_t* com, GM_NEC16_Decoded* table)
+{
+    uint32_t addr;
+
+    for(addr = 0; addr < TIOS_DECODED_LEN; addr++)
+    {
+        if(addr < 3)
+        {
+            memset(&table[addr], 0, sizeof(GM_NEC16_Decoded));
+            table[addr].opcode = GM_NEC16_NOT_DECODED;
+            continue;
+        }
+        gmnec16_predecode(&table[addr], &com->memory[addr]);
+    }
+}
+
+uint8_t* tios_alloc_memory()
+{
+    void* memory = mmap(NULL, 0x10000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (memory == MAP_FAILED) ? NULL : (uint8_t*)memory;
+}
+
+uint16_t tios_le16(const uint8_t* p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+uint32_t tios_le32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* CRC-32 (the zlib one), crc starts at 0 */
+uint32_t tios_crc32(uint32_t crc, const uint8_t* p, size_t len)
+{
+    size_t i;
+    int bit;
+
+    crc = ~crc;
+    for(i = 0; i < len; i++)
+    {
+        crc ^= p[i];
+        for(bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/* Put [load, load + len) of the segment at file offset in memory, sharing whole host pages with the file when possible */
+void tios_place_segment(computer_t* com, int fd, const uint8_t* file, uint32_t offset, uint32_t load, uint32_t len)
+{
+    uint32_t page_size = (uint32_t)sysconf(_SC_PAGESIZE);
+    uint32_t first = (load + page_size - 1) / page_size * page_size;
+    uint32_t last = (load + len) / page_size * page_size;
+
+    if(offset % page_size == load % page_size && first < last
+        && mmap(com->memory + first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset + (first - load)) != MAP_FAILED)
+    {
+        memcpy(com->memory + load, file + offset, first - load);
+        memcpy(com->memory + last, file + offset + (last - load), load + len - last);
+        return;
+    }
+    memcpy(com->memory + load, file + offset, len);
+}
+
+/* Check everything before anything is placed, so a bad image never runs */
+int tios_load_container(computer_t* com, const char* filename, int fd, const uint8_t* file, size_t size)
+{
+    uint32_t header_size;
+    uint32_t count;
+    uint32_t entry;
+    uint32_t crc;
+    uint32_t i;
+    uint32_t j;
+    const uint8_t zero[4] = {0, 0, 0, 0};
+
+    #define rom_error(msg) { printf("[ERROR] >> ROM '%s': %s\n", filename, msg); return -1; }
+    if(size < TIOS_ROM_HEADER_SIZE)
+    {
+        rom_error("Truncated header");
+    }
+    if(tios_le16(file + 8) != TIOS_ROM_VERSION)
+    {
+        rom_error("Unsupported version");
+    }
+    header_size = tios_le16(file + 10);
+    entry = tios_le16(file + 12);
+    count = tios_le16(file + 14);
+    if(header_size < TIOS_ROM_HEADER_SIZE || header_size + (size_t)count * TIOS_ROM_SEGMENT_SIZE > size)
+    {
+        rom_error("Truncated segment table");
+    }
+    crc = tios_crc32(0, file, TIOS_ROM_CRC_OFFSET);
+    crc = tios_crc32(crc, zero, 4);
+    crc = tios_crc32(crc, file + TIOS_ROM_CRC_OFFSET + 4, size - TIOS_ROM_CRC_OFFSET - 4);
+    if(crc != tios_le32(file + TIOS_ROM_CRC_OFFSET))
+    {
+        rom_error("Checksum mismatch");
+    }
+    if(entry < 3 || entry >= 32 * 1024 + 3)
+    {
+        rom_error("Entry point is not in ROM");
+    }
+    for(i = 0; i < count; i++)
+    {
+        const uint8_t* seg = file + header_size + i * TIOS_ROM_SEGMENT_SIZE;
+        uint32_t load = tios_le16(seg);
+        uint32_t len = tios_le32(seg + 4);
+        uint32_t offset = tios_le32(seg + 8);
+
+        if(tios_le16(seg + 2) != 0)
+        {
+            rom_error("Unknown segment flags");
+        }
+        if(load < 3 || len > 0x10000 - load)
+        {
+            rom_error("Segment is outside of ROM and RAM");
+        }
+        if(offset > size || len > size - offset)
+        {
+            rom_error("Segment data is outside of the file");
+        }
+        for(j = 0; j < i; j++)
+        {
+            const uint8_t* other = file + header_size + j * TIOS_ROM_SEGMENT_SIZE;
+            if(load < tios_le16(other) + tios_le32(other + 4) && tios_le16(other) < load + len)
+            {
+                rom_error("Segments overlap");
+            }
+        }
+    }
+    #undef rom_error
+
+    for(i = 0; i < count; i++)
+    {
+        const uint8_t* seg = file + header_size + i * TIOS_ROM_SEGMENT_SIZE;
+        tios_place_segment(com, fd, file, tios_le32(seg + 8), tios_le16(seg), tios_le32(seg + 4));
+    }
+    com->cores[0].cpu.regs[GM_NEC16_PC] = (uint16_t)entry;
+    return 0;
+}
+
+int loadrom(computer_t* com, const char* filename)
+{
+    struct stat st;
+    uint8_t* file = NULL;
+    int fd = open(filename, O_RDONLY);
+    int result = 0;
+
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("[ERROR] >> Error opening '%s'\n", filename);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    if(st.st_size > 0)
+    {
+        file = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(file == MAP_FAILED)
+        {
+            printf("[ERROR] >> Error reading '%s'\n", filename);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(st.st_size >= 8 && memcmp(file, TIOS_ROM_MAGIC, 8) == 0)
+    {
+        result = tios_load_container(com, filename, fd, file, (size_t)st.st_size);
+    }
+    else if(st.st_size > 32 * 1024)
+    {
+        printf("[ERROR] >> ROM '%s' is larger than 32 KiB\n", filename);
+        result = -1;
+    }
+    else if(st.st_size > 0)
+    {
+        /* Raw image at addr 3 */
+        tios_place_segment(com, fd, file, 0, 3, (uint32_t)st.st_size);
+    }
+
+    if(file != NULL)
+    {
+        munmap(file, (size_t)st.st_size);
+    }
+    close(fd);
+    return result;
+}
+
+/* Buffered state file, every byte that goes through it is added to crc */
+typedef struct __TIOS_HIB
+{
+    int fd;
+    uint8_t buf[TIOS_HIB_BUF_SIZE];
+    uint32_t len; /* Bytes in buf */
+    uint32_t pos; /* Next byte of buf to read */
+    uint32_t crc;
+    int error;
+} tios_hib_t;
+
+/* The MACH record, read before the machine is built */
+typedef struct __TIOS_HIB_MACHINE
+{
+    uint32_t core_count;
+    uint32_t flags;
+    uint32_t bank_count;
+    uint16_t bank_regs[TIOS_BANK_WINDOWS];
+    uint32_t blk_bank;
+    uint64_t blk_size;
+    uint64_t elapsed_us;
+} tios_hib_machine_t;
+
+#define TIOS_HIB_MACH_SIZE (2 + 2 + 4 + 2 * TIOS_BANK_WINDOWS + 4 + 8 + 8)
+#define TIOS_HIB_CORE_SIZE (2 + 2 * 0x10 + 8 * 7)
+#define TIOS_HIB_PACKED_MAX (GM_NEC16_PAGE_SIZE + GM_NEC16_PAGE_SIZE / 128)
+
+void tios_hib_init(tios_hib_t* hib, int fd)
+{
+    hib->fd = fd;
+    hib->len = 0;
+    hib->pos = 0;
+    hib->crc = 0;
+    hib->error = 0;
+}
+
+void tios_hib_flush(tios_hib_t* hib)
+{
+    uint32_t done = 0;
+    ssize_t n;
+
+    while(done < hib->len && !hib->error)
+    {
+        n = write(hib->fd, hib->buf + done, hib->len - done);
+        if(n <= 0)
+        {
+            hib->error = 1;
+        }
+        else
+        {
+            done += (uint32_t)n;
+        }
+    }
+    hib->len = 0;
+}
+
+void tios_hib_write(tios_hib_t* hib, const uint8_t* p, uint32_t len)
+{
+    uint32_t n;
+
+    hib->crc = tios_crc32(hib->crc, p, len);
+    while(len > 0)
+    {
+        if(hib->len == TIOS_HIB_BUF_SIZE)
+        {
+            tios_hib_flush(hib);
+        }
+        n = TIOS_HIB_BUF_SIZE - hib->len;
+        n = (n < len) ? n : len;
+        memcpy(hib->buf + hib->len, p, n);
+        hib->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Little endian value of size bytes */
+void tios_hib_put(tios_hib_t* hib, uint64_t value, uint32_t size)
+{
+    uint8_t bytes[8];
+    uint32_t i;
+
+    for(i = 0; i < size; i++)
+    {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+    tios_hib_write(hib, bytes, size);
+}
+
+void tios_hib_record(tios_hib_t* hib, const char* tag, uint32_t len)
+{
+    tios_hib_write(hib, (const uint8_t*)tag, 4);
+    tios_hib_put(hib, len, 4);
+}
+
+/* Returns -1 (and sets error) when the file ends first */
+int tios_hib_read(tios_hib_t* hib, uint8_t* p, uint32_t len)
+{
+    uint32_t want = len;
+    uint8_t* start = p;
+    uint32_t n;
+    ssize_t got;
+
+    while(len > 0 && !hib->error)
+    {
+        if(hib->pos == hib->len)
+        {
+            got = read(hib->fd, hib->buf, TIOS_HIB_BUF_SIZE);
+            if(got <= 0)
+            {
+                hib->error = 1;
+                break;
+            }
+            hib->len = (uint32_t)got;
+            hib->pos = 0;
+        }
+        n = hib->len - hib->pos;
+        n = (n < len) ? n : len;
+        memcpy(p, hib->buf + hib->pos, n);
+        hib->pos += n;
+        p += n;
+        len -= n;
+    }
+    if(hib->error)
+    {
+        return -1;
+    }
+    hib->crc = tios_crc32(hib->crc, start, want);
+    return 0;
+}
+
+uint64_t tios_hib_get(const uint8_t* p, uint32_t size)
+{
+    uint64_t value = 0;
+
+    while(size > 0)
+    {
+        size--;
+        value = (value << 8) | p[size];
+    }
+    return value;
+}
+
+/* Pack len bytes into runs, returns the packed size (at most len + len / 128 + 1) */
+uint32_t tios_hib_pack(const uint8_t* src, uint32_t len, uint8_t* out)
+{
+    uint32_t i = 0;
+    uint32_t n = 0;
+    uint32_t run;
+    uint32_t start;
+
+    while(i < len)
+    {
+        run = 1;
+        while(i + run < len && run < 130 && src[i + run] == src[i])
+        {
+            run++;
+        }
+        if(run >= 3)
+        {
+            out[n++] = (uint8_t)(run + 125);
+            out[n++] = src[i];
+            i += run;
+            continue;
+        }
+        /* Literals up to the next run of 3 */
+        start = i;
+        while(i < len && i - start < 128 && !(i + 2 < len && src[i] == src[i + 1] && src[i] == src[i + 2]))
+        {
+            i++;
+        }
+        out[n++] = (uint8_t)(i - start - 1);
+        memcpy(out + n, src + start, i - start);
+        n += i - start;
+    }
+    return n;
+}
+
+/* Returns -1 unless the runs fill exactly len bytes */
+int tios_hib_unpack(const uint8_t* in, uint32_t in_len, uint8_t* dst, uint32_t len)
+{
+    uint32_t i = 0;
+    uint32_t n = 0;
+    uint32_t count;
+
+    while(i < in_len)
+    {
+        if(in[i] < 128)
+        {
+            count = in[i] + 1u;
+            if(i + 1 + count > in_len || n + count > len)
+            {
+                return -1;
+            }
+            memcpy(dst + n, in + i + 1, count);
+            i += 1 + count;
+        }
+        else
+        {
+            count = in[i] - 125u;
+            if(i + 1 >= in_len || n + count > len)
+            {
+                return -1;
+            }
+            memset(dst + n, in[i + 1], count);
+            i += 2;
+        }
+        n += count;
+    }
+    return (n == len) ? 0 : -1;
+}
+
+void tios_hib_pages(tios_hib_t* hib, uint8_t space, const uint8_t* mem, uint32_t page_count)
+{
+    uint8_t packed[TIOS_HIB_PACKED_MAX];
+    const uint8_t* page;
+    uint32_t page_no;
+    uint32_t n;
+    uint32_t i;
+
+    for(page_no = 0; page_no < page_count && !hib->error; page_no++)
+    {
+        page = mem + (size_t)page_no * GM_NEC16_PAGE_SIZE;
+        for(i = 0; i < GM_NEC16_PAGE_SIZE && page[i] == 0; i++)
+        {
+        }
+        if(i == GM_NEC16_PAGE_SIZE)
+        {
+            continue;
+        }
+        n = tios_hib_pack(page, GM_NEC16_PAGE_SIZE, packed);
+        tios_hib_record(hib, "PAGE", 5 + n);
+        tios_hib_put(hib, space, 1);
+        tios_hib_put(hib, page_no, 4);
+        tios_hib_write(hib, packed, n);
+    }
+}
+
+/* Write the whole state of a stopped machine to fd, returns -1 on a write error */
+int tios_hibernate(computer_t* com, int fd)
+{
+    tios_hib_t* hib = malloc(sizeof(tios_hib_t));
+    uint32_t flags = 0;
+    uint32_t pending;
+    uint32_t crc;
+    uint32_t i;
+    uint32_t r;
+    int result;
+
+    if(hib == NULL)
+    {
+        return -1;
+    }
+    tios_hib_init(hib, fd);
+    tios_hib_write(hib, (const uint8_t*)TIOS_HIB_MAGIC, 8);
+    tios_hib_put(hib, TIOS_HIB_VERSION, 2);
+    tios_hib_put(hib, 0, 2);
+
+    flags |= com->smp ? TIOS_HIB_SMP : 0;
+    flags |= com->clock_enabled ? TIOS_HIB_CLOCK : 0;
+    flags |= (com->blk.file != NULL) ? TIOS_HIB_BLOCKDEV : 0;
+    tios_hib_record(hib, "MACH", TIOS_HIB_MACH_SIZE);
+    tios_hib_put(hib, com->core_count, 2);
+    tios_hib_put(hib, flags, 2);
+    tios_hib_put(hib, com->bank_count, 4);
+    for(i = 0; i < TIOS_BANK_WINDOWS; i++)
+    {
+        tios_hib_put(hib, com->bank_regs[i], 2);
+    }
+    tios_hib_put(hib, com->blk.bank, 4);
+    tios_hib_put(hib, com->blk.size, 8);
+    tios_hib_put(hib, (tios_now_ns() - com->start_ns) / 1000, 8);
+
+    for(i = 0; i < com->core_count; i++)
+    {
+        core_t* core = &com->cores[i];
+
+        tios_hib_record(hib, "CORE", TIOS_HIB_CORE_SIZE);
+        tios_hib_put(hib, core->id, 2);
+        for(r = 0; r < 0x10; r++)
+        {
+            tios_hib_put(hib, core->cpu.regs[r], 2);
+        }
+        tios_hib_put(hib, core->instrs, 8);
+        tios_hib_put(hib, core->bus_reads, 8);
+        tios_hib_put(hib, core->bus_writes, 8);
+        tios_hib_put(hib, core->input_bytes, 8);
+        tios_hib_put(hib, core->output_bytes, 8);
+        tios_hib_put(hib, core->clock_latch[0], 8);
+        tios_hib_put(hib, core->clock_latch[1], 8);
+    }
+
+    tios_hib_pages(hib, TIOS_HIB_SPACE_MEMORY, com->memory, 0x10000 / GM_NEC16_PAGE_SIZE);
+    tios_hib_pages(hib, TIOS_HIB_SPACE_BANKS, com->banks, com->bank_count * (TIOS_BANK_SIZE / GM_NEC16_PAGE_SIZE));
+
+    /* Console input the guest didn't get to yet */
+    pending = com->input_pending_len - com->input_pending_pos;
+    if(pending > 0)
+    {
+        tios_hib_record(hib, "INPT", pending);
+        tios_hib_write(hib, com->input_pending + com->input_pending_pos, pending);
+    }
+
+    crc = hib->crc;
+    tios_hib_record(hib, "END ", 4);
+    tios_hib_put(hib, crc, 4);
+    tios_hib_flush(hib);
+    result = hib->error ? -1 : 0;
+    free(hib);
+    return result;
+}
+
+/* Read the header and the MACH record, which decide how the machine is built */
+int tios_hib_begin(tios_hib_t* hib, tios_hib_machine_t* mach, const char* filename)
+{
+    uint8_t head[TIOS_HIB_MACH_SIZE + 8];
+    uint32_t i;
+
+    if(tios_hib_read(hib, head, 12) < 0 || memcmp(head, TIOS_HIB_MAGIC, 8) != 0)
+    {
+        printf("[ERROR] >> '%s' isn't a hibernated machine\n", filename);
+        return -1;
+    }
+    if(tios_hib_get(head + 8, 2) != TIOS_HIB_VERSION)
+    {
+        printf("[ERROR] >> '%s' has state version %u, expected %u\n", filename, (unsigned)tios_hib_get(head + 8, 2), TIOS_HIB_VERSION);
+        return -1;
+    }
+    if(tios_hib_read(hib, head, 8) < 0 || memcmp(head, "MACH", 4) != 0 || tios_hib_get(head + 4, 4) != TIOS_HIB_MACH_SIZE
+        || tios_hib_read(hib, head, TIOS_HIB_MACH_SIZE) < 0)
+    {
+        printf("[ERROR] >> '%s' is damaged\n", filename);
+        return -1;
+    }
+    mach->core_count = (uint32_t)tios_hib_get(head, 2);
+    mach->flags = (uint32_t)tios_hib_get(head + 2, 2);
+    mach->bank_count = (uint32_t)tios_hib_get(head + 4, 4);
+    for(i = 0; i < TIOS_BANK_WINDOWS; i++)
+    {
+        mach->bank_regs[i] = (uint16_t)tios_hib_get(head + 8 + 2 * i, 2);
+    }
+    mach->blk_bank = (uint32_t)tios_hib_get(head + 8 + 2 * TIOS_BANK_WINDOWS, 4);
+    mach->blk_size = tios_hib_get(head + 12 + 2 * TIOS_BANK_WINDOWS, 8);
+    mach->elapsed_us = tios_hib_get(head + 20 + 2 * TIOS_BANK_WINDOWS, 8);
+    if(mach->core_count == 0 || mach->core_count > TIOS_MAX_CORES || mach->bank_count > TIOS_BANK_MAX_EXTRA)
+    {
+        printf("[ERROR] >> '%s' is damaged\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill a machine built from the MACH record with the rest of the state */
+int tios_restore(computer_t* com, tios_hib_t* hib, const tios_hib_machine_t* mach, const char* filename)
+{
+    uint8_t body[TIOS_HIB_CORE_SIZE + TIOS_HIB_PACKED_MAX + 5];
+    uint8_t* dst;
+    uint32_t crc;
+    uint32_t len;
+    uint32_t page_no;
+    uint32_t cores = 0;
+    uint32_t i;
+
+    if(com->blk.file != NULL && com->blk.size != mach->blk_size)
+    {
+        printf("[ERROR] >> The block device is %llu bytes, '%s' was hibernated with %llu\n", (unsigned long long)com->blk.size, filename,
+            (unsigned long long)mach->blk_size);
+        return -1;
+    }
+    for(i = TIOS_BANK_FIRST_SWITCHED; i < TIOS_BANK_WINDOWS; i++)
+    {
+        if(bank_map(com, i, mach->bank_regs[i]) < 0)
+        {
+            printf("[ERROR] >> '%s' shows bank %u in window %u, which this machine can't\n", filename, (unsigned)mach->bank_regs[i], (unsigned)i);
+            return -1;
+        }
+    }
+    if(com->blk.file != NULL)
+    {
+        com->blk.bank = mach->blk_bank;
+        blockdev_map(com);
+    }
+    com->start_ns = tios_now_ns() - mach->elapsed_us * 1000;
+
+    while(1)
+    {
+        crc = hib->crc;
+        if(tios_hib_read(hib, body, 8) < 0)
+        {
+            break;
+        }
+        len = (uint32_t)tios_hib_get(body + 4, 4);
+        if(memcmp(body, "END ", 4) == 0)
+        {
+            if(len != 4 || tios_hib_read(hib, body, 4) < 0 || tios_hib_get(body, 4) != crc)
+            {
+                break;
+            }
+            if(cores != com->core_count)
+            {
+                break;
+            }
+            return 0;
+        }
+        if(memcmp(body, "INPT", 4) == 0)
+        {
+            com->input_pending = malloc(len > 0 ? len : 1);
+            if(com->input_pending == NULL || tios_hib_read(hib, com->input_pending, len) < 0)
+            {
+                break;
+            }
+            com->input_pending_len = len;
+            continue;
+        }
+        if(memcmp(body, "CORE", 4) == 0)
+        {
+            core_t* core;
+
+            if(len != TIOS_HIB_CORE_SIZE || tios_hib_read(hib, body, len) < 0 || tios_hib_get(body, 2) >= com->core_count)
+            {
+                break;
+            }
+            core = &com->cores[tios_hib_get(body, 2)];
+            for(i = 0; i < 0x10; i++)
+            {
+                core->cpu.regs[i] = (uint16_t)tios_hib_get(body + 2 + 2 * i, 2);
+            }
+            core->instrs = tios_hib_get(body + 34, 8);
+            core->bus_reads = tios_hib_get(body + 42, 8);
+            core->bus_writes = tios_hib_get(body + 50, 8);
+            core->input_bytes = tios_hib_get(body + 58, 8);
+            core->output_bytes = tios_hib_get(body + 66, 8);
+            core->clock_latch[0] = tios_hib_get(body + 74, 8);
+            core->clock_latch[1] = tios_hib_get(body + 82, 8);
+            cores++;
+            continue;
+        }
+        if(memcmp(body, "PAGE", 4) == 0)
+        {
+            if(len < 5 || len > 5 + TIOS_HIB_PACKED_MAX || tios_hib_read(hib, body, len) < 0)
+            {
+                break;
+            }
+            page_no = (uint32_t)tios_hib_get(body + 1, 4);
+            if(body[0] == TIOS_HIB_SPACE_MEMORY && page_no < 0x10000 / GM_NEC16_PAGE_SIZE)
+            {
+                dst = com->memory + (size_t)page_no * GM_NEC16_PAGE_SIZE;
+            }
+            else if(body[0] == TIOS_HIB_SPACE_BANKS && page_no < com->bank_count * (TIOS_BANK_SIZE / GM_NEC16_PAGE_SIZE))
+            {
+                dst = com->banks + (size_t)page_no * GM_NEC16_PAGE_SIZE;
+            }
+            else
+            {
+                break;
+            }
+            if(tios_hib_unpack(body + 5, len - 5, dst, GM_NEC16_PAGE_SIZE) < 0)
+            {
+                break;
+            }
+            continue;
+        }
+        /* Records of later versions of this one */
+        while(len > 0)
+        {
+            i = (len < sizeof(body)) ? len : (uint32_t)sizeof(body);
+            if(tios_hib_read(hib, body, i) < 0)
+            {
+                break;
+            }
+            len -= i;
+        }
+        if(hib->error)
+        {
+            break;
+        }
+    }
+    printf("[ERROR] >> '%s' is damaged\n", filename);
+    return -1;
+}
+
+
+/* Connect a machine to the channels it receives from and sends to, either may be NULL */
+void tios_attach_channels(computer_t* com, channel_t* in, channel_t* out)
+{
+    com->chan_in = in;
+    com->chan_out = out;
+    com->chan_control = 1;
+    com->xio_enabled = 1;
+    tios_map(com, TIOS_XIO_BASE, GM_NEC16_PAGE_SIZE, NULL);
+}
+
+/* A stopped machine closes its ends, so the machines around it can stop as well */
+void tios_detach_channels(computer_t* com)
+{
+    if(com->chan_in != NULL)
+    {
+        channel_close_reader(com->chan_in);
+    }
+    if(com->chan_out != NULL)
+    {
+        channel_close_writer(com->chan_out);
+    }
+}
+
+void tios_config_init(tios_config_t* conf)
+{
+    conf->rom_file = NULL;
+    conf->rom_data = NULL;
+    conf->rom_len = 0;
+    conf->blockdev_file = NULL;
+    conf->bank_count = 0;
+    conf->core_count = 1;
+    conf->smp = 0;
+    conf->stats = 0;
+    conf->clock = 0;
+    conf->bus_only = 0;
+    conf->resume_file = NULL;
+    conf->image = NULL;
+    conf->headless = 0;
+}
+
+/* Returns 1 for a machine option, 0 for any other argument and -1 when the value is bad */
+int tios_parse_option(tios_config_t* conf, const char* arg)
+{
+    if(strncmp(arg, "--blockdev=", 11) == 0)
+    {
+        conf->blockdev_file = arg + 11;
+        return 1;
+    }
+    if(strncmp(arg, "--resume=", 9) == 0)
+    {
+        conf->resume_file = arg + 9;
+        return 1;
+    }
+    if(strcmp(arg, "--clock") == 0)
+    {
+        conf->clock = 1;
+        return 1;
+    }
+    if(strcmp(arg, "--stats") == 0)
+    {
+        conf->stats = 1;
+        return 1;
+    }
+    if(strncmp(arg, "--banks=", 8) == 0)
+    {
+        conf->bank_count = atoi(arg + 8);
+        if(conf->bank_count <= 0 || conf->bank_count > TIOS_BANK_MAX_EXTRA)
+        {
+            printf("[ERROR] >> The bank count has to be 1 to %d\n", TIOS_BANK_MAX_EXTRA);
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Build the machine and load the ROM, every core starts at its entry point */
+/* A resumed machine takes its devices from the state file and carries on where it was hibernated */
+int tios_init(computer_t* com, const tios_config_t* conf)
+{
+    tios_hib_t* hib = NULL;
+    tios_hib_machine_t mach;
+    tios_config_t resumed;
+    uint32_t i;
+
+    if(conf->resume_file != NULL)
+    {
+        int fd = open(conf->resume_file, O_RDONLY);
+
+        hib = malloc(sizeof(tios_hib_t));
+        if(fd < 0 || hib == NULL)
+        {
+            printf("[ERROR] >> Error opening '%s'\n", conf->resume_file);
+            return -1;
+        }
+        tios_hib_init(hib, fd);
+        if(tios_hib_begin(hib, &mach, conf->resume_file) < 0)
+        {
+            return -1;
+        }
+        if(mach.core_count != (uint32_t)conf->core_count)
+        {
+            printf("[ERROR] >> '%s' has %u cores, not %d\n", conf->resume_file, (unsigned)mach.core_count, conf->core_count);
+            return -1;
+        }
+        if((mach.flags & TIOS_HIB_BLOCKDEV) != 0 && conf->blockdev_file == NULL)
+        {
+            printf("[ERROR] >> '%s' needs its block device, attach it with --blockdev=<file>\n", conf->resume_file);
+            return -1;
+        }
+        resumed = *conf;
+        resumed.smp = (mach.flags & TIOS_HIB_SMP) != 0;
+        resumed.clock = (mach.flags & TIOS_HIB_CLOCK) != 0;
+        resumed.bank_count = (int)mach.bank_count;
+        if((mach.flags & TIOS_HIB_BLOCKDEV) == 0)
+        {
+            resumed.blockdev_file = NULL;
+        }
+        conf = &resumed;
+    }
+
+    memset(com, 0, sizeof(computer_t));
+    com->memory = tios_alloc_memory();
+    com->cores = calloc((size_t)conf->core_count, sizeof(core_t));
+    if(com->memory == NULL || com->cores == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return -1;
+    }
+    com->core_count = (uint32_t)conf->core_count;
+    com->start_ns = tios_now_ns();
+    com->bus_only = (g_DEBUG_ENABLED == 1 || conf->bus_only);
+    com->headless = (uint8_t)conf->headless;
+    pthread_mutex_init(&com->xio_lock, NULL);
+    pthread_mutex_init(&com->input_lock, NULL);
+    pthread_mutex_init(&com->chan_locks[0], NULL);
+    pthread_mutex_init(&com->chan_locks[1], NULL);
+    for(i = 0; i < TIOS_BANK_WINDOWS; i++)
+    {
+        com->bank_regs[i] = (uint16_t)i;
+    }
+
+    /* Let the cores bypass the bus for ROM and RAM, debug mode traces every access instead */
+    for(i = 0; i < com->core_count; i++)
+    {
+        core_t* core = &com->cores[i];
+
+        core->com = com;
+        core->id = (uint16_t)i;
+        gmnec16_init(&core->cpu, tios_mmu_read, tios_mmu_write, (void*)core);
+        core->cpu.bus_atomic = tios_mmu_atomic;
+        core->cpu.regs[GM_NEC16_PC] = 3;
+        if(!com->bus_only)
+        {
+            gmnec16_map_pages(&core->cpu, 3, 0x10000 - 3, com->memory + 3);
+        }
+    }
+    tios_map(com, 0, 0x10000, com->memory);
+    if(conf->blockdev_file != NULL)
+    {
+        if(blockdev_open(com, conf->blockdev_file) < 0)
+        {
+            return -1;
+        }
+        blockdev_map(com);
+        com->xio_enabled = 1;
+    }
+    if(conf->bank_count > 0)
+    {
+        /* Untouched banks cost no host memory */
+        com->banks = mmap(NULL, (size_t)conf->bank_count * TIOS_BANK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(com->banks == MAP_FAILED)
+        {
+            com->banks = NULL;
+            printf("[ERROR] >> Out of memory\n");
+            return -1;
+        }
+        com->bank_count = (uint32_t)conf->bank_count;
+        com->xio_enabled = 1;
+    }
+    if(conf->smp)
+    {
+        com->smp = 1;
+        com->xio_enabled = 1;
+    }
+    if(conf->clock)
+    {
+        com->clock_enabled = 1;
+        com->xio_enabled = 1;
+    }
+    if(com->xio_enabled)
+    {
+        tios_map(com, TIOS_XIO_BASE, GM_NEC16_PAGE_SIZE, NULL);
+    }
+
+    if(hib != NULL)
+    {
+        int restored = tios_restore(com, hib, &mach, conf->resume_file);
+
+        close(hib->fd);
+        free(hib);
+        if(restored < 0)
+        {
+            return -1;
+        }
+    }
+    else if(conf->image != NULL)
+    {
+        memcpy(com->memory, conf->image->memory, 0x10000);
+        for(i = 0; i < com->core_count; i++)
+        {
+            com->cores[i].cpu.regs[GM_NEC16_PC] = conf->image->cores[0].cpu.regs[GM_NEC16_PC];
+        }
+    }
+    else
+    {
+        if(conf->rom_data != NULL)
+        {
+            if(conf->rom_len > 32 * 1024)
+            {
+                printf("[ERROR] >> ROM is larger than 32 KiB\n");
+                return -1;
+            }
+            memcpy(com->memory + 3, conf->rom_data, conf->rom_len);
+        }
+        else if(loadrom(com, conf->rom_file) < 0)
+        {
+            return -1;
+        }
+        for(i = 1; i < com->core_count; i++)
+        {
+            com->cores[i].cpu.regs[GM_NEC16_PC] = com->cores[0].cpu.regs[GM_NEC16_PC];
+        }
+    }
+    if(conf->stats)
+    {
+        if(tios_stats_open(com, (conf->resume_file != NULL) ? conf->resume_file : (conf->rom_file != NULL) ? conf->rom_file : "(memory)") < 0)
+        {
+            return -1;
+        }
+        g_TIOS_MACHINES++;
+        tios_stats_update(com, TIOS_STATE_RUNNING);
+    }
+    /* Skip fetching and decoding ROM instructions, debug mode traces the fetches instead */
+    /* A core only drops its own predecoded pages on writes, so code shared by several cores is always fetched */
+    if(g_DEBUG_ENABLED == 0 && com->core_count == 1)
+    {
+        if(conf->image != NULL)
+        {
+            /* Nothing writes to a table, each core drops its own pages */
+            com->decoded = conf->image->decoded;
+        }
+        else
+        {
+            com->decoded = malloc(TIOS_DECODED_LEN * sizeof(GM_NEC16_Decoded));
+            com->decoded_owned = 1;
+            if(com->decoded != NULL)
+            {
+                tios_predecode(com, com->decoded);
+            }
+        }
+        if(com->decoded != NULL)
+        {
+            gmnec16_map_decoded(&com->cores[0].cpu, 0, TIOS_DECODED_LEN, com->decoded);
+        }
+    }
+    return 0;
+}
+
+/* Give back everything tios_init took, for front ends that build many machines */
+void tios_free(computer_t* com)
+{
+    tios_stats_close(com);
+    if(com->decoded != NULL && com->decoded_owned)
+    {
+        free(com->decoded);
+    }
+    if(com->blk.file != NULL)
+    {
+        munmap(com->blk.file, com->blk.map_size);
+        munmap(com->blk.zero_window, TIOS_BLK_WINDOW_SIZE);
+    }
+    if(com->banks != NULL)
+    {
+        munmap(com->banks, (size_t)com->bank_count * TIOS_BANK_SIZE);
+    }
+    if(com->memory != NULL)
+    {
+        munmap(com->memory, 0x10000);
+    }
+    pthread_mutex_destroy(&com->xio_lock);
+    pthread_mutex_destroy(&com->input_lock);
+    pthread_mutex_destroy(&com->chan_locks[0]);
+    pthread_mutex_destroy(&com->chan_locks[1]);
+    free(com->cores);
+    free(com->input_pending);
+    free(com->output);
+    memset(com, 0, sizeof(computer_t));
+}
+
+/* Run one instruction of core, errors (and code in RAM) stop the whole machine */
+int tios_step(computer_t* com, core_t* core)
+{
+    uint16_t pc = core->cpu.regs[GM_NEC16_PC];
+    int inres = gmnec16_instr_step(&core->cpu);
+
+    if(inres == TIOS_WOULD_BLOCK)
+    {
+        /* Every instruction reads before it changes anything */
+        core->cpu.regs[GM_NEC16_PC] = pc;
+        return inres;
+    }
+    if(core->cpu.regs[GM_NEC16_PC] >= (32 * 1024 + 3))
+    {
+        if(!com->headless)
+        {
+            printf("[ERROR] >> Attempted to execute code from RAM\n");
+        }
+        com->exit_flag = 1;
+    }
+    if(inres < 0 && !com->headless)
+    {
+        if(com->core_count > 1)
+        {
+            printf("[ERROR] >> Core %u received error code %d, '%s'\n", (unsigned)core->id, inres, get_error_type(inres));
+        }
+        else
+        {
+            printf("[ERROR] >> Received error code %d, '%s'\n", inres, get_error_type(inres));
+        }
+    }
+    if(inres < 0)
+    {
+        /* Headless front ends report the error themselves */
+        com->exit_flag = 1;
+    }
+    return inres;
+}
+
+/* Run up to n instructions of core, stops after HLT, before a console read that would block and when the machine exits */
+/* Returns the last result */
+/* The loop counts down run_left in the core, so the clock device can tell how far the run is */
+int tios_run(computer_t* com, core_t* core, uint64_t n)
+{
+    uint64_t before = core->instrs;
+    int inres = 0;
+
+    core->run_len = n;
+    core->run_left = n;
+    while(core->run_left != 0 && com->exit_flag != 1 && inres != GM_NEC16_HALTED && inres != TIOS_WOULD_BLOCK)
+    {
+        core->run_left--;
+        inres = tios_step(com, core);
+    }
+    if(inres == TIOS_WOULD_BLOCK)
+    {
+        /* Not run */
+        core->run_left++;
+    }
+    core->instrs += n - core->run_left;
+    core->run_len = 0;
+    core->run_left = 0;
+    if(core->instrs / TIOS_STATS_SLICE != before / TIOS_STATS_SLICE)
+    {
+        tios_stats_update(com, TIOS_STATE_RUNNING);
+    }
+    return inres;
+}
+
+/* Green threads (tiosched), cores of any number of machines take turns on one host thread */
+/* A guest runs up to priority * quantum instructions per turn, the run queue is plain FIFO */
+/* A guest that halts or would block reading the console is parked until the timer ticks, or until input arrives when */
+/* nothing else can run, console reads of guests never block the host thread */
+/* A guest leaves when its machine exits or its budget runs out, switching guests is just following next */
+#define TIOS_NO_BUDGET UINT64_MAX
+
+/* Called after every instruction of a guest that has one, from is the PC the instruction was at */
+typedef void(*tios_step_hook)(void* data, core_t* core, uint16_t from);
+
+typedef struct __GUEST
+{
+    core_t* core;
+    uint32_t priority; /* Quanta per turn, at least 1 */
+    uint64_t budget; /* Instructions it may still run, TIOS_NO_BUDGET for no limit */
+    tios_step_hook hook;
+    void* hook_data;
+    struct __GUEST* next;
+} guest_t;
+
+typedef struct __SCHED
+{
+    guest_t* head; /* Run queue */
+    guest_t* tail;
+    guest_t* parked;
+    uint64_t wake_ns; /* When the parked guests go back to the run queue */
+    uint32_t quantum;
+    volatile uint8_t input_eof;
+} sched_t;
+
+void sched_init(sched_t* sched, uint32_t quantum)
+{
+    memset(sched, 0, sizeof(sched_t));
+    sched->quantum = quantum;
+}
+
+void sched_enqueue(sched_t* sched, guest_t* guest)
+{
+    guest->next = NULL;
+    if(sched->tail == NULL)
+    {
+        sched->head = guest;
+    }
+    else
+    {
+        sched->tail->next = guest;
+    }
+    sched->tail = guest;
+}
+
+/* Add a core that runs with no budget and priority 1, change them in the returned guest */
+guest_t* sched_add(sched_t* sched, core_t* core)
+{
+    guest_t* guest = calloc(1, sizeof(guest_t));
+
+    if(guest == NULL)
+    {
+        return NULL;
+    }
+    guest->core = core;
+    guest->priority = 1;
+    guest->budget = TIOS_NO_BUDGET;
+    core->com->input_nonblock = 1;
+    sched_enqueue(sched, guest);
+    return guest;
+}
+
+/* One turn, returns the result of the last instruction */
+int sched_turn(guest_t* guest, uint64_t n)
+{
+    core_t* core = guest->core;
+    computer_t* com = core->com;
+    uint64_t before = core->instrs;
+    int inres = 0;
+
+    if(guest->budget != TIOS_NO_BUDGET && n > guest->budget)
+    {
+        n = guest->budget;
+    }
+    if(guest->hook == NULL)
+    {
+        inres = tios_run(com, core, n);
+    }
+    else
+    {
+        uint64_t i;
+
+        for(i = 0; i < n && com->exit_flag != 1 && inres != GM_NEC16_HALTED; i++)
+        {
+            uint16_t from = core->cpu.regs[GM_NEC16_PC];
+
+            inres = tios_run(com, core, 1);
+            if(inres == TIOS_WOULD_BLOCK)
+            {
+                break;
+            }
+            guest->hook(guest->hook_data, core, from);
+        }
+    }
+    if(guest->budget != TIOS_NO_BUDGET)
+    {
+        guest->budget -= core->instrs - before;
+    }
+    return inres;
+}
+
+/* 1 when a parked guest's machine has console input read already, so it can go on without waiting */
+int sched_input_buffered(sched_t* sched)
+{
+    guest_t* guest;
+
+    for(guest = sched->parked; guest != NULL; guest = guest->next)
+    {
+        if(guest->core->com->input_pending_pos < guest->core->com->input_pending_len)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run until every guest is gone, finished guests are freed */
+void sched_run(sched_t* sched)
+{
+    while(sched->head != NULL || sched->parked != NULL)
+    {
+        guest_t* guest;
+        int inres;
+
+        if(sched->parked != NULL && (sched->head == NULL || tios_now_ns() >= sched->wake_ns))
+        {
+            if(sched->head == NULL && !sched_input_buffered(sched))
+            {
+                tios_wait_input(&sched->input_eof);
+            }
+            while(sched->parked != NULL)
+            {
+                guest = sched->parked;
+                sched->parked = guest->next;
+                sched_enqueue(sched, guest);
+                tios_stats_update(guest->core->com, TIOS_STATE_RUNNING);
+            }
+        }
+
+        guest = sched->head;
+        sched->head = guest->next;
+        if(sched->head == NULL)
+        {
+            sched->tail = NULL;
+        }
+        inres = sched_turn(guest, (uint64_t)sched->quantum * guest->priority);
+        if(guest->core->com->exit_flag == 1 || guest->budget == 0)
+        {
+            free(guest);
+        }
+        else if(inres == GM_NEC16_HALTED || inres == TIOS_WOULD_BLOCK)
+        {
+            if(sched->parked == NULL)
+            {
+                sched->wake_ns = tios_now_ns() + TIOS_HALT_TICK_MS * 1000000ull;
+            }
+            guest->next = sched->parked;
+            sched->parked = guest;
+            tios_stats_update(guest->core->com, (inres == GM_NEC16_HALTED) ? TIOS_STATE_HALTED : TIOS_STATE_INPUT);
+        }
+        else
+        {
+            sched_enqueue(sched, guest);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,882 @@
+/* Headless batch runs of TIOS, a manifest lists the jobs and a pool of host threads runs them, one machine per job */
+/* Every distinct ROM is loaded and predecoded once, the machine of a job starts from a copy of it */
+
+#include "tios.h"
+
+#define TIOSBATCH_MAX_LINE 4096
+#define TIOSBATCH_MAX_THREADS 256
+
+/* Manifest: one job per line, <rom> [input file] [instruction budget] [output file], '-' skips a field, '#' starts a comment */
+/* Without an input file the guest is at the end of its input at once, without an output file the output is only counted */
+/* A budget of 0 runs the job until it exits, HLT doesn't wait in batch mode since all of the input is there already */
+
+/* Deduplication (--dedup), jobs whose machines get to the same state only run once, the others take over its results */
+/* The state is the registers, the memory, the input still to be read and the budget left. Jobs keep the fast memory path */
+/* and are stepped one instruction at a time, after every backward jump (a loop or a return) the registers and the input */
+/* left are hashed, when the sync bits of that are clear the slice ends. Guests that converge meet at the same points */
+/* whatever their instruction counts, since the choice only depends on the state. At the end of a slice the whole state is */
+/* digested with SHA-256 (the memory as a tree of page digests, only pages that differ from a copy made at the last slice */
+/* are hashed again) and looked up in a table shared by the jobs, the digest has to match in full. A job that revisits its */
+/* own state never ends and gets "loop". A job that joins nothing runs 5 - 15% slower than without --dedup (about 35% for */
+/* a loop of 2 instructions), so it pays off once a few jobs share a state. Needs a machine without banks, block device or */
+/* clock, whose state is all in memory and registers */
+#define DEDUP_SYNC_MASK 0xfffull /* Checked bits of the hash, a slice is 4K backward jumps on average */
+#define DEDUP_DIGEST_SIZE 32
+#define DEDUP_GROUP_PAGES 16 /* Page digests per inner node of the memory tree */
+#define DEDUP_GROUPS (GM_NEC16_PAGE_COUNT / DEDUP_GROUP_PAGES)
+
+typedef struct __BATCH_JOB
+{
+    char* rom;
+    char* input; /* NULL for none */
+    char* output; /* NULL for none */
+    uint64_t budget;
+    uint32_t image; /* Index of the ROM in the loaded images */
+    uint32_t line;
+    const char* reason; /* Why the job stopped */
+    int error; /* Error code when reason is "error" */
+    uint64_t instrs;
+    uint64_t output_bytes;
+    uint64_t time_ns;
+    uint8_t* output_data; /* Kept until the end with --dedup */
+    size_t output_len;
+    int32_t follow; /* Job whose results this one takes over from the state it stopped at, -1 for none */
+    uint64_t follow_instrs; /* Instructions and output of that job at the state */
+    size_t follow_output;
+    uint64_t skipped; /* Instructions that weren't run */
+    int resolved; /* 1 while being resolved, 2 when done */
+} batch_job_t;
+
+typedef struct __DEDUP_ENTRY
+{
+    uint8_t digest[DEDUP_DIGEST_SIZE]; /* Its first 8 bytes place it in the table */
+    int32_t job; /* -1 for a free slot */
+    uint64_t instrs;
+    size_t output_len;
+} dedup_entry_t;
+
+/* Digest tree of a memory, the state digest covers the group digests */
+typedef struct __DEDUP_MEMORY
+{
+    uint8_t page[GM_NEC16_PAGE_COUNT][DEDUP_DIGEST_SIZE];
+    uint8_t group[DEDUP_GROUPS][DEDUP_DIGEST_SIZE];
+} dedup_memory_t;
+
+/* Digests of a deduplicated job */
+typedef struct __DEDUP_RUN
+{
+    core_t* core;
+    dedup_memory_t mem;
+    uint8_t shadow[0x10000]; /* Memory the digests were made of, pages that differ from it get hashed again */
+} dedup_run_t;
+
+typedef struct __DEDUP_SHA
+{
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t block[64];
+} dedup_sha_t;
+
+typedef struct __BATCH
+{
+    batch_job_t* jobs;
+    uint32_t job_count;
+    computer_t* images;
+    uint8_t* image_ok;
+    uint32_t image_count;
+    uint32_t next_job; /* Taken by the workers with an atomic add */
+    tios_config_t conf;
+    int dedup;
+    dedup_memory_t** image_mem; /* Memory digests of every image */
+    dedup_entry_t* states;
+    uint32_t state_cap;
+    uint32_t state_count;
+    pthread_mutex_t state_lock;
+} batch_t;
+
+/* Hash of the registers and the input left, taken after every backward jump so the products are independent of each other */
+/* The top bits are the ones that depend on every input bit */
+uint64_t dedup_sync_hash(const core_t* core, uint32_t pending)
+{
+    uint64_t w[4];
+
+    memcpy(w, core->cpu.regs, sizeof(w));
+    return (w[0] ^ 0x9e3779b97f4a7c15ull) * (w[1] ^ 0xbf58476d1ce4e5b9ull) + (w[2] ^ 0x94d049bb133111ebull) * (w[3] ^ 0xd6e8feb86659fd93ull)
+        + (uint64_t)pending * 0xc2b2ae3d27d4eb4full;
+}
+
+const uint32_t g_DEDUP_SHA_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define dedup_ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void dedup_sha_block(dedup_sha_t* sha, const uint8_t* p)
+{
+    uint32_t w[64];
+    uint32_t v[8];
+    uint32_t i;
+
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) | ((uint32_t)p[4 * i + 2] << 8) | (uint32_t)p[4 * i + 3];
+    }
+    for(i = 16; i < 64; i++)
+    {
+        uint32_t s0 = dedup_ror(w[i - 15], 7) ^ dedup_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = dedup_ror(w[i - 2], 17) ^ dedup_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(v, sha->h, sizeof(v));
+    for(i = 0; i < 64; i++)
+    {
+        uint32_t t1 = v[7] + (dedup_ror(v[4], 6) ^ dedup_ror(v[4], 11) ^ dedup_ror(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + g_DEDUP_SHA_K[i] + w[i];
+        uint32_t t2 = (dedup_ror(v[0], 2) ^ dedup_ror(v[0], 13) ^ dedup_ror(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+        memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for(i = 0; i < 8; i++)
+    {
+        sha->h[i] += v[i];
+    }
+}
+
+void dedup_sha_init(dedup_sha_t* sha)
+{
+    static const uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    memcpy(sha->h, h, sizeof(h));
+    sha->len = 0;
+}
+
+void dedup_sha_update(dedup_sha_t* sha, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+
+    while(len > 0)
+    {
+        size_t fill = (size_t)(sha->len & 63);
+        size_t n = (len < 64 - fill) ? len : 64 - fill;
+
+        if(fill == 0 && len >= 64)
+        {
+            dedup_sha_block(sha, p);
+            n = 64;
+        }
+        else
+        {
+            memcpy(sha->block + fill, p, n);
+            if(fill + n == 64)
+            {
+                dedup_sha_block(sha, sha->block);
+            }
+        }
+        sha->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void dedup_sha_final(dedup_sha_t* sha, uint8_t* digest)
+{
+    uint64_t bits = sha->len * 8;
+    uint8_t pad[72];
+    size_t pad_len = ((sha->len & 63) < 56) ? 56 - (size_t)(sha->len & 63) : 120 - (size_t)(sha->len & 63);
+    uint32_t i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++)
+    {
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    dedup_sha_update(sha, pad, pad_len + 8);
+    for(i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (uint8_t)(sha->h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(sha->h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(sha->h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)sha->h[i];
+    }
+}
+
+void dedup_sha(const void* data, size_t len, uint8_t* digest)
+{
+    dedup_sha_t sha;
+
+    dedup_sha_init(&sha);
+    dedup_sha_update(&sha, data, len);
+    dedup_sha_final(&sha, digest);
+}
+
+/* Digest of every page and group of a machine's memory */
+void dedup_memory_init(dedup_memory_t* mem, const computer_t* com)
+{
+    uint32_t i;
+
+    for(i = 0; i < GM_NEC16_PAGE_COUNT; i++)
+    {
+        if(com->host_pages[i] != NULL)
+        {
+            dedup_sha(com->host_pages[i], GM_NEC16_PAGE_SIZE, mem->page[i]);
+        }
+        else
+        {
+            memset(mem->page[i], 0, DEDUP_DIGEST_SIZE);
+        }
+    }
+    for(i = 0; i < DEDUP_GROUPS; i++)
+    {
+        dedup_sha(mem->page[i * DEDUP_GROUP_PAGES], DEDUP_GROUP_PAGES * DEDUP_DIGEST_SIZE, mem->group[i]);
+    }
+}
+
+/* Digest of the whole state at the end of a slice, budget_left is UINT64_MAX without a budget */
+void dedup_state_digest(dedup_run_t* run, uint64_t budget_left, uint8_t* digest)
+{
+    computer_t* com = run->core->com;
+    uint32_t pending = com->input_pending_len - com->input_pending_pos;
+    dedup_sha_t sha;
+    uint32_t i;
+
+    for(i = 0; i < DEDUP_GROUPS; i++)
+    {
+        uint32_t page;
+        int changed = 0;
+
+        for(page = i * DEDUP_GROUP_PAGES; page < (i + 1) * DEDUP_GROUP_PAGES; page++)
+        {
+            uint8_t* host = com->host_pages[page];
+            uint8_t* copy = run->shadow + page * GM_NEC16_PAGE_SIZE;
+
+            if(host != NULL && memcmp(host, copy, GM_NEC16_PAGE_SIZE) != 0)
+            {
+                dedup_sha(host, GM_NEC16_PAGE_SIZE, run->mem.page[page]);
+                memcpy(copy, host, GM_NEC16_PAGE_SIZE);
+                changed = 1;
+            }
+        }
+        if(changed)
+        {
+            dedup_sha(run->mem.page[i * DEDUP_GROUP_PAGES], DEDUP_GROUP_PAGES * DEDUP_DIGEST_SIZE, run->mem.group[i]);
+        }
+    }
+    dedup_sha_init(&sha);
+    dedup_sha_update(&sha, run->core->cpu.regs, sizeof(run->core->cpu.regs));
+    dedup_sha_update(&sha, &budget_left, sizeof(budget_left));
+    dedup_sha_update(&sha, (const void*)&com->input_eof, 1);
+    dedup_sha_update(&sha, &pending, sizeof(pending));
+    dedup_sha_update(&sha, com->input_pending + com->input_pending_pos, pending);
+    dedup_sha_update(&sha, run->mem.group, sizeof(run->mem.group));
+    dedup_sha_final(&sha, digest);
+}
+
+/* Record the state or find who was there first, returns 1 when the job takes over another job's results from here */
+int dedup_sync(batch_t* batch, uint32_t job_no, const uint8_t* digest, uint64_t instrs, size_t output_len)
+{
+    batch_job_t* job = &batch->jobs[job_no];
+    dedup_entry_t* e;
+    uint64_t key;
+    uint32_t i;
+
+    memcpy(&key, digest, sizeof(key));
+    pthread_mutex_lock(&batch->state_lock);
+    if((batch->state_count + 1) * 2 > batch->state_cap)
+    {
+        uint32_t cap = (batch->state_cap == 0) ? 4096 : batch->state_cap * 2;
+        dedup_entry_t* states = malloc(cap * sizeof(dedup_entry_t));
+
+        if(states == NULL)
+        {
+            /* Out of memory just stops deduplicating */
+            pthread_mutex_unlock(&batch->state_lock);
+            return 0;
+        }
+        for(i = 0; i < cap; i++)
+        {
+            states[i].job = -1;
+        }
+        for(i = 0; i < batch->state_cap; i++)
+        {
+            uint32_t k;
+
+            if(batch->states[i].job < 0)
+            {
+                continue;
+            }
+            memcpy(&key, batch->states[i].digest, sizeof(key));
+            for(k = (uint32_t)key & (cap - 1); states[k].job >= 0; k = (k + 1) & (cap - 1))
+            {
+            }
+            states[k] = batch->states[i];
+        }
+        free(batch->states);
+        batch->states = states;
+        batch->state_cap = cap;
+        memcpy(&key, digest, sizeof(key));
+    }
+    for(i = (uint32_t)key & (batch->state_cap - 1); batch->states[i].job >= 0 && memcmp(batch->states[i].digest, digest, DEDUP_DIGEST_SIZE) != 0;
+        i = (i + 1) & (batch->state_cap - 1))
+    {
+    }
+    e = &batch->states[i];
+    if(e->job >= 0)
+    {
+        job->follow = e->job;
+        job->follow_instrs = e->instrs;
+        job->follow_output = e->output_len;
+        pthread_mutex_unlock(&batch->state_lock);
+        return 1;
+    }
+    memcpy(e->digest, digest, DEDUP_DIGEST_SIZE);
+    e->job = (int32_t)job_no;
+    e->instrs = instrs;
+    e->output_len = output_len;
+    batch->state_count++;
+    pthread_mutex_unlock(&batch->state_lock);
+    return 0;
+}
+
+/* Work out the results of a job that took over another one's, after every job stopped */
+void dedup_resolve(batch_t* batch, batch_job_t* job)
+{
+    batch_job_t* owner;
+
+    if(job->resolved == 2 || job->follow < 0)
+    {
+        job->resolved = 2;
+        return;
+    }
+    job->resolved = 1;
+    owner = &batch->jobs[job->follow];
+    if(owner->resolved != 1)
+    {
+        dedup_resolve(batch, owner);
+    }
+    if(owner->resolved == 1 || strcmp(owner->reason, "loop") == 0)
+    {
+        /* Back at a state it (or a job it follows) was in already */
+        job->reason = "loop";
+    }
+    else
+    {
+        uint8_t* output = realloc(job->output_data, job->output_len + (owner->output_len - job->follow_output) + 1);
+
+        if(output != NULL)
+        {
+            if(owner->output_len > job->follow_output)
+            {
+                memcpy(output + job->output_len, owner->output_data + job->follow_output, owner->output_len - job->follow_output);
+            }
+            job->output_data = output;
+            job->output_len += owner->output_len - job->follow_output;
+        }
+        job->skipped = owner->instrs - job->follow_instrs;
+        job->instrs += job->skipped;
+        job->output_bytes += owner->output_len - job->follow_output;
+        job->reason = owner->reason;
+        job->error = owner->error;
+    }
+    job->resolved = 2;
+}
+
+/* Returns -1 when the file can't be read (or doesn't fit the input buffer) */
+int batch_read_file(const char* filename, uint8_t** data, uint32_t* len)
+{
+    struct stat st;
+    uint32_t done = 0;
+    ssize_t n;
+    int fd = open(filename, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st) < 0 || (uint64_t)st.st_size > 0xffffffffull)
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    *data = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+    if(*data == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    while(done < (uint32_t)st.st_size)
+    {
+        n = read(fd, *data + done, (uint32_t)st.st_size - done);
+        if(n <= 0)
+        {
+            break;
+        }
+        done += (uint32_t)n;
+    }
+    close(fd);
+    *len = done;
+    return 0;
+}
+
+int batch_write_file(const char* filename, const uint8_t* data, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    while(done < len)
+    {
+        n = write(fd, data + done, len - done);
+        if(n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return close(fd);
+}
+
+char* batch_field(char* tok)
+{
+    return (tok == NULL || strcmp(tok, "-") == 0) ? NULL : strdup(tok);
+}
+
+/* Returns -1 after printing what is wrong with the manifest */
+int batch_load_manifest(batch_t* batch, const char* filename)
+{
+    char line[TIOSBATCH_MAX_LINE];
+    uint32_t cap = 0;
+    uint32_t line_no = 0;
+    FILE* f = fopen(filename, "r");
+
+    if(f == NULL)
+    {
+        printf("[ERROR] >> Error opening '%s'\n", filename);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        batch_job_t* job;
+        char* comment = strchr(line, '#');
+        char* rom;
+        char* input;
+        char* budget;
+        char* output;
+
+        line_no++;
+        if(comment != NULL)
+        {
+            *comment = 0;
+        }
+        rom = strtok(line, " \t\r\n");
+        if(rom == NULL)
+        {
+            continue;
+        }
+        input = strtok(NULL, " \t\r\n");
+        budget = strtok(NULL, " \t\r\n");
+        output = strtok(NULL, " \t\r\n");
+        if(strtok(NULL, " \t\r\n") != NULL)
+        {
+            printf("[ERROR] >> '%s' line %u has more than 4 fields\n", filename, (unsigned)line_no);
+            fclose(f);
+            return -1;
+        }
+        if(batch->job_count == cap)
+        {
+            batch_job_t* jobs;
+
+            cap = (cap == 0) ? 64 : cap * 2;
+            jobs = realloc(batch->jobs, cap * sizeof(batch_job_t));
+            if(jobs == NULL)
+            {
+                printf("[ERROR] >> Out of memory\n");
+                fclose(f);
+                return -1;
+            }
+            batch->jobs = jobs;
+        }
+        job = &batch->jobs[batch->job_count++];
+        memset(job, 0, sizeof(batch_job_t));
+        job->rom = strdup(rom);
+        job->input = batch_field(input);
+        job->output = batch_field(output);
+        job->budget = (budget == NULL || strcmp(budget, "-") == 0) ? 0 : strtoull(budget, NULL, 0);
+        job->line = line_no;
+        job->follow = -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Load every distinct ROM once, a ROM that doesn't load fails its jobs but not the batch */
+int batch_load_images(batch_t* batch)
+{
+    const char** names = malloc(batch->job_count * sizeof(char*));
+    tios_config_t conf = batch->conf;
+    uint32_t i;
+    uint32_t k;
+
+    batch->images = calloc(batch->job_count, sizeof(computer_t));
+    batch->image_ok = calloc(batch->job_count, 1);
+    batch->image_mem = calloc(batch->job_count, sizeof(dedup_memory_t*));
+    if(names == NULL || batch->images == NULL || batch->image_ok == NULL || batch->image_mem == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return -1;
+    }
+    for(i = 0; i < batch->job_count; i++)
+    {
+        for(k = 0; k < batch->image_count && strcmp(names[k], batch->jobs[i].rom) != 0; k++)
+        {
+        }
+        batch->jobs[i].image = k;
+        if(k < batch->image_count)
+        {
+            continue;
+        }
+        names[k] = batch->jobs[i].rom;
+        conf.rom_file = names[k];
+        batch->image_ok[k] = (tios_init(&batch->images[k], &conf) == 0);
+        if(batch->image_ok[k] && batch->dedup)
+        {
+            batch->image_mem[k] = malloc(sizeof(dedup_memory_t));
+            if(batch->image_mem[k] == NULL)
+            {
+                printf("[ERROR] >> Out of memory\n");
+                return -1;
+            }
+            dedup_memory_init(batch->image_mem[k], &batch->images[k]);
+        }
+        batch->image_count++;
+    }
+    free(names);
+    return 0;
+}
+
+/* Run like batch_run_job's loop, one instruction at a time, until the budget runs out, the machine exits or the job */
+/* gets to a state another job (or this one) was in, returns the last result */
+int dedup_run(batch_t* batch, batch_job_t* job, computer_t* com, uint64_t left)
+{
+    dedup_run_t* run = malloc(sizeof(dedup_run_t));
+    core_t* core = &com->cores[0];
+    int inres = 0;
+
+    if(run == NULL)
+    {
+        /* Runs the job like without --dedup */
+        return tios_run(com, core, (job->budget == 0) ? UINT64_MAX : left);
+    }
+    run->core = core;
+    run->mem = *batch->image_mem[job->image];
+    memcpy(run->shadow, batch->images[job->image].memory, 0x10000);
+    while(com->exit_flag != 1 && (job->budget == 0 || left > 0))
+    {
+        uint16_t from = core->cpu.regs[GM_NEC16_PC];
+        uint64_t hash;
+
+        /* tios_run without its bookkeeping, batch machines have no clock or stats */
+        inres = tios_step(com, core);
+        core->instrs++;
+        if(job->budget != 0)
+        {
+            left--;
+        }
+        if(core->cpu.regs[GM_NEC16_PC] > from || com->exit_flag == 1)
+        {
+            continue;
+        }
+        hash = dedup_sync_hash(core, com->input_pending_len - com->input_pending_pos);
+        if(((hash >> 52) & DEDUP_SYNC_MASK) == 0)
+        {
+            uint8_t digest[DEDUP_DIGEST_SIZE];
+
+            dedup_state_digest(run, (job->budget == 0) ? UINT64_MAX : left, digest);
+            if(dedup_sync(batch, (uint32_t)(job - batch->jobs), digest, core->instrs, com->output_len))
+            {
+                break;
+            }
+        }
+    }
+    free(run);
+    return inres;
+}
+
+void batch_run_job(batch_t* batch, batch_job_t* job)
+{
+    tios_config_t conf = batch->conf;
+    computer_t com;
+    core_t* core;
+    uint64_t start = tios_now_ns();
+    uint64_t left = job->budget;
+    int inres = 0;
+
+    job->reason = "load";
+    if(!batch->image_ok[job->image])
+    {
+        return;
+    }
+    conf.rom_file = job->rom;
+    conf.image = &batch->images[job->image];
+    if(tios_init(&com, &conf) < 0)
+    {
+        tios_free(&com);
+        return;
+    }
+    if(job->input != NULL && batch_read_file(job->input, &com.input_pending, &com.input_pending_len) < 0)
+    {
+        job->reason = "input";
+        tios_free(&com);
+        return;
+    }
+
+    core = &com.cores[0];
+    if(batch->dedup)
+    {
+        inres = dedup_run(batch, job, &com, left);
+        left = 0;
+    }
+    while(!batch->dedup && com.exit_flag != 1 && (job->budget == 0 || left > 0))
+    {
+        uint64_t before = core->instrs;
+
+        inres = tios_run(&com, core, (job->budget == 0 || left > TIOS_STATS_SLICE) ? TIOS_STATS_SLICE : left);
+        if(job->budget != 0)
+        {
+            left -= core->instrs - before;
+        }
+    }
+    if(inres < 0)
+    {
+        job->reason = "error";
+        job->error = inres;
+    }
+    else if(com.exit_flag == 1 && core->cpu.regs[GM_NEC16_PC] >= (32 * 1024 + 3))
+    {
+        job->reason = "ram";
+    }
+    else
+    {
+        job->reason = (com.exit_flag == 1) ? "exit" : "budget";
+    }
+    job->instrs = core->instrs;
+    job->output_bytes = core->output_bytes;
+    if(batch->dedup)
+    {
+        /* Written once every job is resolved */
+        job->output_data = com.output;
+        job->output_len = com.output_len;
+        com.output = NULL;
+    }
+    else if(job->output != NULL && batch_write_file(job->output, com.output, com.output_len) < 0)
+    {
+        job->reason = "output";
+    }
+    tios_free(&com);
+    job->time_ns = tios_now_ns() - start;
+}
+
+void* batch_worker(void* data)
+{
+    batch_t* batch = (batch_t*)data;
+    uint32_t n;
+
+    while((n = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED)) < batch->job_count)
+    {
+        batch_run_job(batch, &batch->jobs[n]);
+    }
+    return NULL;
+}
+
+void batch_summary(batch_t* batch, FILE* out, uint64_t wall_ns)
+{
+    uint64_t total_instrs = 0;
+    uint64_t skipped = 0;
+    uint32_t followers = 0;
+    uint32_t exited = 0;
+    uint32_t failed = 0;
+    uint32_t i;
+
+    fprintf(out, "%-6s %-6s %-8s %14s %12s %10s  %s\n", "JOB", "LINE", "REASON", "INSTRS", "OUTPUT", "ms", "ROM");
+    for(i = 0; i < batch->job_count; i++)
+    {
+        batch_job_t* job = &batch->jobs[i];
+
+        fprintf(out, "%-6u %-6u %-8s %14llu %12llu %10.3f  %s", (unsigned)i, (unsigned)job->line, job->reason,
+            (unsigned long long)job->instrs, (unsigned long long)job->output_bytes, (double)job->time_ns / 1e6, job->rom);
+        if(job->error != 0)
+        {
+            fprintf(out, " (%d, '%s')", job->error, get_error_type(job->error));
+        }
+        if(job->follow >= 0 && (uint32_t)job->follow != i)
+        {
+            fprintf(out, "  = job %d", (int)job->follow);
+            followers++;
+        }
+        fprintf(out, "\n");
+        total_instrs += job->instrs;
+        skipped += job->skipped;
+        exited += (strcmp(job->reason, "exit") == 0);
+        failed += (strcmp(job->reason, "exit") != 0 && strcmp(job->reason, "budget") != 0);
+    }
+    fprintf(out, "%u jobs (%u exited, %u out of budget, %u failed) from %u ROMs, %llu instructions in %.3f s\n", (unsigned)batch->job_count,
+        (unsigned)exited, (unsigned)(batch->job_count - exited - failed), (unsigned)failed, (unsigned)batch->image_count,
+        (unsigned long long)total_instrs, (double)wall_ns / 1e9);
+    if(batch->dedup)
+    {
+        fprintf(out, "%u jobs joined another one, %llu instructions not run, %u states kept\n", (unsigned)followers,
+            (unsigned long long)skipped, (unsigned)batch->state_count);
+    }
+}
+
+int main(int args, char** argv)
+{
+    const char* manifest = NULL;
+    const char* summary_file = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t tids[TIOSBATCH_MAX_THREADS];
+    FILE* summary = stdout;
+    uint64_t start;
+    batch_t batch;
+    int i;
+
+    memset(&batch, 0, sizeof(batch_t));
+    tios_config_init(&batch.conf);
+    batch.conf.headless = 1;
+
+    /* tiosbatch <manifest> [--threads=<n>] [--summary=<file>] [--dedup] [--options], the machine options apply to every job */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            int parsed = tios_parse_option(&batch.conf, argv[i]);
+
+            if(parsed < 0)
+            {
+                return 1;
+            }
+            if(parsed == 0 && strncmp(argv[i], "--threads=", 10) == 0)
+            {
+                threads = atol(argv[i] + 10);
+                if(threads <= 0 || threads > TIOSBATCH_MAX_THREADS)
+                {
+                    printf("[ERROR] >> The thread count has to be 1 to %d\n", TIOSBATCH_MAX_THREADS);
+                    return 1;
+                }
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--summary=", 10) == 0)
+            {
+                summary_file = argv[i] + 10;
+            }
+            else if(parsed == 0 && strcmp(argv[i], "--dedup") == 0)
+            {
+                batch.dedup = 1;
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        manifest = argv[i];
+    }
+    if(manifest == NULL)
+    {
+        printf("No manifest to run.\n");
+        return 0;
+    }
+    if(batch.conf.stats || batch.conf.resume_file != NULL)
+    {
+        printf("[ERROR] >> --stats and --resume don't work in batch mode\n");
+        return 1;
+    }
+    if(batch.dedup && (batch.conf.core_count > 1 || batch.conf.smp || batch.conf.bank_count != 0 || batch.conf.blockdev_file != NULL || batch.conf.clock))
+    {
+        printf("[ERROR] >> --dedup needs a single core machine without banks, a block device or clocks\n");
+        return 1;
+    }
+    if(batch.dedup)
+    {
+        pthread_mutex_init(&batch.state_lock, NULL);
+    }
+    if(threads <= 0)
+    {
+        threads = 1;
+    }
+    if(threads > TIOSBATCH_MAX_THREADS)
+    {
+        threads = TIOSBATCH_MAX_THREADS;
+    }
+
+    start = tios_now_ns();
+    if(batch_load_manifest(&batch, manifest) < 0 || batch_load_images(&batch) < 0)
+    {
+        return 1;
+    }
+    if((uint32_t)threads > batch.job_count)
+    {
+        threads = (batch.job_count > 0) ? (long)batch.job_count : 1;
+    }
+    for(i = 0; i < threads; i++)
+    {
+        if(pthread_create(&tids[i], NULL, batch_worker, &batch) != 0)
+        {
+            printf("[ERROR] >> Can't start thread %d\n", i);
+            return 1;
+        }
+    }
+    for(i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    if(batch.dedup)
+    {
+        uint32_t k;
+
+        for(k = 0; k < batch.job_count; k++)
+        {
+            dedup_resolve(&batch, &batch.jobs[k]);
+        }
+        for(k = 0; k < batch.job_count; k++)
+        {
+            batch_job_t* job = &batch.jobs[k];
+
+            if(job->output != NULL && strcmp(job->reason, "load") != 0 && strcmp(job->reason, "input") != 0
+                && batch_write_file(job->output, job->output_data, job->output_len) < 0)
+            {
+                job->reason = "output";
+            }
+        }
+    }
+
+    if(summary_file != NULL)
+    {
+        summary = fopen(summary_file, "w");
+        if(summary == NULL)
+        {
+            printf("[ERROR] >> Can't create '%s'\n", summary_file);
+            return 1;
+        }
+    }
+    batch_summary(&batch, summary, tios_now_ns() - start);
+    if(summary != stdout)
+    {
+        fclose(summary);
+    }
+
+    return 0;
+}
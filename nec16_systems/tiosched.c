@@ -0,0 +1,122 @@
+/* TIOS machines as green threads, every ROM runs in a machine of its own and all of them take turns on one host thread */
+/* Meant for many machines that mostly sit in HLT, a halted machine costs nothing until it is woken, all of them share the console */
+
+#include "tios.h"
+
+#define TIOSCHED_DEFAULT_QUANTUM 10000
+#define TIOSCHED_MAX_MACHINES 4096
+
+int main(int args, char** argv)
+{
+    const char* roms[TIOSCHED_MAX_MACHINES];
+    uint32_t priorities[TIOSCHED_MAX_MACHINES];
+    uint64_t budgets[TIOSCHED_MAX_MACHINES];
+    int rom_count = 0;
+    uint32_t priority = 1;
+    uint64_t budget = TIOS_NO_BUDGET;
+    long quantum = TIOSCHED_DEFAULT_QUANTUM;
+    int i;
+    tios_config_t conf;
+    computer_t* coms;
+    sched_t sched;
+
+    tios_config_init(&conf);
+
+    /* tiosched [--quantum=<instructions>] [--priority=<quanta per turn>] [--budget=<instructions>] <rom>... [--options] */
+    /* --priority and --budget apply to the ROMs after them, the machine options apply to every machine */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            int parsed = tios_parse_option(&conf, argv[i]);
+
+            if(parsed < 0)
+            {
+                return 1;
+            }
+            if(parsed == 0 && strncmp(argv[i], "--quantum=", 10) == 0)
+            {
+                quantum = atol(argv[i] + 10);
+                if(quantum <= 0 || quantum > 0x7fffffffL)
+                {
+                    printf("[ERROR] >> The quantum has to be 1 to %ld instructions\n", 0x7fffffffL);
+                    return 1;
+                }
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--priority=", 11) == 0)
+            {
+                int value = atoi(argv[i] + 11);
+
+                if(value <= 0 || value > 1000)
+                {
+                    printf("[ERROR] >> The priority has to be 1 to 1000\n");
+                    return 1;
+                }
+                priority = (uint32_t)value;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--budget=", 9) == 0)
+            {
+                budget = strtoull(argv[i] + 9, NULL, 0);
+                if(budget == 0)
+                {
+                    budget = TIOS_NO_BUDGET;
+                }
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(rom_count == TIOSCHED_MAX_MACHINES)
+        {
+            printf("[ERROR] >> At most %d machines\n", TIOSCHED_MAX_MACHINES);
+            return 1;
+        }
+        roms[rom_count] = argv[i];
+        priorities[rom_count] = priority;
+        budgets[rom_count] = budget;
+        rom_count++;
+    }
+    if(rom_count == 0)
+    {
+        printf("No file to execute.\n");
+        return 0;
+    }
+
+    coms = calloc((size_t)rom_count, sizeof(computer_t));
+    if(coms == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    sched_init(&sched, (uint32_t)quantum);
+    for(i = 0; i < rom_count; i++)
+    {
+        guest_t* guest;
+
+        conf.rom_file = roms[i];
+        if(tios_init(&coms[i], &conf) < 0)
+        {
+            return 1;
+        }
+        guest = sched_add(&sched, &coms[i].cores[0]);
+        if(guest == NULL)
+        {
+            printf("[ERROR] >> Out of memory\n");
+            return 1;
+        }
+        guest->priority = priorities[i];
+        guest->budget = budgets[i];
+    }
+
+    sched_run(&sched);
+    for(i = 0; i < rom_count; i++)
+    {
+        tios_stats_close(&coms[i]);
+    }
+    fflush(stdout);
+
+    return 0;
+}
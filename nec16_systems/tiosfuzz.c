@@ -0,0 +1,721 @@
+/* In-process fuzzing of a ROM's input, the ROM runs to its ready point once and every test case starts from a snapshot of it */
+/* A case goes in through the console input (addr 1) of a headless machine, after its last byte the guest sees the end of input */
+/* Resetting only copies back the host pages the case wrote to, they are found by write protecting the memory of the machine */
+/* Coverage is the edges of branch sites, a site is an instruction that was seen going anywhere but the next instruction, */
+/* from then on both its taken and its not taken edges count, hit counts go in buckets like AFL's */
+
+#include "tios.h"
+#include <dirent.h>
+
+#define FUZZ_MAX_THREADS 64
+#define FUZZ_MAX_HOST_PAGES 64
+#define FUZZ_MAX_TOUCHED 4096 /* Edges remembered per case, the whole trace map is cleared after more */
+#define FUZZ_MAX_CRASHES 1024
+#define FUZZ_READY_MAX 100000000ull /* Instructions to reach the ready point in */
+#define FUZZ_DEFAULT_BUDGET 100000
+#define FUZZ_DEFAULT_MAX_LEN 4096
+
+#define FUZZ_EXIT 0
+#define FUZZ_HANG 1 /* Out of budget */
+#define FUZZ_ERROR 2
+#define FUZZ_RAM 3 /* Executed RAM */
+
+typedef struct __FUZZ_CASE
+{
+    uint8_t* data;
+    uint32_t len;
+} fuzz_case_t;
+
+typedef struct __FUZZ_WORKER
+{
+    computer_t com;
+    uint32_t dirty[FUZZ_MAX_HOST_PAGES]; /* Host pages written since the last reset */
+    uint32_t dirty_count;
+    uint8_t trace[0x10000]; /* Hits of every edge slot in the running case */
+    uint16_t touched[FUZZ_MAX_TOUCHED];
+    uint32_t touched_count;
+    uint8_t sites[0x10000 / 8]; /* Branch sites seen by this worker */
+    uint64_t rng;
+    uint64_t execs;
+    int error; /* Error code of the last FUZZ_ERROR */
+    pthread_t thread;
+} fuzz_worker_t;
+
+typedef struct __FUZZ
+{
+    uint8_t* snapshot; /* Memory at the ready point */
+    uint16_t regs[0x10];
+    GM_NEC16_Decoded* decoded; /* Predecoded from the snapshot */
+    size_t host_page;
+    uint32_t host_pages;
+    fuzz_worker_t* workers[FUZZ_MAX_THREADS];
+    uint32_t worker_count;
+    pthread_mutex_t lock; /* Corpus, virgin map, crashes and files */
+    fuzz_case_t* corpus;
+    uint32_t corpus_count;
+    uint32_t corpus_cap;
+    uint8_t virgin[0x10000]; /* Hit count buckets seen so far */
+    uint32_t edges;
+    uint32_t crash_keys[FUZZ_MAX_CRASHES]; /* reason << 16 | PC */
+    uint32_t crash_count;
+    uint64_t hangs;
+    uint64_t budget;
+    uint32_t max_len;
+    uint64_t runs; /* 0 runs until stopped */
+    const char* corpus_dir;
+    const char* crash_dir;
+} fuzz_t;
+
+fuzz_t g_FUZZ;
+volatile sig_atomic_t g_FUZZ_STOP = 0;
+
+/* xorshift64* */
+uint64_t fuzz_rand(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+/* A write to a protected page of a machine, the page is dirty and writable until the next reset */
+void fuzz_segv(int sig, siginfo_t* info, void* ctx)
+{
+    uint8_t* addr = (uint8_t*)info->si_addr;
+    uint32_t i;
+
+    (void)ctx;
+    for(i = 0; i < g_FUZZ.worker_count; i++)
+    {
+        fuzz_worker_t* w = g_FUZZ.workers[i];
+
+        if(addr >= w->com.memory && addr < w->com.memory + 0x10000)
+        {
+            uint32_t page = (uint32_t)((size_t)(addr - w->com.memory) / g_FUZZ.host_page);
+
+            w->dirty[w->dirty_count++] = page;
+            mprotect(w->com.memory + page * g_FUZZ.host_page, g_FUZZ.host_page, PROT_READ | PROT_WRITE);
+            return;
+        }
+    }
+    /* Not ours, fault again without the handler */
+    signal(sig, SIG_DFL);
+}
+
+void fuzz_stop_signal(int sig)
+{
+    (void)sig;
+    g_FUZZ_STOP = 1;
+}
+
+void fuzz_reset(fuzz_worker_t* w)
+{
+    computer_t* com = &w->com;
+    core_t* core = &com->cores[0];
+    uint32_t i;
+
+    for(i = 0; i < w->dirty_count; i++)
+    {
+        size_t offset = w->dirty[i] * g_FUZZ.host_page;
+
+        memcpy(com->memory + offset, g_FUZZ.snapshot + offset, g_FUZZ.host_page);
+        mprotect(com->memory + offset, g_FUZZ.host_page, PROT_READ);
+    }
+    w->dirty_count = 0;
+    memcpy(core->cpu.regs, g_FUZZ.regs, sizeof(g_FUZZ.regs));
+    if(g_FUZZ.decoded != NULL)
+    {
+        /* Writes dropped predecoded pages, the memory is the snapshot again */
+        gmnec16_map_decoded(&core->cpu, 0, TIOS_DECODED_LEN, g_FUZZ.decoded);
+    }
+    core->instrs = 0;
+    com->exit_flag = 0;
+    com->input_eof = 0;
+    com->output_len = 0;
+}
+
+void fuzz_edge(fuzz_worker_t* w, uint16_t from, uint16_t to)
+{
+    uint16_t slot;
+
+    if((uint16_t)(to - from) != 2 && (uint16_t)(to - from) != 4)
+    {
+        w->sites[from >> 3] |= (uint8_t)(1 << (from & 7));
+    }
+    if((w->sites[from >> 3] & (1 << (from & 7))) == 0)
+    {
+        return;
+    }
+    slot = (uint16_t)((from * 0x9e37u) ^ to);
+    if(w->trace[slot] == 0)
+    {
+        if(w->touched_count < FUZZ_MAX_TOUCHED)
+        {
+            w->touched[w->touched_count] = slot;
+        }
+        w->touched_count++;
+    }
+    if(w->trace[slot] != 0xff)
+    {
+        w->trace[slot]++;
+    }
+}
+
+/* Run one case from the snapshot, returns FUZZ_* */
+int fuzz_exec(fuzz_worker_t* w, uint8_t* data, uint32_t len)
+{
+    computer_t* com = &w->com;
+    core_t* core = &com->cores[0];
+    uint64_t left = g_FUZZ.budget;
+    int inres = 0;
+
+    fuzz_reset(w);
+    com->input_pending = data;
+    com->input_pending_len = len;
+    com->input_pending_pos = 0;
+    while(left != 0 && com->exit_flag != 1)
+    {
+        uint16_t from = core->cpu.regs[GM_NEC16_PC];
+
+        /* HLT doesn't wait, all of the input is there */
+        inres = tios_run(com, core, 1);
+        left--;
+        fuzz_edge(w, from, core->cpu.regs[GM_NEC16_PC]);
+    }
+    com->input_pending = NULL;
+    com->input_pending_len = 0;
+    __atomic_store_n(&w->execs, w->execs + 1, __ATOMIC_RELAXED);
+    if(inres < 0)
+    {
+        w->error = inres;
+        return FUZZ_ERROR;
+    }
+    if(com->exit_flag == 1 && core->cpu.regs[GM_NEC16_PC] >= (32 * 1024 + 3))
+    {
+        return FUZZ_RAM;
+    }
+    return (com->exit_flag == 1) ? FUZZ_EXIT : FUZZ_HANG;
+}
+
+uint8_t fuzz_bucket(uint8_t hits)
+{
+    if(hits <= 2)
+    {
+        return hits;
+    }
+    if(hits == 3)
+    {
+        return 4;
+    }
+    if(hits < 8)
+    {
+        return 8;
+    }
+    if(hits < 16)
+    {
+        return 16;
+    }
+    if(hits < 32)
+    {
+        return 32;
+    }
+    return (hits < 128) ? 64 : 128;
+}
+
+/* Merge the trace of the last case into the virgin map and clear it, returns 1 when it hit something new */
+int fuzz_merge(fuzz_worker_t* w)
+{
+    uint32_t count = (w->touched_count <= FUZZ_MAX_TOUCHED) ? w->touched_count : 0x10000;
+    int novel = 0;
+    uint32_t i;
+
+    for(i = 0; i < count && !novel; i++)
+    {
+        uint16_t slot = (count == 0x10000) ? (uint16_t)i : w->touched[i];
+
+        novel = (fuzz_bucket(w->trace[slot]) & ~__atomic_load_n(&g_FUZZ.virgin[slot], __ATOMIC_RELAXED)) != 0;
+    }
+    if(novel)
+    {
+        pthread_mutex_lock(&g_FUZZ.lock);
+        for(i = 0; i < count; i++)
+        {
+            uint16_t slot = (count == 0x10000) ? (uint16_t)i : w->touched[i];
+
+            if(w->trace[slot] != 0)
+            {
+                g_FUZZ.edges += (g_FUZZ.virgin[slot] == 0);
+                __atomic_store_n(&g_FUZZ.virgin[slot], g_FUZZ.virgin[slot] | fuzz_bucket(w->trace[slot]), __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&g_FUZZ.lock);
+    }
+    if(count == 0x10000)
+    {
+        memset(w->trace, 0, sizeof(w->trace));
+    }
+    else
+    {
+        for(i = 0; i < count; i++)
+        {
+            w->trace[w->touched[i]] = 0;
+        }
+    }
+    w->touched_count = 0;
+    return novel;
+}
+
+void fuzz_save(const char* dir, const char* name, const uint8_t* data, uint32_t len)
+{
+    char path[4096];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "wb");
+    if(f == NULL)
+    {
+        printf("[ERROR] >> Can't create '%s'\n", path);
+        return;
+    }
+    fwrite(data, 1, len, f);
+    fclose(f);
+}
+
+/* Takes a copy of data, lock held */
+void fuzz_add_case(const uint8_t* data, uint32_t len, int save)
+{
+    char name[32];
+    fuzz_case_t* c;
+
+    if(g_FUZZ.corpus_count == g_FUZZ.corpus_cap)
+    {
+        uint32_t cap = (g_FUZZ.corpus_cap == 0) ? 256 : g_FUZZ.corpus_cap * 2;
+        fuzz_case_t* corpus = realloc(g_FUZZ.corpus, cap * sizeof(fuzz_case_t));
+
+        if(corpus == NULL)
+        {
+            return;
+        }
+        g_FUZZ.corpus = corpus;
+        g_FUZZ.corpus_cap = cap;
+    }
+    c = &g_FUZZ.corpus[g_FUZZ.corpus_count];
+    c->data = malloc(len > 0 ? len : 1);
+    if(c->data == NULL)
+    {
+        return;
+    }
+    memcpy(c->data, data, len);
+    c->len = len;
+    g_FUZZ.corpus_count++;
+    if(save && g_FUZZ.corpus_dir != NULL)
+    {
+        snprintf(name, sizeof(name), "case-%06u", (unsigned)g_FUZZ.corpus_count);
+        fuzz_save(g_FUZZ.corpus_dir, name, data, len);
+    }
+}
+
+/* Crashes are told apart by their reason and the PC they stopped at */
+void fuzz_crash(fuzz_worker_t* w, int reason, const uint8_t* data, uint32_t len)
+{
+    uint32_t key = ((uint32_t)reason << 16) | w->com.cores[0].cpu.regs[GM_NEC16_PC];
+    char name[64];
+    uint32_t i;
+
+    pthread_mutex_lock(&g_FUZZ.lock);
+    for(i = 0; i < g_FUZZ.crash_count && g_FUZZ.crash_keys[i] != key; i++)
+    {
+    }
+    if(i == g_FUZZ.crash_count && i < FUZZ_MAX_CRASHES)
+    {
+        g_FUZZ.crash_keys[g_FUZZ.crash_count++] = key;
+        if(reason == FUZZ_ERROR)
+        {
+            printf("\nCrash at 0x%04X, error code %d, '%s'\n", key & 0xffff, w->error, get_error_type(w->error));
+            snprintf(name, sizeof(name), "crash-error%d-%04x", -w->error, key & 0xffff);
+        }
+        else
+        {
+            printf("\nCrash at 0x%04X, executed RAM\n", key & 0xffff);
+            snprintf(name, sizeof(name), "crash-ram-%04x", key & 0xffff);
+        }
+        if(g_FUZZ.crash_dir != NULL)
+        {
+            fuzz_save(g_FUZZ.crash_dir, name, data, len);
+        }
+    }
+    pthread_mutex_unlock(&g_FUZZ.lock);
+}
+
+/* Stack a few random changes, returns the new length */
+uint32_t fuzz_mutate(fuzz_worker_t* w, uint8_t* buf, uint32_t len)
+{
+    static const uint8_t interesting[] = {0, 1, 0x7f, 0x80, 0xff, '\n', ' ', '0', '9', 'A', 'z', '-'};
+    uint32_t rounds = 1 + (uint32_t)(fuzz_rand(&w->rng) % 8);
+    uint32_t i;
+
+    for(i = 0; i < rounds; i++)
+    {
+        uint64_t r = fuzz_rand(&w->rng);
+        uint32_t pos = (len > 0) ? (uint32_t)((r >> 8) % len) : 0;
+
+        switch((len == 0) ? 3 : (int)(r % 7))
+        {
+            case 0: buf[pos] ^= (uint8_t)(1 << ((r >> 40) & 7)); break;
+            case 1: buf[pos] = (uint8_t)(r >> 40); break;
+            case 2: buf[pos] = interesting[(r >> 40) % sizeof(interesting)]; break;
+            case 3:
+                if(len < g_FUZZ.max_len)
+                {
+                    memmove(buf + pos + 1, buf + pos, len - pos);
+                    buf[pos] = (uint8_t)(r >> 40);
+                    len++;
+                }
+                break;
+            case 4:
+                memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                len--;
+                break;
+            case 5:
+            {
+                /* Copy a chunk over another place */
+                uint32_t to = (uint32_t)((r >> 32) % len);
+                uint32_t n = 1 + (uint32_t)((r >> 48) % 8);
+
+                n = (n > len - pos) ? len - pos : n;
+                n = (n > len - to) ? len - to : n;
+                memmove(buf + to, buf + pos, n);
+                break;
+            }
+            default: buf[pos] = (uint8_t)(buf[pos] + (((r >> 40) & 1) ? 1 : -1) * (int)(1 + ((r >> 41) % 16))); break;
+        }
+    }
+    return len;
+}
+
+/* Try a case, it joins the corpus when it hits something new */
+void fuzz_try(fuzz_worker_t* w, uint8_t* data, uint32_t len, int save)
+{
+    int reason = fuzz_exec(w, data, len);
+
+    if(fuzz_merge(w))
+    {
+        pthread_mutex_lock(&g_FUZZ.lock);
+        fuzz_add_case(data, len, save);
+        pthread_mutex_unlock(&g_FUZZ.lock);
+    }
+    if(reason == FUZZ_HANG)
+    {
+        __atomic_add_fetch(&g_FUZZ.hangs, 1, __ATOMIC_RELAXED);
+    }
+    if(reason == FUZZ_ERROR || reason == FUZZ_RAM)
+    {
+        fuzz_crash(w, reason, data, len);
+    }
+}
+
+uint64_t fuzz_total_execs()
+{
+    uint64_t execs = 0;
+    uint32_t i;
+
+    for(i = 0; i < g_FUZZ.worker_count; i++)
+    {
+        execs += __atomic_load_n(&g_FUZZ.workers[i]->execs, __ATOMIC_RELAXED);
+    }
+    return execs;
+}
+
+void* fuzz_thread(void* arg)
+{
+    fuzz_worker_t* w = (fuzz_worker_t*)arg;
+    uint8_t* buf = malloc(g_FUZZ.max_len);
+    uint32_t len;
+
+    if(buf == NULL)
+    {
+        return NULL;
+    }
+    while(!g_FUZZ_STOP && (g_FUZZ.runs == 0 || fuzz_total_execs() < g_FUZZ.runs))
+    {
+        pthread_mutex_lock(&g_FUZZ.lock);
+        {
+            fuzz_case_t* c = &g_FUZZ.corpus[fuzz_rand(&w->rng) % g_FUZZ.corpus_count];
+
+            len = c->len;
+            memcpy(buf, c->data, len);
+        }
+        pthread_mutex_unlock(&g_FUZZ.lock);
+        len = fuzz_mutate(w, buf, len);
+        fuzz_try(w, buf, len, 1);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* A machine of its own for every worker, all of them start as copies of the one at the ready point */
+fuzz_worker_t* fuzz_worker_new(const tios_config_t* conf, const computer_t* ready, uint64_t seed)
+{
+    fuzz_worker_t* w = calloc(1, sizeof(fuzz_worker_t));
+    tios_config_t wconf = *conf;
+
+    if(w == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return NULL;
+    }
+    wconf.image = ready;
+    wconf.resume_file = NULL;
+    if(tios_init(&w->com, &wconf) < 0)
+    {
+        return NULL;
+    }
+    memcpy(w->com.cores[0].cpu.regs, g_FUZZ.regs, sizeof(g_FUZZ.regs));
+    mprotect(w->com.memory, 0x10000, PROT_READ);
+    w->rng = seed * 0x9e3779b97f4a7c15ull + 1;
+    g_FUZZ.workers[g_FUZZ.worker_count] = w;
+    __atomic_store_n(&g_FUZZ.worker_count, g_FUZZ.worker_count + 1, __ATOMIC_RELEASE);
+    return w;
+}
+
+/* Seeds are every file of the corpus directory, an empty case when there are none */
+void fuzz_load_seeds(fuzz_worker_t* w)
+{
+    uint8_t* buf = malloc(g_FUZZ.max_len);
+    DIR* dir = (g_FUZZ.corpus_dir != NULL) ? opendir(g_FUZZ.corpus_dir) : NULL;
+    struct dirent* de;
+
+    if(buf == NULL)
+    {
+        return;
+    }
+    while(dir != NULL && (de = readdir(dir)) != NULL)
+    {
+        char path[4096];
+        FILE* f;
+        size_t len;
+
+        if(de->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", g_FUZZ.corpus_dir, de->d_name);
+        f = fopen(path, "rb");
+        if(f == NULL)
+        {
+            continue;
+        }
+        len = fread(buf, 1, g_FUZZ.max_len, f);
+        fclose(f);
+        fuzz_exec(w, buf, (uint32_t)len);
+        fuzz_merge(w);
+        fuzz_add_case(buf, (uint32_t)len, 0);
+    }
+    if(dir != NULL)
+    {
+        closedir(dir);
+    }
+    if(g_FUZZ.corpus_count == 0)
+    {
+        fuzz_exec(w, buf, 0);
+        fuzz_merge(w);
+        fuzz_add_case(buf, 0, 0);
+    }
+    free(buf);
+}
+
+void fuzz_print(uint64_t start_ns)
+{
+    uint64_t execs = fuzz_total_execs();
+    double secs = (double)(tios_now_ns() - start_ns) / 1e9;
+
+    printf("\rexecs %llu, %.0f/s, corpus %u, edges %u, crashes %u, hangs %llu    ", (unsigned long long)execs,
+        (secs > 0) ? (double)execs / secs : 0.0, (unsigned)g_FUZZ.corpus_count, (unsigned)g_FUZZ.edges, (unsigned)g_FUZZ.crash_count,
+        (unsigned long long)__atomic_load_n(&g_FUZZ.hangs, __ATOMIC_RELAXED));
+    fflush(stdout);
+}
+
+int main(int args, char** argv)
+{
+    tios_config_t conf;
+    computer_t ready;
+    core_t* core;
+    struct sigaction sa;
+    long threads = 1;
+    long seconds = 0;
+    long ready_pc = -1;
+    uint64_t seed = 1;
+    uint64_t start;
+    uint64_t steps = 0;
+    uint32_t ticks = 0;
+    int i;
+
+    memset(&g_FUZZ, 0, sizeof(fuzz_t));
+    pthread_mutex_init(&g_FUZZ.lock, NULL);
+    g_FUZZ.budget = FUZZ_DEFAULT_BUDGET;
+    g_FUZZ.max_len = FUZZ_DEFAULT_MAX_LEN;
+    tios_config_init(&conf);
+    conf.headless = 1;
+
+    /* tiosfuzz <rom> [--ready=<addr>] [--budget=<instructions per case>] [--threads=<n>] [--runs=<cases>] [--seconds=<n>] */
+    /* [--corpus=<dir>] [--crashes=<dir>] [--max-len=<bytes>] [--seed=<n>] [--options] */
+    /* Without --ready the snapshot is taken at the entry point, new cases are written to the corpus directory */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            int parsed = tios_parse_option(&conf, argv[i]);
+
+            if(parsed < 0)
+            {
+                return 1;
+            }
+            if(parsed == 0 && strncmp(argv[i], "--ready=", 8) == 0)
+            {
+                ready_pc = strtol(argv[i] + 8, NULL, 0);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--budget=", 9) == 0)
+            {
+                g_FUZZ.budget = strtoull(argv[i] + 9, NULL, 0);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--threads=", 10) == 0)
+            {
+                threads = atol(argv[i] + 10);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--runs=", 7) == 0)
+            {
+                g_FUZZ.runs = strtoull(argv[i] + 7, NULL, 0);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--seconds=", 10) == 0)
+            {
+                seconds = atol(argv[i] + 10);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--corpus=", 9) == 0)
+            {
+                g_FUZZ.corpus_dir = argv[i] + 9;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--crashes=", 10) == 0)
+            {
+                g_FUZZ.crash_dir = argv[i] + 10;
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--max-len=", 10) == 0)
+            {
+                g_FUZZ.max_len = (uint32_t)atol(argv[i] + 10);
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--seed=", 7) == 0)
+            {
+                seed = strtoull(argv[i] + 7, NULL, 0);
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        conf.rom_file = argv[i];
+    }
+    if(conf.rom_file == NULL && conf.resume_file == NULL)
+    {
+        printf("No file to execute.\n");
+        return 0;
+    }
+    if(threads <= 0 || threads > FUZZ_MAX_THREADS || g_FUZZ.budget == 0 || g_FUZZ.max_len == 0 || ready_pc > 0xffff)
+    {
+        printf("[ERROR] >> Bad value, threads 1 to %d, budget and max length at least 1, ready point 0 to 0xffff\n", FUZZ_MAX_THREADS);
+        return 1;
+    }
+    /* The memory is all a case can change */
+    if(conf.bank_count > 0 || conf.blockdev_file != NULL || conf.stats)
+    {
+        printf("[ERROR] >> --banks, --blockdev and --stats don't work with fuzzing\n");
+        return 1;
+    }
+    g_FUZZ.host_page = (size_t)sysconf(_SC_PAGESIZE);
+    g_FUZZ.host_pages = (g_FUZZ.host_page >= 0x10000) ? 1 : (uint32_t)(0x10000 / g_FUZZ.host_page);
+    if(g_FUZZ.host_pages > FUZZ_MAX_HOST_PAGES)
+    {
+        printf("[ERROR] >> Host pages of %zu bytes are too small\n", g_FUZZ.host_page);
+        return 1;
+    }
+    if(g_FUZZ.host_page > 0x10000)
+    {
+        g_FUZZ.host_page = 0x10000;
+    }
+
+    /* Run to the ready point, without input */
+    if(tios_init(&ready, &conf) < 0)
+    {
+        return 1;
+    }
+    core = &ready.cores[0];
+    while(ready_pc >= 0 && core->cpu.regs[GM_NEC16_PC] != ready_pc && ready.exit_flag != 1 && steps < FUZZ_READY_MAX)
+    {
+        tios_run(&ready, core, 1);
+        steps++;
+    }
+    if(ready.exit_flag == 1 || steps == FUZZ_READY_MAX)
+    {
+        printf("[ERROR] >> The ROM never got to 0x%04lX\n", ready_pc);
+        return 1;
+    }
+    g_FUZZ.snapshot = malloc(0x10000);
+    g_FUZZ.decoded = malloc(TIOS_DECODED_LEN * sizeof(GM_NEC16_Decoded));
+    if(g_FUZZ.snapshot == NULL || g_FUZZ.decoded == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    memcpy(g_FUZZ.snapshot, ready.memory, 0x10000);
+    memcpy(g_FUZZ.regs, core->cpu.regs, sizeof(g_FUZZ.regs));
+    tios_predecode(&ready, g_FUZZ.decoded);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fuzz_segv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    signal(SIGINT, fuzz_stop_signal);
+
+    for(i = 0; i < threads; i++)
+    {
+        if(fuzz_worker_new(&conf, &ready, seed + (uint64_t)i) == NULL)
+        {
+            return 1;
+        }
+    }
+    fuzz_load_seeds(g_FUZZ.workers[0]);
+    printf("Snapshot at 0x%04X after %llu instructions, %u seeds\n", g_FUZZ.regs[GM_NEC16_PC], (unsigned long long)steps,
+        (unsigned)g_FUZZ.corpus_count);
+
+    start = tios_now_ns();
+    for(i = 0; i < threads; i++)
+    {
+        if(pthread_create(&g_FUZZ.workers[i]->thread, NULL, fuzz_thread, g_FUZZ.workers[i]) != 0)
+        {
+            printf("[ERROR] >> Can't start thread %d\n", i);
+            return 1;
+        }
+    }
+    while(!g_FUZZ_STOP && (g_FUZZ.runs == 0 || fuzz_total_execs() < g_FUZZ.runs))
+    {
+        usleep(100000);
+        if(++ticks % 10 == 0)
+        {
+            fuzz_print(start);
+        }
+        if(seconds > 0 && tios_now_ns() - start >= (uint64_t)seconds * 1000000000ull)
+        {
+            g_FUZZ_STOP = 1;
+        }
+    }
+    g_FUZZ_STOP = 1;
+    for(i = 0; i < threads; i++)
+    {
+        pthread_join(g_FUZZ.workers[i]->thread, NULL);
+    }
+    fuzz_print(start);
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/* TIOS with several NEC16 cores sharing one machine */
+/* Every core runs on its own host thread, --deterministic=<quantum> runs them in turns on one thread instead, */
+/* quantum instructions at a time, so a run (and a race in it) can be repeated exactly */
+
+#include "tios.h"
+
+#define TIOSMP_DEFAULT_CORES 2
+
+typedef struct __CORE_RUN
+{
+    computer_t* com;
+    core_t* core;
+    uint64_t budget; /* TIOS_NO_BUDGET for no limit */
+    pthread_t thread;
+} core_run_t;
+
+uint32_t g_HALTED_CORES = 0;
+
+void* core_thread(void* arg)
+{
+    core_run_t* run = (core_run_t*)arg;
+    computer_t* com = run->com;
+    core_t* core = run->core;
+
+    while(com->exit_flag != 1 && core->instrs < run->budget)
+    {
+        uint64_t n = TIOS_STATS_SLICE;
+
+        if(run->budget - core->instrs < n)
+        {
+            n = run->budget - core->instrs;
+        }
+        if(tios_run(com, core, n) == GM_NEC16_HALTED)
+        {
+            uint32_t halted = __atomic_add_fetch(&g_HALTED_CORES, 1, __ATOMIC_SEQ_CST);
+
+            tios_stats_update(com, halted == com->core_count ? TIOS_STATE_HALTED : TIOS_STATE_RUNNING);
+            tios_wait_event(com);
+            __atomic_sub_fetch(&g_HALTED_CORES, 1, __ATOMIC_SEQ_CST);
+            tios_stats_update(com, TIOS_STATE_RUNNING);
+        }
+    }
+    return NULL;
+}
+
+/* A halted core gives up the rest of its turn, the machine only sleeps when every running core halted */
+void run_deterministic(computer_t* com, uint64_t quantum, uint64_t budget)
+{
+    uint32_t i;
+
+    while(com->exit_flag != 1)
+    {
+        int running = 0;
+        int halted = 0;
+
+        for(i = 0; i < com->core_count && com->exit_flag != 1; i++)
+        {
+            core_t* core = &com->cores[i];
+            uint64_t n = quantum;
+
+            if(core->instrs >= budget)
+            {
+                continue;
+            }
+            if(budget - core->instrs < n)
+            {
+                n = budget - core->instrs;
+            }
+            running++;
+            if(tios_run(com, core, n) == GM_NEC16_HALTED)
+            {
+                halted++;
+            }
+        }
+        if(running == 0)
+        {
+            break;
+        }
+        if(halted == running)
+        {
+            tios_stats_update(com, TIOS_STATE_HALTED);
+            tios_wait_event(com);
+            tios_stats_update(com, TIOS_STATE_RUNNING);
+        }
+    }
+}
+
+int main(int args, char** argv)
+{
+    int instr_counts = 0;
+    uint64_t budget = TIOS_NO_BUDGET;
+    int positional = 0;
+    int quantum = 0;
+    int i;
+    tios_config_t conf;
+    computer_t com;
+    core_run_t runs[TIOS_MAX_CORES];
+
+    tios_config_init(&conf);
+    conf.core_count = TIOSMP_DEFAULT_CORES;
+    conf.smp = 1;
+
+    /* tiosmp <rom> [-d] [instruction limit of each core] [--cores=<n>] [--deterministic=<quantum>] [--options] */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            int parsed = tios_parse_option(&conf, argv[i]);
+
+            if(parsed < 0)
+            {
+                return 1;
+            }
+            if(parsed == 0 && strncmp(argv[i], "--cores=", 8) == 0)
+            {
+                conf.core_count = atoi(argv[i] + 8);
+                if(conf.core_count <= 0 || conf.core_count > TIOS_MAX_CORES)
+                {
+                    printf("[ERROR] >> The core count has to be 1 to %d\n", TIOS_MAX_CORES);
+                    return 1;
+                }
+            }
+            else if(parsed == 0 && strncmp(argv[i], "--deterministic=", 16) == 0)
+            {
+                quantum = atoi(argv[i] + 16);
+                if(quantum <= 0)
+                {
+                    printf("[ERROR] >> The quantum has to be at least 1 instruction\n");
+                    return 1;
+                }
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        positional++;
+        if(positional == 1)
+        {
+            conf.rom_file = argv[i];
+        }
+        if(positional == 2 && strcmp("-d", argv[i]) == 0)
+        {
+            g_DEBUG_ENABLED = 1;
+        }
+        if(positional == 3)
+        {
+            instr_counts = atoi(argv[i]);
+            if(instr_counts <= 0)
+            {
+                /* Like tios, a limit stops before the first instruction */
+                return 0;
+            }
+        }
+    }
+    if(conf.rom_file == NULL && conf.resume_file == NULL)
+    {
+        printf("No file to execute.\n");
+        return 0;
+    }
+    if(tios_init(&com, &conf) < 0)
+    {
+        return 1;
+    }
+    if(instr_counts > 0)
+    {
+        /* Like tios, the limit counts the instruction each core stops at */
+        budget = (uint64_t)(instr_counts - 1);
+    }
+
+    if(quantum > 0)
+    {
+        run_deterministic(&com, (uint64_t)quantum, budget);
+        tios_stats_close(&com);
+        return 0;
+    }
+    for(i = 0; i < conf.core_count; i++)
+    {
+        runs[i].com = &com;
+        runs[i].core = &com.cores[i];
+        runs[i].budget = budget;
+        if(pthread_create(&runs[i].thread, NULL, core_thread, &runs[i]) != 0)
+        {
+            printf("[ERROR] >> Can't start core %d\n", i);
+            com.exit_flag = 1;
+            conf.core_count = i;
+            break;
+        }
+    }
+    for(i = 0; i < conf.core_count; i++)
+    {
+        pthread_join(runs[i].thread, NULL);
+    }
+    tios_stats_close(&com);
+    fflush(stdout);
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/* TIOS pipelines, every ROM runs in a machine of its own on its own thread */
+/* Each machine sends to the next one over a channel (see TIOS_CHAN_*), all of them share the console */
+
+#include "tios.h"
+
+#define TIOSPIPE_MAX_STAGES 64
+
+typedef struct __STAGE
+{
+    computer_t com;
+    pthread_t thread;
+} stage_t;
+
+void* stage_thread(void* arg)
+{
+    stage_t* stage = (stage_t*)arg;
+    computer_t* com = &stage->com;
+
+    while(com->exit_flag != 1)
+    {
+        if(tios_run(com, &com->cores[0], TIOS_STATS_SLICE) == GM_NEC16_HALTED)
+        {
+            tios_stats_update(com, TIOS_STATE_HALTED);
+            tios_wait_event(com);
+            tios_stats_update(com, TIOS_STATE_RUNNING);
+        }
+    }
+    tios_detach_channels(com);
+    tios_stats_close(com);
+    return NULL;
+}
+
+int main(int args, char** argv)
+{
+    const char* roms[TIOSPIPE_MAX_STAGES];
+    int rom_count = 0;
+    long channel_size = TIOS_CHAN_DEFAULT_SIZE;
+    int i;
+    tios_config_t conf;
+    stage_t* stages;
+    channel_t* channels;
+
+    tios_config_init(&conf);
+
+    /* tiospipe <rom> <rom>... [--channel-size=<bytes>] [--options], the options apply to every machine */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--", 2) == 0)
+        {
+            int parsed = tios_parse_option(&conf, argv[i]);
+
+            if(parsed < 0)
+            {
+                return 1;
+            }
+            if(parsed == 0 && strncmp(argv[i], "--channel-size=", 15) == 0)
+            {
+                channel_size = atol(argv[i] + 15);
+                if(channel_size <= 0 || channel_size > 0x40000000L)
+                {
+                    printf("[ERROR] >> The channel size has to be 1 to %ld bytes\n", 0x40000000L);
+                    return 1;
+                }
+            }
+            else if(parsed == 0)
+            {
+                printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(rom_count == TIOSPIPE_MAX_STAGES)
+        {
+            printf("[ERROR] >> At most %d machines\n", TIOSPIPE_MAX_STAGES);
+            return 1;
+        }
+        roms[rom_count++] = argv[i];
+    }
+    if(rom_count == 0)
+    {
+        printf("No file to execute.\n");
+        return 0;
+    }
+
+    stages = calloc((size_t)rom_count, sizeof(stage_t));
+    channels = calloc((size_t)rom_count, sizeof(channel_t));
+    if(stages == NULL || channels == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < rom_count; i++)
+    {
+        conf.rom_file = roms[i];
+        if(tios_init(&stages[i].com, &conf) < 0)
+        {
+            return 1;
+        }
+        if(i + 1 < rom_count && channel_init(&channels[i], (uint32_t)channel_size) < 0)
+        {
+            printf("[ERROR] >> Out of memory\n");
+            return 1;
+        }
+    }
+    for(i = 0; i < rom_count; i++)
+    {
+        tios_attach_channels(&stages[i].com, i > 0 ? &channels[i - 1] : NULL, i + 1 < rom_count ? &channels[i] : NULL);
+    }
+
+    for(i = 0; i < rom_count; i++)
+    {
+        if(pthread_create(&stages[i].thread, NULL, stage_thread, &stages[i]) != 0)
+        {
+            printf("[ERROR] >> Can't start '%s'\n", roms[i]);
+            return 1;
+        }
+    }
+    for(i = 0; i < rom_count; i++)
+    {
+        pthread_join(stages[i].thread, NULL);
+    }
+    fflush(stdout);
+
+    return 0;
+}
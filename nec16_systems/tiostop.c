@@ -0,0 +1,209 @@
+/* tiostop, shows the live stats of every TIOS machine started with --stats on this host */
+/* A machine whose process is gone left its segment behind, --clean removes those */
+
+#include "tios.h"
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+
+#define TIOSTOP_MAX_MACHINES 1024
+#define TIOSTOP_SHM_DIR "/dev/shm"
+#define TIOSTOP_STALE_NS 2000000000ull /* A running machine that published nothing for this long is shown as stalled */
+
+typedef struct __TOP_ENTRY
+{
+    tios_stats_t st;
+    char name[256];
+    int gone;
+} top_entry_t;
+
+/* Returns -1 when the segment isn't a (complete) stats segment */
+int top_read(const char* name, tios_stats_t* out)
+{
+    char path[300];
+    struct stat sb;
+    tios_stats_t* st;
+    int fd;
+    int result;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(tios_stats_t))
+    {
+        close(fd);
+        return -1;
+    }
+    st = mmap(NULL, sizeof(tios_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(st == MAP_FAILED)
+    {
+        return -1;
+    }
+    result = -1;
+    if(memcmp(st->magic, TIOS_STATS_MAGIC, 8) == 0 && st->version == TIOS_STATS_VERSION)
+    {
+        result = tios_stats_read(st, out);
+    }
+    munmap(st, sizeof(tios_stats_t));
+    return result;
+}
+
+int top_compare(const void* a, const void* b)
+{
+    const top_entry_t* x = (const top_entry_t*)a;
+    const top_entry_t* y = (const top_entry_t*)b;
+
+    if(x->gone != y->gone)
+    {
+        return x->gone - y->gone;
+    }
+    return (x->st.instrs_per_sec < y->st.instrs_per_sec) - (x->st.instrs_per_sec > y->st.instrs_per_sec);
+}
+
+const char* top_state(const top_entry_t* e, uint64_t now)
+{
+    if(e->gone)
+    {
+        return "gone";
+    }
+    switch(e->st.state)
+    {
+        case TIOS_STATE_HALTED: return "halted";
+        case TIOS_STATE_INPUT: return "input";
+        default: return (now - e->st.update_ns > TIOSTOP_STALE_NS) ? "stalled" : "running";
+    }
+}
+
+/* Returns the number of machines, stale segments are removed (and not counted) when clean is set */
+int top_scan(top_entry_t* entries, int clean)
+{
+    DIR* dir = opendir(TIOSTOP_SHM_DIR);
+    struct dirent* de;
+    int count = 0;
+
+    if(dir == NULL)
+    {
+        printf("[ERROR] >> Can't open '%s'\n", TIOSTOP_SHM_DIR);
+        return -1;
+    }
+    while((de = readdir(dir)) != NULL && count < TIOSTOP_MAX_MACHINES)
+    {
+        top_entry_t* e = &entries[count];
+
+        if(strncmp(de->d_name, TIOS_STATS_PREFIX, strlen(TIOS_STATS_PREFIX)) != 0 || top_read(de->d_name, &e->st) < 0)
+        {
+            continue;
+        }
+        snprintf(e->name, sizeof(e->name), "%s", de->d_name);
+        e->gone = kill((pid_t)e->st.pid, 0) < 0 && errno == ESRCH;
+        if(e->gone && clean)
+        {
+            char path[300];
+
+            snprintf(path, sizeof(path), "/%s", e->name);
+            shm_unlink(path);
+            printf("Removed '%s'\n", e->name);
+            continue;
+        }
+        count++;
+    }
+    closedir(dir);
+    qsort(entries, (size_t)count, sizeof(top_entry_t), top_compare);
+    return count;
+}
+
+void top_print(top_entry_t* entries, int count)
+{
+    uint64_t now = tios_now_ns();
+    uint64_t total_rate = 0;
+    int i;
+
+    printf("%-8s %-3s %-8s %10s %14s %-6s %12s %12s %10s %10s %9s  %s\n", "PID", "M", "STATE", "MIPS", "INSTRS", "PC",
+        "BUS READS", "BUS WRITES", "IN", "OUT", "UP s", "ROM");
+    for(i = 0; i < count; i++)
+    {
+        top_entry_t* e = &entries[i];
+
+        if(!e->gone)
+        {
+            total_rate += e->st.instrs_per_sec;
+        }
+        printf("%-8u %-3u %-8s %10.2f %14llu 0x%04X %12llu %12llu %10llu %10llu %9.1f  %s\n", (unsigned)e->st.pid, (unsigned)e->st.machine,
+            top_state(e, now), (double)e->st.instrs_per_sec / 1e6, (unsigned long long)e->st.instrs, e->st.pc[0],
+            (unsigned long long)e->st.bus_reads, (unsigned long long)e->st.bus_writes, (unsigned long long)e->st.input_bytes,
+            (unsigned long long)e->st.output_bytes, (double)(e->st.update_ns - e->st.start_ns) / 1e9, e->st.rom);
+    }
+    printf("%d machines, %.2f MIPS\n", count, (double)total_rate / 1e6);
+}
+
+int main(int args, char** argv)
+{
+    int interval_ms = 1000;
+    int once = 0;
+    int clean = 0;
+    int count;
+    int i;
+    top_entry_t* entries;
+
+    /* tiostop [--interval=<ms>] [--once] [--clean] */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--interval=", 11) == 0)
+        {
+            interval_ms = atoi(argv[i] + 11);
+            if(interval_ms <= 0)
+            {
+                printf("[ERROR] >> The interval has to be at least 1 ms\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--once") == 0)
+        {
+            once = 1;
+        }
+        else if(strcmp(argv[i], "--clean") == 0)
+        {
+            clean = 1;
+            once = 1;
+        }
+        else
+        {
+            printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    entries = malloc(TIOSTOP_MAX_MACHINES * sizeof(top_entry_t));
+    if(entries == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    while(1)
+    {
+        count = top_scan(entries, clean);
+        if(count < 0)
+        {
+            return 1;
+        }
+        if(!once)
+        {
+            /* Clear the terminal */
+            printf("\033[H\033[J");
+        }
+        top_print(entries, count);
+        fflush(stdout);
+        if(once)
+        {
+            break;
+        }
+        usleep((useconds_t)interval_ms * 1000);
+    }
+    free(entries);
+
+    return 0;
+}
@@ -0,0 +1,352 @@
+/* Benchmark harness for NEC16 engines */
+/* Assembles every workload (every .asm file in asm_benchmarks when none are named), runs it on every engine and reports instructions per second, */
+/* bus accesses per instruction and wall time (warm-up runs are not counted) */
+/* The first rows are TIOS itself, a headless machine built by tios_init and run by tios_run (so they measure tios.h), */
+/* the engines of gmnec16engines.h follow as extra rows */
+/* Engines have to agree on the instruction count and the output of a workload, or it is reported as a mismatch */
+/* The workloads don't write code or read input, so an engine that predecodes the entry page has to keep it mapped until the end */
+
+#include <libgmnec16asm.h>
+#include "gmnec16engines.h"
+#include <nec16_systems/tios.h>
+#include <glob.h>
+#include <math.h>
+#include <time.h>
+
+#define BENCH_MAX_RUNS 1000
+#define BENCH_DEFAULT_WORKLOADS "asm_benchmarks/*.asm" /* Without workload arguments, from the repository root */
+
+/* A row of the report, a TIOS machine when engine is NULL */
+typedef struct __BENCH_ROW
+{
+    const char* name;
+    const engine_t* engine;
+    int bus_only; /* TIOS machine option */
+} bench_row_t;
+
+/* What a run did */
+typedef struct __BENCH_RESULT
+{
+    uint64_t instrs;
+    uint64_t bus_accesses;
+    uint64_t output_hash; /* FNV-1a of the output */
+    int inres;
+    uint16_t pc;
+    int predecoded; /* The entry page was predecoded at the start */
+    int kept_predecoded; /* and still was at the end */
+} bench_result_t;
+
+double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int bench_compare(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Returns the assembled size or -1 */
+long bench_assemble(const char* filename, uint8_t* out, size_t out_cap)
+{
+    GM_NEC16_Asm as;
+    FILE* fptr = fopen(filename, "rb");
+    char* src;
+    long src_len;
+    size_t out_len = 0;
+    int result;
+
+    if(fptr == NULL)
+    {
+        printf("[ERROR] >> Error opening '%s'\n", filename);
+        return -1;
+    }
+    fseek(fptr, 0, SEEK_END);
+    src_len = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+    src = malloc((size_t)src_len + 1);
+    if(src == NULL || fread(src, 1, (size_t)src_len, fptr) != (size_t)src_len)
+    {
+        printf("[ERROR] >> Error reading '%s'\n", filename);
+        fclose(fptr);
+        free(src);
+        return -1;
+    }
+    fclose(fptr);
+
+    gmnec16asm_init(&as);
+    result = gmnec16asm_assemble(&as, src, (size_t)src_len, 3, out, out_cap, &out_len);
+    if(result != GM_NEC16_ASM_OK)
+    {
+        printf("[ERROR] >> '%s' line %lu: %s\n", filename, as.error.line, as.error.message);
+    }
+    gmnec16asm_free(&as);
+    free(src);
+    return (result == GM_NEC16_ASM_OK) ? (long)out_len : -1;
+}
+
+/* Time one run of the workload, machine m holds it already for engine rows */
+double bench_run(const bench_row_t* row, machine_t* m, const uint8_t* rom, size_t rom_len, bench_result_t* result)
+{
+    double start;
+    double elapsed;
+
+    memset(result, 0, sizeof(bench_result_t));
+    if(row->engine != NULL)
+    {
+        machine_reset(m, row->engine);
+        result->predecoded = (m->cpu.decoded[0] != NULL);
+        start = bench_now();
+        result->inres = machine_run(m, 0, &result->instrs);
+        elapsed = bench_now() - start;
+        result->bus_accesses = m->bus_reads + m->bus_writes;
+        result->output_hash = m->output_hash;
+        result->pc = m->cpu.regs[GM_NEC16_PC];
+        result->kept_predecoded = (m->cpu.decoded[0] != NULL);
+    }
+    else
+    {
+        tios_config_t conf;
+        computer_t com;
+        core_t* core;
+        size_t i;
+
+        tios_config_init(&conf);
+        conf.rom_data = rom;
+        conf.rom_len = rom_len;
+        conf.headless = 1;
+        conf.bus_only = row->bus_only;
+        memset(&com, 0, sizeof(computer_t));
+        if(tios_init(&com, &conf) < 0)
+        {
+            tios_free(&com);
+            result->inres = -1;
+            return 0;
+        }
+        core = &com.cores[0];
+        result->predecoded = (core->cpu.decoded[0] != NULL);
+        start = bench_now();
+        while(com.exit_flag != 1)
+        {
+            /* HLT just goes on, like machine_run */
+            result->inres = tios_run(&com, core, TIOS_STATS_SLICE);
+        }
+        elapsed = bench_now() - start;
+        result->instrs = core->instrs;
+        result->bus_accesses = core->bus_reads + core->bus_writes;
+        result->output_hash = 0xcbf29ce484222325ull;
+        for(i = 0; i < com.output_len; i++)
+        {
+            result->output_hash = (result->output_hash ^ com.output[i]) * 0x100000001b3ull;
+        }
+        result->pc = core->cpu.regs[GM_NEC16_PC];
+        result->kept_predecoded = (core->cpu.decoded[0] != NULL);
+        tios_free(&com);
+    }
+    return elapsed;
+}
+
+int main(int args, char** argv)
+{
+    int warmup = 1;
+    int runs = 5;
+    bench_row_t rows[ENGINE_COUNT + 2];
+    size_t row_count = 0;
+    const char* only_engine = NULL;
+    uint8_t rom[0x10000];
+    double times[BENCH_MAX_RUNS];
+    machine_t* m;
+    glob_t defaults;
+    char** workloads;
+    size_t workload_count = 0;
+    size_t w;
+    int mismatches = 0;
+    int i;
+
+    workloads = malloc((size_t)args * sizeof(char*));
+    if(workloads == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    memset(&defaults, 0, sizeof(glob_t));
+
+    /* gmnec16bench [--runs=<n>] [--warmup=<n>] [--engine=<name>] [workload asm]... */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--runs=", 7) == 0)
+        {
+            runs = atoi(argv[i] + 7);
+            if(runs <= 0 || runs > BENCH_MAX_RUNS)
+            {
+                printf("[ERROR] >> The run count has to be 1 to %d\n", BENCH_MAX_RUNS);
+                return 1;
+            }
+        }
+        else if(strncmp(argv[i], "--warmup=", 9) == 0)
+        {
+            warmup = atoi(argv[i] + 9);
+            if(warmup < 0)
+            {
+                printf("[ERROR] >> The warm-up run count can't be negative\n");
+                return 1;
+            }
+        }
+        else if(strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            only_engine = argv[i] + 9;
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+        else
+        {
+            workloads[workload_count++] = argv[i];
+        }
+    }
+    if(workload_count == 0)
+    {
+        if(glob(BENCH_DEFAULT_WORKLOADS, 0, NULL, &defaults) != 0 || defaults.gl_pathc == 0)
+        {
+            printf("Usage: gmnec16bench [--runs=<n>] [--warmup=<n>] [--engine=<name>] [workload asm]...\n");
+            printf("[ERROR] >> No workloads given and none in %s\n", BENCH_DEFAULT_WORKLOADS);
+            return 1;
+        }
+        free(workloads);
+        workloads = defaults.gl_pathv;
+        workload_count = defaults.gl_pathc;
+    }
+
+    rows[row_count].name = "tios";
+    rows[row_count].engine = NULL;
+    rows[row_count++].bus_only = 0;
+    /* Memory accesses through the TIOS bus, the way --heatmap and tiosbatch --dedup run */
+    rows[row_count].name = "tios-bus";
+    rows[row_count].engine = NULL;
+    rows[row_count++].bus_only = 1;
+    for(i = 0; i < (int)ENGINE_COUNT; i++)
+    {
+        rows[row_count].name = g_ENGINES[i].name;
+        rows[row_count].engine = &g_ENGINES[i];
+        rows[row_count++].bus_only = 0;
+    }
+    if(only_engine != NULL)
+    {
+        size_t r;
+
+        for(r = 0; r < row_count && strcmp(rows[r].name, only_engine) != 0; r++)
+        {
+        }
+        if(r == row_count)
+        {
+            printf("[ERROR] >> Unknown engine '%s'\n", only_engine);
+            return 1;
+        }
+        rows[0] = rows[r];
+        row_count = 1;
+    }
+
+    m = machine_alloc();
+    if(m == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    printf("%-24s %-12s %12s %9s %10s %10s %9s %9s\n", "workload", "engine", "instrs", "bus/inst", "median ms", "min ms", "stddev", "MIPS");
+    for(w = 0; w < workload_count; w++)
+    {
+        const char* filename = workloads[w];
+        const char* name;
+        long rom_len;
+        size_t r;
+        uint64_t ref_instrs = 0;
+        uint64_t ref_hash = 0;
+        const char* ref_name = NULL;
+
+        rom_len = bench_assemble(filename, rom, sizeof(rom));
+        if(rom_len < 0 || machine_load(m, rom, (size_t)rom_len) < 0)
+        {
+            printf("[ERROR] >> '%s' can't be loaded\n", filename);
+            mismatches++;
+            continue;
+        }
+        name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+
+        for(r = 0; r < row_count; r++)
+        {
+            const bench_row_t* row = &rows[r];
+            bench_result_t result;
+            double mean = 0;
+            double var = 0;
+            int run;
+
+            result.inres = 0;
+            for(run = -warmup; run < runs; run++)
+            {
+                double elapsed = bench_run(row, m, rom, (size_t)rom_len, &result);
+
+                if(run >= 0)
+                {
+                    times[run] = elapsed;
+                }
+                if(result.inres < 0)
+                {
+                    break;
+                }
+            }
+            if(result.inres < 0)
+            {
+                printf("%-24s %-12s error %d at PC 0x%04X\n", name, row->name, result.inres, result.pc);
+                mismatches++;
+                continue;
+            }
+            for(run = 0; run < runs; run++)
+            {
+                mean += times[run] / runs;
+            }
+            for(run = 0; run < runs; run++)
+            {
+                var += (times[run] - mean) * (times[run] - mean) / runs;
+            }
+            qsort(times, (size_t)runs, sizeof(double), bench_compare);
+            printf("%-24s %-12s %12llu %9.3f %10.3f %10.3f %9.3f %9.2f\n", name, row->name, (unsigned long long)result.instrs,
+                (double)result.bus_accesses / (double)(result.instrs ? result.instrs : 1),
+                times[runs / 2] * 1e3, times[0] * 1e3, sqrt(var) * 1e3, (double)result.instrs / times[runs / 2] / 1e6);
+            if(result.predecoded && !result.kept_predecoded)
+            {
+                printf("%-24s %-12s dropped the predecoded entry page\n", name, row->name);
+                mismatches++;
+            }
+            if(ref_name == NULL)
+            {
+                ref_instrs = result.instrs;
+                ref_hash = result.output_hash;
+                ref_name = row->name;
+            }
+            else if(result.instrs != ref_instrs || result.output_hash != ref_hash)
+            {
+                printf("%-24s %-12s MISMATCH with %s\n", name, row->name, ref_name);
+                mismatches++;
+            }
+        }
+    }
+    machine_free(m);
+    if(defaults.gl_pathc > 0)
+    {
+        globfree(&defaults);
+    }
+    else
+    {
+        free(workloads);
+    }
+
+    return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,498 @@
+/* Differential conformance harness for NEC16 engines */
+/* Generated programs run in lockstep on the reference engine (the first of g_ENGINES) and a candidate, */
+/* registers, step results and the accesses of addr 0 - 2 are compared after every instruction, memory after every case */
+/* A case whose memory differs is run again comparing memory after every instruction, to find the first bad one */
+/* Cases are either random bytes or random instructions with edge case operands (shift counts >= 16, */
+/* division by 0, SP and PC close to 0xffff), any of them can be replayed with --seed=<case seed> --cases=1 */
+/* TIOS device cases run first, each on a TIOS machine that goes through the bus for everything (like -d) and on */
+/* one with the fast memory path and predecoded ROM, both have to give the expected output, registers and memory */
+
+#include <libgmnec16asm.h>
+#include "gmnec16engines.h"
+#include <nec16_systems/tios.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CONFORM_IO_LOG_CAP 64
+#define CONFORM_CODE_LEN 0x400
+#define CONFORM_TIOS_STEPS 100000
+
+typedef struct __CONFORM_TIOS_CASE
+{
+    const char* name;
+    int bank_count;
+    const char* source;
+    const char* output;
+} conform_tios_case_t;
+
+/* New device cases go here */
+const conform_tios_case_t g_TIOS_CASES[] = {
+    /* Patch the immediate of the next instruction, the predecoded entry has to go */
+    {"ROM patched in place", 0,
+        ".setapc 3\nujmp ::main\n.jlabel main\nset idx, ::patch\naddi idx, 2\nset r5, 0x42\nsm r5\n"
+        ".jlabel patch\nset acc, 0x41\nset idx, 2\nsm acc\nset idx, 0\nsm idx\n", "B"},
+    /* Window 5 can't show bank 0 (ROM), the patch lands in RAM and the register keeps bank 5 */
+    {"ROM bank in a switched window", 1,
+        ".setapc 3\nujmp ::main\n.jlabel main\nset r5, 0\nset idx, 0xff1a\nsm r5\nset idx, 0xff1b\nsm r5\n"
+        "set idx, ::patch\naddi idx, 0xa002\nset r5, 0x42\nsm r5\n"
+        ".jlabel patch\nset acc, 0x41\nset idx, 2\nsm acc\nset idx, 0xff1a\ngm acc\nset idx, 2\nsm acc\nset idx, 0\nsm idx\n", "A\x05"},
+    /* Window 6 shows window 5's memory, bank 0x34 doesn't exist and window 7 keeps bank 7 */
+    {"RAM bank in two windows", 1,
+        ".setapc 3\nujmp ::main\n.jlabel main\nset r5, 5\nset idx, 0xff1c\nsm r5\n"
+        "set r5, 0x43\nset idx, 0xc010\nsm r5\nset idx, 0xa010\ngm acc\nset idx, 2\nsm acc\n"
+        "set r5, 0x34\nset idx, 0xff1e\nsm r5\ngm acc\nset idx, 2\nsm acc\nset idx, 0\nsm idx\n", "C\x07"},
+};
+#define CONFORM_TIOS_CASE_COUNT (sizeof(g_TIOS_CASES) / sizeof(g_TIOS_CASES[0]))
+
+typedef struct __CONFORM_OPTIONS
+{
+    const engine_t* candidate;
+    uint64_t seed;
+    uint64_t cases;
+    uint64_t steps;
+    int mode; /* -1 both, 0 random bytes, 1 instructions */
+    int jobs;
+} conform_options_t;
+
+typedef struct __CONFORM_JOB
+{
+    const conform_options_t* opts;
+    int index;
+    uint64_t instrs;
+    uint64_t cases;
+    pthread_t thread;
+} conform_job_t;
+
+volatile int g_DIVERGED = 0;
+pthread_mutex_t g_REPORT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/* xorshift64* */
+uint64_t conform_rand(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+uint64_t conform_case_seed(uint64_t seed, uint64_t n)
+{
+    uint64_t state = (seed + n) * 0x9e3779b97f4a7c15ull + 1;
+
+    return conform_rand(&state) | 1;
+}
+
+/* Mostly values that hit edge cases, code addresses to keep jumps in the case */
+uint16_t conform_value(uint64_t* rng, uint16_t code_base)
+{
+    static const uint16_t edges[] = {0, 1, 2, 3, 15, 16, 17, 0x7fff, 0x8000, 0x8003, 0xfffe, 0xffff, 0xff00, 0x00ff};
+    uint64_t r = conform_rand(rng);
+
+    switch(r % 8)
+    {
+        case 0:
+        case 1:
+            return edges[(r >> 8) % (sizeof(edges) / sizeof(edges[0]))];
+        case 2:
+        case 3:
+            return (uint16_t)(code_base + ((r >> 8) % CONFORM_CODE_LEN));
+        case 4:
+            return (uint16_t)(0x8003 + ((r >> 8) % 0x100));
+        default:
+            return (uint16_t)(r >> 16);
+    }
+}
+
+/* Fill the image of ref with a case, code at code_base */
+void conform_generate(machine_t* ref, uint64_t case_seed, int mode, uint16_t* regs)
+{
+    uint64_t rng = case_seed;
+    uint16_t code_base = 3;
+    uint32_t i;
+
+    memset(ref->image, 0, 0x10000);
+    if(mode < 0)
+    {
+        mode = (int)(conform_rand(&rng) & 1);
+    }
+    /* Some cases run at the very end of memory, where fetches wrap */
+    if(conform_rand(&rng) % 16 == 0)
+    {
+        code_base = (uint16_t)(0x10000 - CONFORM_CODE_LEN);
+    }
+    for(i = 0; i < CONFORM_CODE_LEN; i += 4)
+    {
+        uint64_t r = conform_rand(&rng);
+        uint8_t* b = ref->image + (uint16_t)(code_base + i);
+        uint16_t imm = conform_value(&rng, code_base);
+
+        b[0] = (uint8_t)r;
+        b[1] = (uint8_t)(r >> 8);
+        if(mode == 1)
+        {
+            b[2] = (uint8_t)(imm & 0xff);
+            b[3] = (uint8_t)(imm >> 8);
+        }
+        else
+        {
+            b[2] = (uint8_t)(r >> 16);
+            b[3] = (uint8_t)(r >> 24);
+        }
+    }
+    /* Data for GM/LDW and friends */
+    for(i = 0; i < 0x100; i++)
+    {
+        ref->image[0x8003 + i] = (uint8_t)conform_rand(&rng);
+    }
+    for(i = 0; i < 0x10; i++)
+    {
+        regs[i] = (mode == 1) ? conform_value(&rng, code_base) : (uint16_t)conform_rand(&rng);
+    }
+    regs[GM_NEC16_PC] = code_base;
+}
+
+void conform_start(machine_t* m, const engine_t* engine, const uint16_t* regs)
+{
+    machine_reset(m, engine);
+    memcpy(m->cpu.regs, regs, sizeof(m->cpu.regs));
+}
+
+/* Returns the first differing address or -1 */
+long conform_memory_diff(machine_t* a, machine_t* b)
+{
+    long addr;
+
+    if(memcmp(a->memory, b->memory, 0x10000) == 0)
+    {
+        return -1;
+    }
+    for(addr = 0; addr < 0x10000; addr++)
+    {
+        if(a->memory[addr] != b->memory[addr])
+        {
+            return addr;
+        }
+    }
+    return -1;
+}
+
+void conform_report(const conform_options_t* opts, machine_t* ref, machine_t* cand, uint64_t case_seed, uint64_t step,
+    uint16_t pc, int ref_res, int cand_res, const char* what)
+{
+    int i;
+
+    pthread_mutex_lock(&g_REPORT_LOCK);
+    if(g_DIVERGED)
+    {
+        pthread_mutex_unlock(&g_REPORT_LOCK);
+        return;
+    }
+    g_DIVERGED = 1;
+    printf("DIVERGENCE (%s) between %s and %s\n", what, g_ENGINES[0].name, opts->candidate->name);
+    printf("  case seed 0x%016llx, step %llu, PC 0x%04X, bytes %02X %02X %02X %02X\n", (unsigned long long)case_seed,
+        (unsigned long long)step, pc, ref->memory[pc], ref->memory[(uint16_t)(pc + 1)], ref->memory[(uint16_t)(pc + 2)], ref->memory[(uint16_t)(pc + 3)]);
+    printf("  result %d vs %d\n", ref_res, cand_res);
+    for(i = 0; i < 0x10; i++)
+    {
+        printf("  r%-2d 0x%04X %s 0x%04X\n", i, ref->cpu.regs[i], ref->cpu.regs[i] == cand->cpu.regs[i] ? "==" : "!=", cand->cpu.regs[i]);
+    }
+    if(conform_memory_diff(ref, cand) >= 0)
+    {
+        long addr = conform_memory_diff(ref, cand);
+        printf("  memory 0x%04lX: 0x%02X vs 0x%02X\n", addr, ref->memory[addr], cand->memory[addr]);
+    }
+    printf("  I/O accesses: %zu vs %zu\n", ref->io_log_len, cand->io_log_len);
+    for(i = 0; i < (int)ref->io_log_len || i < (int)cand->io_log_len; i++)
+    {
+        printf("    %08X %s %08X\n", i < (int)ref->io_log_len ? ref->io_log[i] : 0, "|", i < (int)cand->io_log_len ? cand->io_log[i] : 0);
+    }
+    printf("  replay: --engine=%s --seed=0x%016llx --cases=1 --steps=%llu --mode=%d\n", opts->candidate->name,
+        (unsigned long long)case_seed, (unsigned long long)opts->steps, opts->mode);
+    fflush(stdout);
+    pthread_mutex_unlock(&g_REPORT_LOCK);
+}
+
+/* Returns the number of instructions run, or 0 after reporting a divergence */
+uint64_t conform_case(const conform_options_t* opts, machine_t* ref, machine_t* cand, uint64_t case_seed, int check_memory)
+{
+    uint16_t regs[0x10];
+    uint64_t step;
+
+    conform_generate(ref, case_seed, opts->mode, regs);
+    memcpy(cand->image, ref->image, 0x10000);
+    /* Only the code at addr 3 can be in the predecoded part, everything else stays 0 from case to case */
+    machine_predecode_range(cand, 0, 3 + CONFORM_CODE_LEN + 4);
+    conform_start(ref, &g_ENGINES[0], regs);
+    conform_start(cand, opts->candidate, regs);
+
+    for(step = 0; step < opts->steps; step++)
+    {
+        uint16_t pc = ref->cpu.regs[GM_NEC16_PC];
+        int ref_res;
+        int cand_res;
+
+        ref->io_log_len = 0;
+        cand->io_log_len = 0;
+        ref_res = gmnec16_instr_step(&ref->cpu);
+        cand_res = gmnec16_instr_step(&cand->cpu);
+        if(ref_res != cand_res || memcmp(ref->cpu.regs, cand->cpu.regs, sizeof(ref->cpu.regs)) != 0
+            || ref->io_log_len != cand->io_log_len || memcmp(ref->io_log, cand->io_log, ref->io_log_len * sizeof(uint32_t)) != 0)
+        {
+            conform_report(opts, ref, cand, case_seed, step, pc, ref_res, cand_res, "registers, result or I/O");
+            return 0;
+        }
+        if(check_memory && conform_memory_diff(ref, cand) >= 0)
+        {
+            conform_report(opts, ref, cand, case_seed, step, pc, ref_res, cand_res, "memory");
+            return 0;
+        }
+        if(ref_res < 0 || ref->exit_flag)
+        {
+            step++;
+            break;
+        }
+    }
+    if(!check_memory && conform_memory_diff(ref, cand) >= 0)
+    {
+        /* Find the instruction that made the difference */
+        return conform_case(opts, ref, cand, case_seed, 1);
+    }
+    return step;
+}
+
+/* Run a device case on a headless TIOS machine, returns the last step result */
+int conform_tios_run(computer_t* com, const conform_tios_case_t* c, const uint8_t* rom, size_t rom_len, int fast)
+{
+    tios_config_t conf;
+    core_t* core;
+    uint64_t steps;
+    int inres = 0;
+
+    tios_config_init(&conf);
+    conf.rom_data = rom;
+    conf.rom_len = rom_len;
+    conf.bank_count = c->bank_count;
+    conf.headless = 1;
+    conf.bus_only = !fast;
+    if(tios_init(com, &conf) < 0)
+    {
+        return -1;
+    }
+    core = &com->cores[0];
+    if(!fast)
+    {
+        /* Like -d, fetches go through the bus too */
+        gmnec16_map_decoded(&core->cpu, 0, 0x10000, NULL);
+    }
+    for(steps = 0; steps < CONFORM_TIOS_STEPS && com->exit_flag != 1; steps += TIOS_STATS_SLICE)
+    {
+        inres = tios_run(com, core, TIOS_STATS_SLICE);
+    }
+    return inres;
+}
+
+/* Returns the number of device cases that failed */
+int conform_tios_cases()
+{
+    uint8_t rom[0x8000];
+    int failed = 0;
+    size_t n;
+
+    for(n = 0; n < CONFORM_TIOS_CASE_COUNT; n++)
+    {
+        const conform_tios_case_t* c = &g_TIOS_CASES[n];
+        computer_t ref;
+        computer_t cand;
+        GM_NEC16_Asm as;
+        size_t rom_len = 0;
+        size_t out_len = strlen(c->output);
+        const char* what = NULL;
+        int ref_res;
+        int cand_res;
+        int i;
+
+        gmnec16asm_init(&as);
+        if(gmnec16asm_assemble(&as, c->source, strlen(c->source), 3, rom, sizeof(rom), &rom_len) != GM_NEC16_ASM_OK)
+        {
+            printf("[ERROR] >> TIOS case '%s' line %lu: %s\n", c->name, as.error.line, as.error.message);
+            gmnec16asm_free(&as);
+            failed++;
+            continue;
+        }
+        gmnec16asm_free(&as);
+        memset(&ref, 0, sizeof(ref));
+        memset(&cand, 0, sizeof(cand));
+        ref_res = conform_tios_run(&ref, c, rom, rom_len, 0);
+        cand_res = conform_tios_run(&cand, c, rom, rom_len, 1);
+        if(ref_res != cand_res || memcmp(ref.cores[0].cpu.regs, cand.cores[0].cpu.regs, sizeof(ref.cores[0].cpu.regs)) != 0)
+        {
+            what = "registers or result";
+        }
+        else if(memcmp(ref.memory, cand.memory, 0x10000) != 0 || memcmp(ref.bank_regs, cand.bank_regs, sizeof(ref.bank_regs)) != 0
+            || (ref.bank_count > 0 && memcmp(ref.banks, cand.banks, (size_t)ref.bank_count * TIOS_BANK_SIZE) != 0))
+        {
+            what = "memory or banks";
+        }
+        else if(ref.output_len != out_len || cand.output_len != out_len || memcmp(ref.output, c->output, out_len) != 0
+            || memcmp(cand.output, c->output, out_len) != 0)
+        {
+            what = "output";
+        }
+        if(what != NULL)
+        {
+            printf("DIVERGENCE (%s) in TIOS case '%s' between the bus and the fast path\n", what, c->name);
+            printf("  result %d vs %d, PC 0x%04X vs 0x%04X\n", ref_res, cand_res, ref.cores[0].cpu.regs[GM_NEC16_PC], cand.cores[0].cpu.regs[GM_NEC16_PC]);
+            printf("  output (%zu bytes expected):", out_len);
+            for(i = 0; i < (int)ref.output_len || i < (int)cand.output_len; i++)
+            {
+                printf(" %02X|%02X", i < (int)ref.output_len ? ref.output[i] : 0, i < (int)cand.output_len ? cand.output[i] : 0);
+            }
+            printf("\n");
+            failed++;
+        }
+        tios_free(&ref);
+        tios_free(&cand);
+    }
+    return failed;
+}
+
+void* conform_thread(void* arg)
+{
+    conform_job_t* job = (conform_job_t*)arg;
+    const conform_options_t* opts = job->opts;
+    machine_t* ref = machine_alloc();
+    machine_t* cand = machine_alloc();
+    uint64_t n;
+
+    if(ref == NULL || cand == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        g_DIVERGED = 1;
+        return NULL;
+    }
+    ref->io_log = malloc(CONFORM_IO_LOG_CAP * sizeof(uint32_t));
+    cand->io_log = malloc(CONFORM_IO_LOG_CAP * sizeof(uint32_t));
+    ref->io_log_cap = CONFORM_IO_LOG_CAP;
+    cand->io_log_cap = CONFORM_IO_LOG_CAP;
+    machine_predecode(cand);
+    for(n = (uint64_t)job->index; n < opts->cases && !g_DIVERGED; n += (uint64_t)opts->jobs)
+    {
+        /* --cases=1 replays --seed as it is */
+        uint64_t case_seed = (opts->cases == 1) ? opts->seed : conform_case_seed(opts->seed, n);
+        uint64_t run = conform_case(opts, ref, cand, case_seed, 0);
+
+        if(run == 0 && g_DIVERGED)
+        {
+            break;
+        }
+        job->instrs += run;
+        job->cases++;
+    }
+    free(ref->io_log);
+    free(cand->io_log);
+    machine_free(ref);
+    machine_free(cand);
+    return NULL;
+}
+
+int main(int args, char** argv)
+{
+    conform_options_t opts;
+    conform_job_t* jobs;
+    uint64_t instrs = 0;
+    uint64_t cases = 0;
+    struct timespec start;
+    struct timespec end;
+    double seconds;
+    int tios_failed;
+    int i;
+
+    opts.candidate = &g_ENGINES[ENGINE_COUNT - 1];
+    opts.seed = 1;
+    opts.cases = 10000;
+    opts.steps = 10000;
+    opts.mode = -1;
+    opts.jobs = 1;
+
+    /* gmnec16conform [--engine=<candidate>] [--seed=<n>] [--cases=<n>] [--steps=<per case>] [--mode=<0|1>] [--jobs=<threads>] */
+    for(i = 1; i < args; i++)
+    {
+        if(strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            opts.candidate = engine_find(argv[i] + 9);
+            if(opts.candidate == NULL)
+            {
+                printf("[ERROR] >> Unknown engine '%s'\n", argv[i] + 9);
+                return 1;
+            }
+        }
+        else if(strncmp(argv[i], "--seed=", 7) == 0)
+        {
+            opts.seed = strtoull(argv[i] + 7, NULL, 0);
+        }
+        else if(strncmp(argv[i], "--cases=", 8) == 0)
+        {
+            opts.cases = strtoull(argv[i] + 8, NULL, 0);
+        }
+        else if(strncmp(argv[i], "--steps=", 8) == 0)
+        {
+            opts.steps = strtoull(argv[i] + 8, NULL, 0);
+        }
+        else if(strncmp(argv[i], "--mode=", 7) == 0)
+        {
+            opts.mode = atoi(argv[i] + 7);
+            if(opts.mode < -1 || opts.mode > 1)
+            {
+                printf("[ERROR] >> The mode has to be 0 (random bytes), 1 (instructions) or -1 (both)\n");
+                return 1;
+            }
+        }
+        else if(strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            opts.jobs = atoi(argv[i] + 7);
+            if(opts.jobs <= 0)
+            {
+                printf("[ERROR] >> At least 1 job is needed\n");
+                return 1;
+            }
+        }
+        else
+        {
+            printf("[ERROR] >> Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    tios_failed = conform_tios_cases();
+    printf("TIOS bus vs fast path: %d device cases%s\n", (int)CONFORM_TIOS_CASE_COUNT, tios_failed ? ", DIVERGED" : "");
+
+    jobs = calloc((size_t)opts.jobs, sizeof(conform_job_t));
+    if(jobs == NULL)
+    {
+        printf("[ERROR] >> Out of memory\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < opts.jobs; i++)
+    {
+        jobs[i].opts = &opts;
+        jobs[i].index = i;
+        if(pthread_create(&jobs[i].thread, NULL, conform_thread, &jobs[i]) != 0)
+        {
+            printf("[ERROR] >> Can't start job %d\n", i);
+            return 1;
+        }
+    }
+    for(i = 0; i < opts.jobs; i++)
+    {
+        pthread_join(jobs[i].thread, NULL);
+        instrs += jobs[i].instrs;
+        cases += jobs[i].cases;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%s vs %s: %llu cases, %llu instructions in %.2f s (%.2f M/s)%s\n", g_ENGINES[0].name, opts.candidate->name,
+        (unsigned long long)cases, (unsigned long long)instrs, seconds, (double)instrs / seconds / 1e6, g_DIVERGED ? ", DIVERGED" : "");
+    return (g_DIVERGED || tios_failed) ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/* NEC16 engines for the tools, the ways a core can run one TIOS-like machine */
+/* addr 0 - exit, addr 1 - input (reads 0, 1, 2, ...), addr 2 - output (counted and hashed instead of printed) */
+/* ROM images are loaded at addr 3 and start there, like raw TIOS images */
+
+#ifndef GMNEC16ENGINES_HEADER
+#define GMNEC16ENGINES_HEADER
+
+#include <libgmnec16.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Same as TIOS_DECODED_LEN */
+#define ENGINE_DECODED_LEN 0x8000
+
+typedef struct __MACHINE
+{
+    GM_NEC16 cpu;
+    uint8_t* memory; /* 64 KiB, indexed by address (0 - 2 unused) */
+    uint8_t* image; /* Memory right after loading */
+    GM_NEC16_Decoded* decoded; /* Predecoded image of 0 - ENGINE_DECODED_LEN - 1 */
+    uint64_t bus_reads;
+    uint64_t bus_writes;
+    uint64_t output_bytes;
+    uint64_t output_hash; /* FNV-1a of the output */
+    uint8_t input_next;
+    uint8_t exit_flag;
+    uint32_t* io_log; /* Accesses of addr 0 - 2 when not NULL, see ENGINE_IO_ENTRY */
+    size_t io_log_len;
+    size_t io_log_cap; /* Later accesses are dropped */
+} machine_t;
+
+#define ENGINE_IO_ENTRY(write, addr, val) (((uint32_t)(write) << 24) | ((uint32_t)(addr) << 8) | (uint32_t)(val))
+
+void machine_log_io(machine_t* m, int write, uint16_t addr, uint8_t val)
+{
+    if(m->io_log != NULL && m->io_log_len < m->io_log_cap)
+    {
+        m->io_log[m->io_log_len++] = ENGINE_IO_ENTRY(write, addr, val);
+    }
+}
+
+/* Sets up the core of a machine that was just reset */
+typedef void(*engine_setup_func)(machine_t*);
+
+typedef struct __ENGINE
+{
+    const char* name;
+    engine_setup_func setup;
+} engine_t;
+
+int machine_bus_read(void* data, uint16_t addr, uint8_t* ib)
+{
+    machine_t* m = (machine_t*)data;
+
+    m->bus_reads++;
+    switch(addr)
+    {
+        case 0: machine_log_io(m, 0, addr, 0); return GM_NEC16_ADDRINVALID;
+        case 2: machine_log_io(m, 0, addr, 0); return GM_NEC16_ADDRINVALID;
+        case 1: *ib = m->input_next++; machine_log_io(m, 0, addr, *ib); break;
+        default: *ib = m->memory[addr]; break;
+    }
+    return 0;
+}
+
+int machine_bus_write(void* data, uint16_t addr, uint8_t ob)
+{
+    machine_t* m = (machine_t*)data;
+
+    m->bus_writes++;
+    switch(addr)
+    {
+        case 0: machine_log_io(m, 1, addr, ob); m->exit_flag = 1; break;
+        case 1: machine_log_io(m, 1, addr, ob); return GM_NEC16_ADDRINVALID;
+        case 2:
+            machine_log_io(m, 1, addr, ob);
+            m->output_bytes++;
+            m->output_hash = (m->output_hash ^ ob) * 0x100000001b3ull;
+            break;
+        default: m->memory[addr] = ob; break;
+    }
+    return 0;
+}
+
+/* Every fetch and memory access goes through the bus */
+void engine_setup_bus(machine_t* m)
+{
+    gmnec16_map_pages(&m->cpu, 0, 0x10000, NULL);
+    gmnec16_map_decoded(&m->cpu, 0, 0x10000, NULL);
+}
+
+/* Fast memory path for the whole pages after the I/O addresses, like TIOS */
+void engine_setup_pages(machine_t* m)
+{
+    engine_setup_bus(m);
+    gmnec16_map_pages(&m->cpu, 3, 0x10000 - 3, m->memory + 3);
+}
+
+/* Fast memory path and predecoded ROM, like TIOS */
+void engine_setup_predecoded(machine_t* m)
+{
+    engine_setup_pages(m);
+    gmnec16_map_decoded(&m->cpu, 0, ENGINE_DECODED_LEN, m->decoded);
+}
+
+/* New engines go here, the first one is the reference */
+const engine_t g_ENGINES[] = {
+    {"bus", engine_setup_bus},
+    {"pages", engine_setup_pages},
+    {"predecoded", engine_setup_predecoded},
+};
+#define ENGINE_COUNT (sizeof(g_ENGINES) / sizeof(g_ENGINES[0]))
+
+const engine_t* engine_find(const char* name)
+{
+    size_t i;
+
+    for(i = 0; i < ENGINE_COUNT; i++)
+    {
+        if(strcmp(g_ENGINES[i].name, name) == 0)
+        {
+            return &g_ENGINES[i];
+        }
+    }
+    return NULL;
+}
+
+machine_t* machine_alloc()
+{
+    machine_t* m = calloc(1, sizeof(machine_t));
+
+    if(m == NULL)
+    {
+        return NULL;
+    }
+    m->memory = calloc(1, 0x10000);
+    m->image = calloc(1, 0x10000);
+    m->decoded = calloc(ENGINE_DECODED_LEN, sizeof(GM_NEC16_Decoded));
+    if(m->memory == NULL || m->image == NULL || m->decoded == NULL)
+    {
+        free(m->memory);
+        free(m->image);
+        free(m->decoded);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void machine_free(machine_t* m)
+{
+    free(m->memory);
+    free(m->image);
+    free(m->decoded);
+    free(m);
+}
+
+/* Predecode start - end - 1 of the image, after it was changed directly */
+void machine_predecode_range(machine_t* m, uint32_t start, uint32_t end)
+{
+    uint32_t addr;
+
+    for(addr = start; addr < end && addr < ENGINE_DECODED_LEN; addr++)
+    {
+        if(addr < 3)
+        {
+            memset(&m->decoded[addr], 0, sizeof(GM_NEC16_Decoded));
+            m->decoded[addr].opcode = GM_NEC16_NOT_DECODED;
+            continue;
+        }
+        gmnec16_predecode(&m->decoded[addr], &m->image[addr]);
+    }
+}
+
+void machine_predecode(machine_t* m)
+{
+    machine_predecode_range(m, 0, ENGINE_DECODED_LEN);
+}
+
+/* Put a ROM image at addr 3, returns -1 when it doesn't fit */
+int machine_load(machine_t* m, const uint8_t* rom, size_t len)
+{
+    if(len > 0x10000 - 3)
+    {
+        return -1;
+    }
+    memset(m->image, 0, 0x10000);
+    memcpy(m->image + 3, rom, len);
+    machine_predecode(m);
+    return 0;
+}
+
+/* Back to the state right after loading, run by engine */
+void machine_reset(machine_t* m, const engine_t* engine)
+{
+    memcpy(m->memory, m->image, 0x10000);
+    gmnec16_init(&m->cpu, machine_bus_read, machine_bus_write, (void*)m);
+    m->cpu.regs[GM_NEC16_PC] = 3;
+    m->bus_reads = 0;
+    m->bus_writes = 0;
+    m->output_bytes = 0;
+    m->output_hash = 0xcbf29ce484222325ull;
+    m->input_next = 0;
+    m->exit_flag = 0;
+    m->io_log_len = 0;
+    engine->setup(m);
+}
+
+/* Run until the machine exits, an error or max_instrs (0 for no limit), HLT just goes on */
+/* Returns the last result of gmnec16_instr_step, *instrs is the number of instructions run */
+int machine_run(machine_t* m, uint64_t max_instrs, uint64_t* instrs)
+{
+    int inres = 0;
+    uint64_t count = 0;
+
+    while(m->exit_flag == 0 && (max_instrs == 0 || count < max_instrs))
+    {
+        inres = gmnec16_instr_step(&m->cpu);
+        count++;
+        if(inres < 0)
+        {
+            break;
+        }
+    }
+    *instrs = count;
+    return inres;
+}
+
+#endif
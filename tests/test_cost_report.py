@@ -0,0 +1,84 @@
+#!/usr/bin/python3
+
+# Checks of the assembler's static cost report (--cost-report), run with
+#   python3 -m unittest discover tests
+
+import os
+import subprocess
+import sys
+import tempfile
+import unittest
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# second isn't a call target and starts right after the ret of first
+ADJACENT_ROUTINES = """
+.setapc 3
+ujmp ::main
+.jlabel first
+calla ::helper
+ret
+.jlabel second
+calla ::helper
+ret
+.jlabel helper
+ret
+.jlabel main
+set sp, 0x9000
+calla ::first
+set idx, ::second
+callr idx
+set idx, 0
+sm idx
+"""
+
+# hlt resumes at the next instruction, woke is reached by falling through
+HLT_WAIT = """
+.setapc 3
+ujmp ::main
+.jlabel waiter
+hlt
+.jlabel woke
+calla ::helper
+ret
+.jlabel helper
+ret
+.jlabel main
+set sp, 0x9000
+calla ::waiter
+set idx, 0
+sm idx
+"""
+
+def cost_report(source):
+    with tempfile.TemporaryDirectory() as tmp:
+        asm_name = os.path.join(tmp, "prog.asm")
+        with open(asm_name, "w") as asm_file:
+            asm_file.write(source)
+        result = subprocess.run([sys.executable, os.path.join(REPO, "gmnec16asm.py"), asm_name, os.path.join(tmp, "prog.bin"), "3",
+            "--cost-report=-"], capture_output=True, text=True, check=True)
+    sections = {}
+    name = None
+    for line in result.stdout.splitlines():
+        if line.startswith("[") and line.endswith("]"):
+            name = line[1:-1]
+            sections[name] = []
+        elif name is not None and line != "":
+            sections[name].append(line)
+    return sections
+
+class CostReportTest(unittest.TestCase):
+    def test_calls_after_stop_start_new_routine(self):
+        callers = [line.split(" -> ")[0] for line in cost_report(ADJACENT_ROUTINES)["calls"]]
+        self.assertEqual(callers, ["first", "second", "main"])
+
+    def test_hlt_falls_through(self):
+        report = cost_report(HLT_WAIT)
+        callers = [line.split(" -> ")[0] for line in report["calls"]]
+        self.assertEqual(callers, ["waiter", "main"])
+        waiter = [line for line in report["labels"] if " waiter: " in line]
+        self.assertEqual(len(waiter), 1)
+        self.assertIn("(inclusive ", waiter[0])
+
+if __name__ == "__main__":
+    unittest.main()